@@ -199,18 +199,25 @@ IOReturn ACPIProbe::woorkloopTimerEvent(void)
     return kIOReturnSuccess;
 }
 
+bool ACPIProbe::shouldWaitForKeyStore()
+{
+    return false;
+}
+
 bool ACPIProbe::start(IOService * provider)
 {
     ACPISensorsDebugLog("starting...");
-    
-	if (!super::start(provider))
-        return false;
-    
+
 	if (!(acpiDevice = OSDynamicCast(IOACPIPlatformDevice, provider))) {
         ACPISensorsFatalLog("ACPI device not ready");
         return false;
     }
-    
+
+	return super::start(provider);
+}
+
+bool ACPIProbe::startWithKeyStore(IOService * provider)
+{
     // Try to load configuration from info.plist first
     if (OSDictionary *configuration = getConfigurationNode())
     {
@@ -85,7 +85,8 @@ private:
     IOReturn                woorkloopTimerEvent(void);
 
 protected:
-    
+    virtual bool            shouldWaitForKeyStore();
+    virtual bool            startWithKeyStore(IOService *provider);
     
 public:
     virtual bool			start(IOService *provider);
@@ -162,6 +162,8 @@ bool ACPISensors::willReadSensorValue(FakeSMCSensor *sensor, float *outValue)
     OSString *method = NULL;
     
     if (sensor->getIndex() < methods->getCount() && (method = (OSString*)methods->getObject(sensor->getIndex()))) {
+        accountHardwareAccess(kFakeSMCACPIAccess);
+
         if (kIOReturnSuccess == acpiDevice->evaluateInteger(method->getCStringNoCopy(), &value)) {
             switch(sensor->getGroup()) {
                 case kFakeSMCTemperatureSensor:                    
@@ -192,18 +194,25 @@ bool ACPISensors::willReadSensorValue(FakeSMCSensor *sensor, float *outValue)
     return true;
 }
 
+bool ACPISensors::shouldWaitForKeyStore()
+{
+    return false;
+}
+
 bool ACPISensors::start(IOService * provider)
 {
     ACPISensorsDebugLog("starting...");
-    
-	if (!super::start(provider))
-        return false;
 
 	if (!(acpiDevice = OSDynamicCast(IOACPIPlatformDevice, provider))) {
         ACPISensorsFatalLog("ACPI device not ready");
         return false;
     }
 
+	return super::start(provider);
+}
+
+bool ACPISensors::startWithKeyStore(IOService * provider)
+{
     methods = OSArray::withCapacity(0);
     
     // Try to load configuration provided by ACPI device
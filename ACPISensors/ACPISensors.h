@@ -39,6 +39,8 @@ private:
     void                    addSensorsFromArray(OSArray *array, FakeSMCSensorCategory category);
     
 protected:
+    virtual bool           shouldWaitForKeyStore();
+    virtual bool           startWithKeyStore(IOService *provider);
     virtual bool           willReadSensorValue(FakeSMCSensor *sensor, float *outValue);
     
 public:
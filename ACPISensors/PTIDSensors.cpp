@@ -38,6 +38,8 @@ bool PTIDSensors::updateTemperatures()
 {
     OSObject *object;
     
+    accountHardwareAccess(kFakeSMCACPIAccess);
+
     if (kIOReturnSuccess == acpiDevice->evaluateObject("TSDD", &object) && object) {
 
         OSSafeRelease(temperatures);
@@ -57,6 +59,8 @@ bool PTIDSensors::updateTachometers()
 {
     OSObject *object;
     
+    accountHardwareAccess(kFakeSMCACPIAccess);
+
     if (kIOReturnSuccess == acpiDevice->evaluateObject("OSDD", &object) && object) {
 
         OSSafeRelease(tachometers);
@@ -184,11 +188,13 @@ void PTIDSensors::parseTachometerName(OSString *name, OSString *title, UInt32 in
         this->addTachometer(index, title ? title->getCStringNoCopy() : NULL);
 }
 
+bool PTIDSensors::shouldWaitForKeyStore()
+{
+    return false;
+}
+
 bool PTIDSensors::start(IOService * provider)
 {
-	if (!super::start(provider))
-        return false;
-    
 	acpiDevice = (IOACPIPlatformDevice *)provider;
 	
 	if (!acpiDevice) {
@@ -196,6 +202,11 @@ bool PTIDSensors::start(IOService * provider)
         return false;
     }
     
+	return super::start(provider);
+}
+
+bool PTIDSensors::startWithKeyStore(IOService * provider)
+{
     if (OSDictionary *configuration = getConfigurationNode()) {
         OSBoolean* disable = OSDynamicCast(OSBoolean, configuration->getObject("DisableDevice"));
         if (disable && disable->isTrue())
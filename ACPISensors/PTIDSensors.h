@@ -55,6 +55,8 @@ private:
     void                    parseTachometerName(OSString *name, OSString *title, UInt32 index);
     
 protected:
+    virtual bool           shouldWaitForKeyStore();
+    virtual bool           startWithKeyStore(IOService *provider);
     virtual bool           willReadSensorValue(FakeSMCSensor *sensor, float *outValue);
     
 public:
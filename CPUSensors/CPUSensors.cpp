@@ -130,12 +130,15 @@ static inline UInt8 get_cpu_number()
 
 static UInt8  cpu_tjmax[kCPUSensorsMaxCpus];
 
+static volatile SInt32 cpu_msr_reads;  // reads of the rendezvous below, the caller accounts them
+
 static void read_cpu_tjmax(void *magic)
 {
     UInt32 number = get_cpu_number();
 
     if (number < kCPUSensorsMaxCpus) {
         cpu_tjmax[number] = (rdmsr64(MSR_IA32_TEMP_TARGET) >> 16) & 0xFF;
+        OSIncrementAtomic(&cpu_msr_reads);
     }
 }
 
@@ -147,6 +150,7 @@ static void read_cpu_rapl(void *magic)
 
     if (number == 0) {
         cpu_rapl = rdmsr64(MSR_RAPL_POWER_UNIT);
+        OSIncrementAtomic(&cpu_msr_reads);
     }
 }
 
@@ -159,14 +163,17 @@ static void update_counters(void *arg)
     if (number < kCPUSensorsMaxCpus) {
 
         UInt64 msr;
+        SInt32 reads = 0;
 
         if (bit_get(counters->event_flags, kCPUSensorsThermalCore)) {
+            reads++;
             if ((msr = rdmsr64(MSR_IA32_THERM_STS)) & 0x80000000) {
                 counters->thermal_status[number] = (msr >> 16) & 0x7F;
             }
         }
 
         if (number == 0 && bit_get(counters->event_flags, kCPUSensorsThermalPackage)) {
+            reads++;
             if ((msr = rdmsr64(MSR_IA32_PACKAGE_THERM_STATUS)) & 0x80000000) {
                 counters->thermal_status_package = (msr >> 16) & 0x7F;
             }
@@ -175,6 +182,7 @@ static void update_counters(void *arg)
         if (bit_get(counters->event_flags, kCPUSensorsMultiplierCore) || (number == 0 && bit_get(counters->event_flags, kCPUSensorsMultiplierPackage))) {
 
             counters->perf_status[number] =  rdmsr64(MSR_IA32_PERF_STS) & 0xFFFF;
+            reads++;
 
             // Performance counters
             if (counters->update_perf_counters) {
@@ -182,6 +190,7 @@ static void update_counters(void *arg)
                 counters->mperf_before[number] = counters->mperf_after[number];
                 counters->aperf_after[number] = rdmsr64(MSR_IA32_APERF);
                 counters->mperf_after[number] = rdmsr64(MSR_IA32_MPERF);
+                reads += 2;
             }
         }
 
@@ -191,6 +200,7 @@ static void update_counters(void *arg)
             counters->urc_before[number] = counters->urc_after[number];
             counters->utc_after[number] = rdmpc64(0x40000001);
             counters->urc_after[number] = rdmpc64(0x40000002);
+            reads += 2;
         }
 
         // Energy counters
@@ -199,9 +209,12 @@ static void update_counters(void *arg)
                 if (bit_get(counters->event_flags, cpu_energy_flgs[index])) {
                     counters->energy_before[index] = counters->energy_after[index];
                     counters->energy_after[index] = rdmsr64(cpu_energy_msrs[index]);
+                    reads++;
                 }
             }
         }
+
+        OSAddAtomic(reads, &counters->msr_reads);
     }
 }
 
@@ -338,6 +351,10 @@ IOReturn CPUSensors::timerEventAction()
 
         mp_rendezvous_no_intrs(update_counters, &counters);
 
+        // Rendezvous returns once every CPU is done
+        accountHardwareAccess(kFakeSMCMSRAccess, counters.msr_reads);
+        counters.msr_reads = 0;
+
         calculateTimedCounters();
 
         if (timerEventDeltaTime == 0 || timerEventDeltaTime > 10.0f) {
@@ -431,11 +448,13 @@ FakeSMCSensor *CPUSensors::addSensor(const char *key, const char *type, UInt8 si
     return result;
 }
 
-bool CPUSensors::start(IOService *provider)
+bool CPUSensors::shouldWaitForKeyStore()
 {
-    if (!super::start(provider)) 
-        return false;
+    return false;
+}
 
+bool CPUSensors::start(IOService *provider)
+{
     // Pre-checks
     
     cpuid_set_info();
@@ -450,6 +469,11 @@ bool CPUSensors::start(IOService *provider)
 		return false;
 	}
 
+    return super::start(provider);
+}
+
+bool CPUSensors::startWithKeyStore(IOService *provider)
+{
     // Init timer
 
     if (IOWorkLoop *workloop = getWorkLoop()) {
@@ -553,6 +577,7 @@ bool CPUSensors::start(IOService *provider)
                     case CPUID_MODEL_PENRYN: // Intel Core (45nm)
                                              // Mobile CPU ?
                         if (!platform) platform = OSData::withBytes("M82\0\0\0\0\0", 8);
+                        accountHardwareAccess(kFakeSMCMSRAccess);
                         if (rdmsr64(0x17) & (1<<28))
                             cpu_tjmax[0] = 105;
                         else
@@ -660,6 +685,10 @@ bool CPUSensors::start(IOService *provider)
                 break;
             }
         }
+
+        // Rendezvous returns once every CPU is done
+        accountHardwareAccess(kFakeSMCMSRAccess, cpu_msr_reads);
+        cpu_msr_reads = 0;
 	}
 
     // bus clock
@@ -740,6 +769,7 @@ bool CPUSensors::start(IOService *provider)
         case CPUFAMILY_INTEL_HASWELL:
         case CPUFAMILY_INTEL_BROADWELL:
         case CPUFAMILY_INTEL_SKYLAKE:
+            accountHardwareAccess(kFakeSMCMSRAccess);
             if ((baseMultiplier = (rdmsr64(MSR_PLATFORM_INFO) >> 8) & 0xFF)) {
                 //mp_rendezvous_no_intrs(init_cpu_turbo_counters, NULL);
                 HWSensorsInfoLog("base CPU multiplier is %d", baseMultiplier);
@@ -756,6 +786,7 @@ bool CPUSensors::start(IOService *provider)
         case CPUFAMILY_INTEL_WESTMERE:
         case CPUFAMILY_INTEL_SANDYBRIDGE:
         case CPUFAMILY_INTEL_IVYBRIDGE:
+            accountHardwareAccess(kFakeSMCMSRAccess);
             if ((baseMultiplier = (rdmsr64(MSR_PLATFORM_INFO) >> 8) & 0xFF)) {
                 HWSensorsInfoLog("base CPU multiplier is %d", baseMultiplier);
                 counters.update_perf_counters = true;
@@ -813,6 +844,8 @@ bool CPUSensors::start(IOService *provider)
         case CPUFAMILY_INTEL_SKYLAKE:
         {
             mp_rendezvous_no_intrs(read_cpu_rapl, NULL);
+            accountHardwareAccess(kFakeSMCMSRAccess, cpu_msr_reads);
+            cpu_msr_reads = 0;
 
             UInt8 power_units = cpu_rapl & 0xf;
             UInt8 energy_units = (cpu_rapl >> 8) & 0x1f;
@@ -907,10 +940,13 @@ void CPUSensors::stop(IOService *provider)
 {
     PMstop();
     
-    timerEventSource->cancelTimeout();
+    // Not created if the key store never showed up
+    if (timerEventSource) {
+        timerEventSource->cancelTimeout();
 
-    if (IOWorkLoop *workloop = getWorkLoop()) {
-        workloop->removeEventSource(timerEventSource);
+        if (IOWorkLoop *workloop = getWorkLoop()) {
+            workloop->removeEventSource(timerEventSource);
+        }
     }
     
     super::stop(provider);
@@ -101,6 +101,8 @@ struct CPUSensorsCounters {
 
     UInt64  energy_before[4];
     UInt64  energy_after[4];
+
+    volatile SInt32 msr_reads;  // MSR and PMC reads, every CPU adds its own
 };
 
 class EXPORT CPUSensors : public FakeSMCPlugin
@@ -137,6 +139,8 @@ private:
     
     
 protected:
+    virtual bool            shouldWaitForKeyStore();
+    virtual bool            startWithKeyStore(IOService *provider);
     virtual bool            willReadSensorValue(FakeSMCSensor *sensor, float *outValue);
     
 public:
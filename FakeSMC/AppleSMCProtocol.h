@@ -0,0 +1,476 @@
+//
+//  AppleSMCProtocol.h
+//  HWSensors
+//
+//  AppleSMC port protocol state machine. Plain C with no IOKit dependencies: keys are reached
+//  through AppleSMCKeyStoreOps and the caller passes its thread and the time, so the same code
+//  runs in FakeSMCDevice and in the host simulator (see Tests/)
+//
+
+#ifndef HWSensors_AppleSMCProtocol_h
+#define HWSensors_AppleSMCProtocol_h
+
+#define APPLESMC_DATA_PORT				0x300
+
+#define APPLESMC_CMD_PORT				0x304
+#define APPLESMC_ERROR_CODE_PORT		0x31e
+#define APPLESMC_NR_PORTS				32 /* 0x300-0x31f */
+#define APPLESMC_MAX_DATA_LENGTH		32
+
+#define APPLESMC_READ_CMD				0x10
+#define APPLESMC_WRITE_CMD				0x11
+#define APPLESMC_GET_KEY_BY_INDEX_CMD	0x12
+#define APPLESMC_GET_KEY_TYPE_CMD		0x13
+
+/* FakeSMC extension, never issued by stock clients: write 4 byte big endian #KEY index and 1 byte key count,
+   then read 1 byte number of keys returned followed by 4 byte name, 1 byte size and value of each key */
+#define APPLESMC_READ_RANGE_CMD         0x40
+
+#define APPLESMC_STATUS_IB_CLOSED       0x02    /* last written byte not consumed yet */
+#define APPLESMC_DEFAULT_BUSY_DELAY     10      /* microseconds per written byte */
+
+#define APPLESMC_CONTEXTS               8
+#define APPLESMC_CONTEXT_TIMEOUT        100     /* milliseconds without access after which a transaction is abandoned */
+
+struct AppleSMCStatus {
+	UInt8 cmd;
+	UInt8 status;
+	UInt8 key[4];
+	UInt8 read_pos;
+	UInt8 data_len;
+	UInt8 data_pos;
+	UInt8 value[255];
+	UInt8 charactic[4];
+	UInt8 status_1e;
+	UInt32 key_index;
+	UInt8 key_info[6];
+	UInt8 cached_name[4];
+	void *cached_key;           // key resolved for cached_name, keys are never removed from the store
+	void * volatile owner;      // thread running a transaction on this context, 0 when free
+	UInt64 last_use;            // last access of the owner
+	UInt64 busy_deadline;
+};
+
+// Key store the protocol runs against, key handles stay valid as long as the store
+typedef struct {
+	void *      (*getKey)(void *store, const char *name);               // NUL terminated name, 0 if not found
+	void *      (*getKeyByIndex)(void *store, UInt32 index);
+	const char *(*getKeyName)(void *store, void *key);
+	const char *(*getKeyType)(void *store, void *key);
+	UInt8       (*getKeySize)(void *store, void *key);
+	UInt8       (*copyKeyValue)(void *store, void *key, void *value, int background);  // up to APPLESMC_MAX_DATA_LENGTH bytes
+	void        (*writeKey)(void *store, const char *name, UInt8 size, const void *value);  // adds the key if missing
+} AppleSMCKeyStoreOps;
+
+typedef struct {
+	const AppleSMCKeyStoreOps *ops;
+	void *store;
+	UInt64 busyInterval;        // clock units the port stays busy after a write, 0 disables the model
+	UInt64 contextTimeout;      // clock units, see APPLESMC_CONTEXT_TIMEOUT
+	struct AppleSMCStatus contexts[APPLESMC_CONTEXTS];
+	struct AppleSMCStatus idle; // seen by threads running no transaction, never written
+	volatile UInt32 rejected;   // commands refused while every context ran a transaction
+} AppleSMCPort;
+
+static inline void applesmc_port_init(AppleSMCPort *port, const AppleSMCKeyStoreOps *ops, void *store, UInt64 busyInterval, UInt64 contextTimeout)
+{
+	memset(port, 0, sizeof(AppleSMCPort));
+
+	port->ops = ops;
+	port->store = store;
+	port->busyInterval = busyInterval;
+	port->contextTimeout = contextTimeout;
+}
+
+/**
+ *  A context is bound to one transaction: a command write claims it for the calling thread and it is
+ *  released when the transaction completes. Other threads never see or change it, so concurrent callers
+ *  can't corrupt each other's key, buffers or position. A thread running no transaction gets the idle
+ *  context, reading zeros. An active transaction is never taken over, unless its owner stopped accessing
+ *  the port for contextTimeout; a command arriving while every context is active is refused
+ *
+ *  @param claim Command write, start a transaction for the calling thread
+ *
+ *  @return Context of the caller, the idle context when it runs no transaction
+ */
+static inline struct AppleSMCStatus *applesmc_get_context(AppleSMCPort *port, void *self, UInt64 now, int claim)
+{
+	struct AppleSMCStatus *s = NULL;
+
+	for (int i = 0; i < APPLESMC_CONTEXTS && !s; i++)
+		if (port->contexts[i].owner == self)
+			s = &port->contexts[i];
+
+	if (!s && claim) {
+		for (int i = 0; i < APPLESMC_CONTEXTS && !s; i++)
+			if (!port->contexts[i].owner && __sync_bool_compare_and_swap(&port->contexts[i].owner, (void *)0, self))
+				s = &port->contexts[i];
+
+		// Transactions abandoned by their owner, e.g. after an error, are taken over once timed out
+		for (int i = 0; i < APPLESMC_CONTEXTS && !s && port->contextTimeout; i++) {
+			void *owner = port->contexts[i].owner;
+
+			if (owner && now - port->contexts[i].last_use > port->contextTimeout && __sync_bool_compare_and_swap(&port->contexts[i].owner, owner, self))
+				s = &port->contexts[i];
+		}
+
+		if (!s)
+			__sync_fetch_and_add(&port->rejected, 1);
+	}
+
+	if (!s)
+		return &port->idle;
+
+	if (claim) {
+		s->cmd = 0;
+		s->status = 0;
+		s->status_1e = 0;
+		s->data_len = 0;
+	}
+
+	s->last_use = now;
+
+	return s;
+}
+
+// Free the context once its transaction is over, an error code pending keeps it until read
+static inline void applesmc_put_context(AppleSMCPort *port, struct AppleSMCStatus *s)
+{
+	if (s != &port->idle && !s->status && !s->status_1e)
+		__sync_lock_release(&s->owner);
+}
+
+static inline void applesmc_io_cmd_writeb(struct AppleSMCStatus *s, UInt8 val)
+{
+	switch(val) {
+		case APPLESMC_READ_CMD:
+			s->status = 0x0c;
+			break;
+		case APPLESMC_WRITE_CMD:
+			s->status = 0x0c;
+			break;
+		case APPLESMC_GET_KEY_BY_INDEX_CMD:
+			s->status = 0x0c;
+			break;
+		case APPLESMC_GET_KEY_TYPE_CMD:
+			s->status = 0x0c;
+			break;
+		case APPLESMC_READ_RANGE_CMD:
+			s->status = 0x0c;
+			break;
+		default:
+			// Unknown command, don't leave the status of a previous transaction behind
+			s->status = 0x00;
+			break;
+	}
+	s->cmd = val;
+	s->read_pos = 0;
+	s->data_pos = 0;
+	s->data_len = 0;    // nothing to read before the command says so, a stale length overruns key_info
+	s->key_index = 0;
+}
+
+static inline void *applesmc_get_key(AppleSMCPort *port, struct AppleSMCStatus *s)
+{
+	// KEYINFO followed by READ of the same key resolves it only once
+	if (!s->cached_key || memcmp(s->cached_name, s->key, 4)) {
+		char name[5]; name[4] = 0; memcpy(name, s->key, 4);
+
+		if (!(s->cached_key = port->ops->getKey(port->store, name)))
+			return NULL;
+
+		memcpy(s->cached_name, s->key, 4);
+	}
+
+	return s->cached_key;
+}
+
+static inline void applesmc_fill_data(AppleSMCPort *port, struct AppleSMCStatus *s)
+{
+	void *key = applesmc_get_key(port, s);
+
+	// Whole value is copied once, data port reads then just index into it
+	if (key) {
+		port->ops->copyKeyValue(port->store, key, s->value, 0);
+		return;
+	}
+
+	s->status_1e=0x84;
+}
+
+static inline const char *applesmc_get_key_by_index(AppleSMCPort *port, UInt32 index, struct AppleSMCStatus *s)
+{
+	void *key = port->ops->getKeyByIndex(port->store, index);
+
+	if (key)
+		return port->ops->getKeyName(port->store, key);
+
+	s->status_1e=0x84;
+	s->status = 0x00;
+
+	return 0;
+}
+
+static inline void applesmc_fill_info(AppleSMCPort *port, struct AppleSMCStatus *s)
+{
+	void *key = applesmc_get_key(port, s);
+
+	if (key) {
+		s->key_info[0] = port->ops->getKeySize(port->store, key);
+		s->key_info[5] = 0;
+
+		const char* typ = port->ops->getKeyType(port->store, key);
+		size_t len = strnlen(typ, 4);
+
+		for (UInt8 i=0; i<4; i++)
+		{
+			if (i<len)
+			{
+				s->key_info[i+1] = typ[i];
+			}
+			else
+			{
+				s->key_info[i+1] = 0;
+			}
+		}
+
+		return;
+	}
+
+	s->status_1e=0x84;
+}
+
+static inline void applesmc_fill_range(AppleSMCPort *port, struct AppleSMCStatus *s, UInt8 count)
+{
+	UInt8 returned = 0;
+	UInt32 pos = 1;
+
+	for (UInt32 index = s->key_index; returned < count; index++) {
+		void *key = port->ops->getKeyByIndex(port->store, index);
+
+		if (!key)
+			break;
+
+		UInt8 value[APPLESMC_MAX_DATA_LENGTH];
+
+		// Bulk enumeration, must not hold back single key reads
+		UInt8 size = port->ops->copyKeyValue(port->store, key, value, 1);
+
+		// Stop at the first key that doesn't fit, client continues from there
+		if (pos + 5 + size > sizeof(s->value))
+			break;
+
+		memcpy(&s->value[pos], port->ops->getKeyName(port->store, key), 4);
+		s->value[pos + 4] = size;
+		memcpy(&s->value[pos + 5], value, size);
+
+		pos += 5 + size;
+		returned++;
+	}
+
+	if (!returned && count)
+		s->status_1e = 0x84;
+
+	s->value[0] = returned;
+	s->data_len = pos;
+	s->data_pos = 0;
+}
+
+static inline void applesmc_io_data_writeb(AppleSMCPort *port, struct AppleSMCStatus *s, UInt8 val)
+{
+	switch(s->cmd) {
+		case APPLESMC_READ_CMD:
+			if(s->read_pos < 4) {
+				s->key[s->read_pos] = val;
+				s->status = 0x04;
+			} else if(s->read_pos == 4) {
+				s->data_len = val;
+				s->status = val ? 0x05 : 0x00;  // nothing to read back for zero length
+				s->data_pos = 0;
+				applesmc_fill_data(port, s);
+			}
+			s->read_pos++;
+			break;
+		case APPLESMC_WRITE_CMD:
+			if(s->read_pos < 4) {
+				s->key[s->read_pos] = val;
+				s->status = 0x04;
+			} else if(s->read_pos == 4) {
+				s->status = val ? 0x05 : 0x00;  // zero length write would never complete otherwise
+				s->data_pos=0;
+				s->data_len = val;
+			} else if( s->data_pos < s->data_len ) {
+				s->value[s->data_pos] = val;
+				s->data_pos++;
+				s->status = 0x05;
+				if(s->data_pos == s->data_len) {
+					s->status = 0x00;
+
+					// Add or update key
+					char name[5]; name[4] = 0; memcpy(name, s->key, 4);
+
+					// The length byte goes up to 255, keys never hold more than the protocol carries
+					port->ops->writeKey(port->store, name, s->data_len > APPLESMC_MAX_DATA_LENGTH ? APPLESMC_MAX_DATA_LENGTH : s->data_len, s->value);
+
+					memset(s->value, 0, 255);
+				}
+			};
+			s->read_pos++;
+			break;
+		case APPLESMC_GET_KEY_BY_INDEX_CMD:
+			if(s->read_pos < 4) {
+				s->key_index += (UInt32)val << (24 - s->read_pos * 8);
+				s->status = 0x04;
+				s->read_pos++;
+			};
+			if(s->read_pos == 4) {
+				s->status = 0x05;
+				const char *key = applesmc_get_key_by_index(port, s->key_index, s);
+				if(key)
+					memcpy(s->key, key, 4);
+			}
+
+			break;
+		case APPLESMC_READ_RANGE_CMD:
+			if(s->read_pos < 4) {
+				s->key_index += (UInt32)val << (24 - s->read_pos * 8);
+				s->status = 0x04;
+			} else if(s->read_pos == 4) {
+				applesmc_fill_range(port, s, val);
+				s->status = 0x05;
+			}
+			s->read_pos++;
+			break;
+		case APPLESMC_GET_KEY_TYPE_CMD:
+			if(s->read_pos < 4) {
+				s->key[s->read_pos] = val;
+				s->status = 0x04;
+			};
+			s->read_pos++;
+			if(s->read_pos == 4) {
+				s->data_len = 6;  ///s->data_len = val ; ? val should be 6 here too
+				s->status = 0x05;
+				s->data_pos=0;
+				applesmc_fill_info(port, s);
+			}
+			break;
+	}
+}
+
+static inline UInt8 applesmc_io_data_readb(struct AppleSMCStatus *s)
+{
+	UInt8 retval = 0;
+	switch(s->cmd) {
+		case APPLESMC_READ_CMD:
+		case APPLESMC_READ_RANGE_CMD:
+			if(s->data_pos < s->data_len) {
+				retval = s->value[s->data_pos];
+				s->data_pos++;
+				if(s->data_pos == s->data_len) {
+					s->status = 0x00;
+					memset(s->value, 0, 255);
+				} else
+					s->status = 0x05;
+			}
+			break;
+		case APPLESMC_WRITE_CMD:
+			s->status = 0x00;
+			break;
+		case APPLESMC_GET_KEY_BY_INDEX_CMD:  ///shouldnt be here if status == 0
+			if(s->status == 0) return 0; //sanity check
+			if(s->data_pos < 4) {
+				retval = s->key[s->data_pos];
+				s->data_pos++;
+			}
+			if (s->data_pos == 4)
+				s->status = 0x00;
+			break;
+		case APPLESMC_GET_KEY_TYPE_CMD:
+			if(s->data_pos < s->data_len) {
+				retval = s->key_info[s->data_pos];
+				s->data_pos++;
+				if(s->data_pos == s->data_len) {
+					s->status = 0x00;
+					memset(s->key_info, 0, 6);
+				} else
+					s->status = 0x05;
+			}
+			break;
+
+	}
+	return retval;
+}
+
+static inline UInt8 applesmc_io_cmd_readb(AppleSMCPort *port, struct AppleSMCStatus *s, UInt64 now)
+{
+	UInt8 status = s->status;
+
+	// Like the real SMC, report the input buffer closed until the last written byte is "processed"
+	if (port->busyInterval && now < s->busy_deadline)
+		status |= APPLESMC_STATUS_IB_CLOSED;
+
+	return status;
+}
+
+/**
+ *  Read one of the SMC ports
+ *
+ *  @param address Port address
+ *  @param thread  Identifies the caller, see applesmc_get_context
+ *  @param now     Time in the units of busyInterval
+ *  @param context Receives the context the access went to, for tracing
+ */
+static inline UInt8 applesmc_port_read(AppleSMCPort *port, UInt16 address, void *thread, UInt64 now, struct AppleSMCStatus **context)
+{
+	struct AppleSMCStatus *s = applesmc_get_context(port, thread, now, 0);
+	UInt8 value = 0;
+
+	if (context)
+		*context = s;
+
+	if (s == &port->idle)
+		return 0;
+
+	if (address == APPLESMC_DATA_PORT) value = applesmc_io_data_readb(s);
+	if (address == APPLESMC_CMD_PORT) value = applesmc_io_cmd_readb(port, s, now);
+
+	if (address == APPLESMC_ERROR_CODE_PORT)
+	{
+		if(s->status_1e != 0)
+		{
+			value = s->status_1e;
+			s->status_1e = 0x00;
+		}
+		else value = 0x0;
+	}
+
+	applesmc_put_context(port, s);
+
+	return value;
+}
+
+/**
+ *  Write one of the SMC ports, parameters as for applesmc_port_read
+ */
+static inline void applesmc_port_write(AppleSMCPort *port, UInt16 address, UInt8 value, void *thread, UInt64 now, struct AppleSMCStatus **context)
+{
+	struct AppleSMCStatus *s = applesmc_get_context(port, thread, now, address == APPLESMC_CMD_PORT);
+
+	if (context)
+		*context = s;
+
+	// Data written outside a transaction, or a command refused, goes nowhere
+	if (s == &port->idle)
+		return;
+
+	// Status port reports busy until the deadline instead of spinning the caller here
+	if (port->busyInterval)
+		s->busy_deadline = now + port->busyInterval;
+
+	if (address == APPLESMC_DATA_PORT) applesmc_io_data_writeb(port, s, value);
+	if (address == APPLESMC_CMD_PORT) applesmc_io_cmd_writeb(s, value);
+
+	applesmc_put_context(port, s);
+}
+
+#endif
@@ -6,8 +6,10 @@
 #include "FakeSMCKeyStoreUserClient.h"
 #include "FakeSMC.h"
 #include "FakeSMCDevice.h"
+#include "SMCDetection.h"
 
 #include <IOKit/IODeviceTreeSupport.h>
+#include <IOKit/IOPlatformExpert.h>
 
 //REVIEW: avoids problem with Xcode 5.1.0 where -dead_strip eliminates these required symbols
 #include <libkern/OSKextLib.h>
@@ -21,6 +23,111 @@ void* _org_rehabman_dontstrip[] =
 #define super IOService
 OSDefineMetaClassAndStructors (FakeSMC, IOService)
 
+#pragma mark -
+#pragma mark Hardware SMC detection
+
+/**
+ *  For internal use, checksum of the ACPI table headers published by the platform expert
+ *
+ *  @return Checksum, 0 if the tables are not available
+ */
+UInt32 FakeSMC::getACPITablesChecksum(void)
+{
+    UInt32 checksum = 0;
+
+    if (IOService *platform = getPlatform()) {
+        if (OSDictionary *tables = OSDynamicCast(OSDictionary, platform->getProperty("ACPI Tables"))) {
+            if (OSCollectionIterator *iterator = OSCollectionIterator::withCollection(tables)) {
+                while (OSSymbol *name = OSDynamicCast(OSSymbol, iterator->getNextObject())) {
+                    if (OSData *table = OSDynamicCast(OSData, tables->getObject(name))) {
+                        checksum += smcDetectionTableChecksum(name->getCStringNoCopy(), table->getBytesNoCopy(), table->getLength());
+                    }
+                }
+
+                OSSafeRelease(iterator);
+            }
+        }
+    }
+
+    return checksum;
+}
+
+/**
+ *  For internal use, hardware SMC verdict stored in NVRAM by a previous boot with the same ACPI tables
+ *
+ *  @return kSMCDetection*
+ */
+int FakeSMC::loadSMCVerdict(UInt32 checksum)
+{
+    int verdict = kSMCDetectionUnknown;
+
+    if (!checksum)
+        return verdict;
+
+    if (IORegistryEntry *nvram = fromPath("/options", gIODTPlane)) {
+        if (OSData *data = OSDynamicCast(OSData, nvram->getProperty(kFakeSMCDetectionProperty))) {
+            verdict = smcDetectionCachedVerdict(data->getBytesNoCopy(), data->getLength(), checksum);
+        }
+
+        OSSafeRelease(nvram);
+    }
+
+    return verdict;
+}
+
+/**
+ *  For internal use, store the hardware SMC verdict in NVRAM, written only when it changed
+ *
+ */
+void FakeSMC::saveSMCVerdict(UInt32 checksum, bool found)
+{
+    if (!checksum || loadSMCVerdict(checksum) == (found ? kSMCDetectionFound : kSMCDetectionAbsent))
+        return;
+
+    if (IORegistryEntry *nvram = fromPath("/options", gIODTPlane)) {
+        SMCDetectionVerdict verdict;
+
+        smcDetectionMakeVerdict(&verdict, checksum, found);
+
+        if (OSData *data = OSData::withBytes(&verdict, sizeof(verdict))) {
+            const OSSymbol *name = OSSymbol::withCString(kFakeSMCDetectionProperty);
+
+            // Same fallback as FakeSMCKeyStore::saveKeyToNVRAM
+            if (0 == strncmp(nvram->getName(), "AppleNVRAM", sizeof("AppleNVRAM")))
+                nvram->IORegistryEntry::setProperty(name, data);
+            else
+                nvram->setProperty(name, data);
+
+            OSSafeRelease(name);
+            OSSafeRelease(data);
+        }
+
+        OSSafeRelease(nvram);
+    }
+}
+
+/**
+ *  For internal use, APP0001 publish notification handler. Called from addMatchingNotification for
+ *  a device published already, later for one published after FakeSMC started
+ *
+ */
+bool FakeSMC::smcDevicePublished(void *refCon, IOService *newService, IONotifier *notifier)
+{
+    HWSensorsDebugLog("matched %s", newService->getName());
+
+    if (!smcDeviceFound) {
+        smcDeviceFound = true;
+
+        // Too late for this boot, the next one with these tables won't emulate the SMC
+        if (smcDevice) {
+            HWSensorsWarningLog("physical SMC device published after the emulated one was started");
+            saveSMCVerdict(acpiChecksum, true);
+        }
+    }
+
+    return true;
+}
+
 #pragma mark -
 #pragma mark Overridden methods
 
@@ -96,6 +203,11 @@ bool FakeSMC::start(IOService *provider)
 
     keyStore->addWellKnownTypesFromDictionary(OSDynamicCast(OSDictionary, configuration->getObject("Types")));
 
+    // Load key threshold rules
+    if (UInt32 count = keyStore->addThresholdsFromDictionary(OSDynamicCast(OSDictionary, configuration->getObject("Thresholds")))) {
+        HWSensorsInfoLog("%d key threshold%s loaded", count, count == 1 ? "" : "s");
+    }
+
     // Set Clover platform keys
     if (OSDictionary *dictionary = OSDynamicCast(OSDictionary, configuration->getObject("Clover"))) {
         UInt32 count = 0;
@@ -120,29 +232,27 @@ bool FakeSMC::start(IOService *provider)
             HWSensorsInfoLog("%d key%s exported by Clover EFI", count, count == 1 ? "" : "s");
     }
 
-    // Check if we have SMC already
-    bool smcDeviceFound = false;
+    // Check if we have SMC already. The ACPI tables define the device, the verdict of a previous
+    // boot with the same tables holds and the registry isn't searched
+    acpiChecksum = getACPITablesChecksum();
 
-    if (OSDictionary *matching = serviceMatching("IOACPIPlatformDevice")) {
-        if (OSIterator *iterator = getMatchingServices(matching)) {
-            
-            OSString *name = OSString::withCString("APP0001");
+    int verdict = loadSMCVerdict(acpiChecksum);
 
-            while (IOService *service = (IOService*)iterator->getNextObject()) {
-
-                HWSensorsDebugLog("checking %s", service->getName());
+    if (verdict != kSMCDetectionUnknown) {
+        HWSensorsDebugLog("physical SMC device %s by a previous boot", verdict == kSMCDetectionFound ? "found" : "not found");
+        smcDeviceFound = verdict == kSMCDetectionFound;
+    }
+    else if (OSDictionary *matching = nameMatching("APP0001", serviceMatching("IOACPIPlatformDevice"))) {
+        // Devices published already are handed to the handler before this returns, the notification
+        // stays installed for one published later
+        smcNotifier = addMatchingNotification(gIOFirstPublishNotification, matching, OSMemberFunctionCast(IOServiceMatchingNotificationHandler, this, &FakeSMC::smcDevicePublished), this);
 
-                if (service->compareName(name)) {
-                    HWSensorsDebugLog("matched!");
-                    smcDeviceFound = true;
-                    break;
-                }
-            }
-            
-            OSSafeRelease(iterator);
-        }
-        
         OSSafeRelease(matching);
+
+        if (!smcNotifier)
+            HWSensorsWarningLog("failed to install APP0001 notification");
+
+        saveSMCVerdict(acpiChecksum, smcDeviceFound);
     }
 
     if (!smcDeviceFound) {
@@ -180,3 +290,13 @@ bool FakeSMC::start(IOService *provider)
 	return true;
 }
 
+void FakeSMC::free(void)
+{
+    if (smcNotifier) {
+        smcNotifier->remove();
+        smcNotifier = NULL;
+    }
+
+    super::free();
+}
+
@@ -15,9 +15,19 @@ private:
     FakeSMCKeyStore     *keyStore;
     FakeSMCDevice       *smcDevice;
 
+    IONotifier          *smcNotifier;
+    volatile bool       smcDeviceFound;
+    UInt32              acpiChecksum;
+
+    UInt32              getACPITablesChecksum(void);
+    int                 loadSMCVerdict(UInt32 checksum);
+    void                saveSMCVerdict(UInt32 checksum, bool found);
+    bool                smcDevicePublished(void *refCon, IOService *newService, IONotifier *notifier);
+
 public:
     virtual bool		init(OSDictionary *dictionary = 0);
     virtual bool		start(IOService *provider);
+    virtual void		free(void);
     
 };
 
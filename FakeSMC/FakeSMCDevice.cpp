@@ -15,12 +15,11 @@
 
 #include <IOKit/IODeviceTreeSupport.h>
 #include <IOKit/IOKitKeys.h>
+#include <kern/clock.h>
 
 #ifdef DEBUG
-#define FakeSMCTraceLog(string, args...) do { if (trace) { IOLog ("%s: [Trace] " string "\n",getName() , ## args); } } while(0)
 #define FakeSMCDebugLog(string, args...) do { if (debug) { IOLog ("%s: [Debug] " string "\n",getName() , ## args); } } while(0)
 #else
-#define FakeSMCTraceLog(string, args...) do { } while(0)
 #define FakeSMCDebugLog(string, args...) do { } while(0)
 #endif
 
@@ -32,227 +31,96 @@ OSDefineMetaClassAndStructors (FakeSMCDevice, IOACPIPlatformDevice)
 #pragma mark -
 #pragma mark Internal I/O methods
 
-void FakeSMCDevice::applesmc_io_cmd_writeb(void *opaque, uint32_t addr, uint32_t val)
+/**
+ *  Key store access for the port protocol in AppleSMCProtocol.h, the store pointer is the device
+ */
+static void *applesmcGetKey(void *store, const char *name)
 {
-    struct AppleSMCStatus *s = (struct AppleSMCStatus *)opaque;
-    
-    FakeSMCTraceLog("CMD Write B: %#x = %#x", addr, val);
-    
-    switch(val) {
-        case APPLESMC_READ_CMD:
-            s->status = 0x0c;
-            break;
-		case APPLESMC_WRITE_CMD:
-            s->status = 0x0c;
-			break;
-		case APPLESMC_GET_KEY_BY_INDEX_CMD:
-			s->status = 0x0c;
-			break;
-		case APPLESMC_GET_KEY_TYPE_CMD:
-			s->status = 0x0c;
-			break;
-    }
-    s->cmd = val;
-    s->read_pos = 0;
-    s->data_pos = 0;
-	s->key_index = 0;
-    //	bzero(s->key_info, 6);
+    return ((FakeSMCDevice *)store)->getKeyStore()->getKey(name);
 }
 
-void FakeSMCDevice::applesmc_fill_data(struct AppleSMCStatus *s)
+static void *applesmcGetKeyByIndex(void *store, UInt32 index)
 {
-	if (FakeSMCKey *key = keyStore->getKey((char*)s->key)) {
-		bcopy(key->getValue(), s->value, key->getSize());
-		return;
-	}
-    
-    FakeSMCTraceLog("key not found %c%c%c%c, length - %x\n", s->key[0], s->key[1], s->key[2], s->key[3],  s->data_len);
-    
-	s->status_1e=0x84;
+    return ((FakeSMCDevice *)store)->getKeyStore()->getKey(index);
 }
 
-const char * FakeSMCDevice::applesmc_get_key_by_index(uint32_t index, struct AppleSMCStatus *s)
+static const char *applesmcGetKeyName(void *store, void *key)
 {
-	if (FakeSMCKey *key = keyStore->getKey(index))
-		return key->getKey();
-    
-    FakeSMCTraceLog("key by count %x is not found",index);
-    
-	s->status_1e=0x84;
-	s->status = 0x00;
-    
-	return 0;
+    return ((FakeSMCKey *)key)->getKey();
 }
 
-void FakeSMCDevice::applesmc_fill_info(struct AppleSMCStatus *s)
+static const char *applesmcGetKeyType(void *store, void *key)
 {
-	if (FakeSMCKey *key = keyStore->getKey((char*)s->key)) {
-		s->key_info[0] = key->getSize();
-		s->key_info[5] = 0;
-        
-		const char* typ = key->getType();
-		UInt64 len = strnlen(typ, 4);
-        
-		for (UInt8 i=0; i<4; i++)
-		{
-			if (i<len)
-			{
-				s->key_info[i+1] = typ[i];
-			}
-			else
-			{
-				s->key_info[i+1] = 0;
-			}
-		}
-        
-		return;
-	}
-    
-	FakeSMCTraceLog("key info not found %c%c%c%c, length - %x", s->key[0], s->key[1], s->key[2], s->key[3],  s->data_len);
-    
-	s->status_1e=0x84;
+    return ((FakeSMCKey *)key)->getType();
 }
 
-void FakeSMCDevice::applesmc_io_data_writeb(void *opaque, uint32_t addr, uint32_t val)
+static UInt8 applesmcGetKeySize(void *store, void *key)
 {
-    struct AppleSMCStatus *s = (struct AppleSMCStatus *)opaque;
-    //    IOLog("APPLESMC: DATA Write B: %#x = %#x\n", addr, val);
-    switch(s->cmd) {
-        case APPLESMC_READ_CMD:
-            if(s->read_pos < 4) {
-                s->key[s->read_pos] = val;
-                s->status = 0x04;
-            } else if(s->read_pos == 4) {
-                s->data_len = val;
-                s->status = 0x05;
-                s->data_pos = 0;
-                //                IOLog("APPLESMC: Key = %c%c%c%c Len = %d\n", s->key[0], s->key[1], s->key[2], s->key[3], val);
-                applesmc_fill_data(s);
-            }
-            s->read_pos++;
-            break;
-		case APPLESMC_WRITE_CMD:
-            //			IOLog("FakeSMC: attempting to write(WRITE_CMD) to io port value %x ( %c )\n", val, val);
-			if(s->read_pos < 4) {
-                s->key[s->read_pos] = val;
-                s->status = 0x04;
-			} else if(s->read_pos == 4) {
-				s->status = 0x05;
-				s->data_pos=0;
-				s->data_len = val;
-                //				IOLog("FakeSMC: System Tried to write Key = %c%c%c%c Len = %d\n", s->key[0], s->key[1], s->key[2], s->key[3], val);
-			} else if( s->data_pos < s->data_len ) {
-				s->value[s->data_pos] = val;
-				s->data_pos++;
-				s->status = 0x05;
-				if(s->data_pos == s->data_len) {
-					s->status = 0x00;
-                    
-                    // Add or update key
-                    char name[5]; name[4] = 0; memcpy(name, s->key, 4);
-                    
-                    FakeSMCDebugLog("system writing key %s, length %d", name, s->data_len);
-                    
-                    FakeSMCKey* key = keyStore->addKeyWithValue(name, 0, s->data_len, s->value);
-
-                    bzero(s->value, 255);
-                    
-#if NVRAMKEYS
-                    if (key) keyStore->saveKeyToNVRAM(key);
-#else
-                    key=key; //REVIEW_REHABMAN: just to avoid warning
-#endif
-				}
-			};
-			s->read_pos++;
-			break;
-		case APPLESMC_GET_KEY_BY_INDEX_CMD:
-            //			IOLog("FakeSMC: System Tried to write GETKEYBYINDEX = %x (%c) at pos %x\n",val , val, s->read_pos);
-			if(s->read_pos < 4) {
-                s->key_index += val << (24 - s->read_pos * 8);
-                s->status = 0x04;
-				s->read_pos++;
-			};
-			if(s->read_pos == 4) {
-				s->status = 0x05;
-                //				IOLog("FakeSMC: trying to find key by index %x\n", s->key_index);
-				if(const char * key = applesmc_get_key_by_index(s->key_index, s))
-					bcopy(key, s->key, 4);
-			}
-            
-			break;
-		case APPLESMC_GET_KEY_TYPE_CMD:
-            //			IOLog("FakeSMC: System Tried to write GETKEYTYPE = %x (%c) at pos %x\n",val , val, s->read_pos);
-			if(s->read_pos < 4) {
-                s->key[s->read_pos] = val;
-                s->status = 0x04;
-            };
-			s->read_pos++;
-			if(s->read_pos == 4) {
-				s->data_len = 6;  ///s->data_len = val ; ? val should be 6 here too
-				s->status = 0x05;
-				s->data_pos=0;
-				applesmc_fill_info(s);
-			}
-			break;
-    }
+    return ((FakeSMCKey *)key)->getSize();
 }
 
-uint32_t FakeSMCDevice::applesmc_io_data_readb(void *opaque, uint32_t addr1)
+static UInt8 applesmcCopyKeyValue(void *store, void *key, void *value, int background)
 {
-    struct AppleSMCStatus *s = (struct AppleSMCStatus *)opaque;
-    uint8_t retval = 0;
-    switch(s->cmd) {
-        case APPLESMC_READ_CMD:
-            if(s->data_pos < s->data_len) {
-                retval = s->value[s->data_pos];
-                //			        IOLog("APPLESMC: READ_DATA[%d] = %#hhx\n", s->data_pos, retval);
-                s->data_pos++;
-                if(s->data_pos == s->data_len) {
-                    s->status = 0x00;
-                    bzero(s->value, 255);
-                    //			            IOLog("APPLESMC: EOF\n");
-                } else
-                    s->status = 0x05;
-            }
-            break;
-        case APPLESMC_WRITE_CMD:
-            //				HWSensorsInfoLog("attempting to read(WRITE_CMD) from io port");
-            s->status = 0x00;
-            break;
-        case APPLESMC_GET_KEY_BY_INDEX_CMD:  ///shouldnt be here if status == 0
-            //				IOLog("FakeSMC:System Tried to read GETKEYBYINDEX = %x (%c) , at pos %d\n", retval, s->key[s->data_pos], s->key[s->data_pos], s->data_pos);
-            if(s->status == 0) return 0; //sanity check
-            if(s->data_pos < 4) {
-                retval = s->key[s->data_pos];
-                s->data_pos++;
-            }
-            if (s->data_pos == 4)
-                s->status = 0x00;
-            break;
-        case APPLESMC_GET_KEY_TYPE_CMD:
-            //				IOLog("FakeSMC:System Tried to read GETKEYTYPE = %x , at pos %d\n", s->key_info[s->data_pos], s->data_pos);
-            if(s->data_pos < s->data_len) {
-                retval = s->key_info[s->data_pos];
-                s->data_pos++;
-                if(s->data_pos == s->data_len) {
-                    s->status = 0x00;
-                    bzero(s->key_info, 6);
-                    //			            IOLog("APPLESMC: EOF\n");
-                } else
-                    s->status = 0x05;
-            }
-            break;
-            
-    }
-    //    IOLog("APPLESMC: DATA Read b: %#x = %#x\n", addr1, retval);
-    return retval;
+    return ((FakeSMCKey *)key)->copyValue(value, background ? kFakeSMCKeyReadBackground : kFakeSMCKeyReadInteractive);
+}
+
+static void applesmcWriteKey(void *store, const char *name, UInt8 size, const void *value)
+{
+    ((FakeSMCDevice *)store)->writeKey(name, size, value);
+}
+
+const AppleSMCKeyStoreOps FakeSMCDevice::keyStoreOps = {
+    applesmcGetKey,
+    applesmcGetKeyByIndex,
+    applesmcGetKeyName,
+    applesmcGetKeyType,
+    applesmcGetKeySize,
+    applesmcCopyKeyValue,
+    applesmcWriteKey,
+};
+
+FakeSMCKeyStore *FakeSMCDevice::getKeyStore()
+{
+    return keyStore;
+}
+
+// Add or update key written through the port
+void FakeSMCDevice::writeKey(const char *name, UInt8 size, const void *value)
+{
+    FakeSMCDebugLog("system writing key %s, length %d", name, size);
+
+    FakeSMCKey* key = keyStore->addKeyWithValue(name, 0, size, value);
+
+#if NVRAMKEYS
+    if (key) keyStore->saveKeyToNVRAM(key);
+#else
+    key=key; //REVIEW_REHABMAN: just to avoid warning
+#endif
 }
 
-uint32_t FakeSMCDevice::applesmc_io_cmd_readb(void *opaque, uint32_t addr1)
+/**
+ *  Append a record to the trace ring. Writers only reserve a slot with an atomic increment, readers
+ *  detect records overwritten or still being written by comparing sequence with the expected position
+ */
+void FakeSMCDevice::traceAccess(UInt16 address, UInt8 value, UInt8 flags, struct AppleSMCStatus *s)
 {
-    //		IOLog("APPLESMC: CMD Read B: %#x\n", addr1);
-    return ((struct AppleSMCStatus*)opaque)->status;
+    UInt32 position = (UInt32)OSIncrementAtomic((volatile SInt32 *)&traceRing->head);
+    SMCTraceRecord_t *record = &traceRing->records[position & (SMC_TRACE_RING_RECORDS - 1)];
+
+    record->sequence = 0;
+    __sync_synchronize();
+
+    record->timestamp = mach_absolute_time();
+    record->key = (UInt32)s->key[0] << 24 | (UInt32)s->key[1] << 16 | (UInt32)s->key[2] << 8 | s->key[3];
+    record->port = address;
+    record->value = value;
+    record->flags = flags | (s->status_1e ? SMC_TRACE_ERROR : 0);
+    record->cmd = s->cmd;
+    record->status = s->status;
+    record->pos = s->cmd == APPLESMC_WRITE_CMD ? s->read_pos : s->data_pos;
+
+    __sync_synchronize();
+    record->sequence = position + 1;
 }
 
 #pragma mark -
@@ -279,10 +147,10 @@ bool FakeSMCDevice::initAndStart(IOService *platform, IOService *provider)
         return false;
     }
     
-	status = (ApleSMCStatus *) IOMalloc(sizeof(struct AppleSMCStatus));
-    if (!status)
+	port = (AppleSMCPort *) IOMalloc(sizeof(AppleSMCPort));
+    if (!port)
         return false;
-	bzero((void*)status, sizeof(struct AppleSMCStatus));
+	applesmc_port_init(port, &keyStoreOps, this, 0, 0);
     
     // Start SMC device
     
@@ -314,18 +182,43 @@ bool FakeSMCDevice::initAndStart(IOService *platform, IOService *provider)
     else
         debug = false;
     
+#endif
+
+    // Binary port trace is cheap enough for release builds, see traceAccess
     if (OSBoolean *traceKey = OSDynamicCast(OSBoolean, properties->getObject("trace")))
 		trace = traceKey->getValue();
     else
         trace = false;
-#endif
+
+    if (trace) {
+        if ((traceBuffer = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared, sizeof(SMCTraceRing_t), PAGE_SIZE))) {
+            traceRing = (SMCTraceRing_t *)traceBuffer->getBytesNoCopy();
+
+            bzero(traceRing, sizeof(SMCTraceRing_t));
+
+            traceRing->capacity = SMC_TRACE_RING_RECORDS;
+            traceRing->recordSize = sizeof(SMCTraceRecord_t);
+
+            keyStore->setTraceBuffer(traceBuffer);
+        }
+        else HWSensorsErrorLog("failed to allocate trace ring");
+    }
+
+    UInt32 busyDelay = APPLESMC_DEFAULT_BUSY_DELAY;
+
+    if (OSNumber *busyDelayKey = OSDynamicCast(OSNumber, properties->getObject("smc-busy-delay")))
+        busyDelay = busyDelayKey->unsigned32BitValue();
+
+    nanoseconds_to_absolutetime((UInt64)busyDelay * NSEC_PER_USEC, &port->busyInterval);
+    nanoseconds_to_absolutetime((UInt64)APPLESMC_CONTEXT_TIMEOUT * NSEC_PER_MSEC, &port->contextTimeout);
     
 	IODeviceMemory::InitElement	rangeList[1];
     
 	rangeList[0].start = 0x300;
 	rangeList[0].length = 0x20;
-//    rangeList[1].start = 0xfef00000;
-//	rangeList[1].length = 0x10000;
+    // The MMIO window (0xfef00000, 0x10000) is not published: AppleSMC maps it and accesses it directly,
+    // without going through this device. There is nothing at that address on non-Apple hardware, and
+    // those accesses cannot be trapped from here, so clients must stay on the port protocol above
     
 	if(OSArray *array = IODeviceMemory::arrayFromList(rangeList, 1)) {
 		this->setDeviceMemory(array);
@@ -406,23 +299,15 @@ UInt8 FakeSMCDevice::ioRead8( UInt16 offset, IOMemoryMap * map )
 {
     UInt8  value =0;
     UInt16  base = 0;
-	struct AppleSMCStatus *s = (struct AppleSMCStatus *)status;
+	struct AppleSMCStatus *s;
     //	IODelay(10);
     
     if (map) base = map->getPhysicalAddress();
-	if((base+offset) == APPLESMC_DATA_PORT) value=applesmc_io_data_readb(status, base+offset);
-	if((base+offset) == APPLESMC_CMD_PORT) value=applesmc_io_cmd_readb(status, base+offset);
-    
-    if((base+offset) == APPLESMC_ERROR_CODE_PORT)
-	{
-		if(s->status_1e != 0)
-		{
-			value = s->status_1e;
-			s->status_1e = 0x00;
-            //			IOLog("generating error %x\n", value);
-		}
-		else value = 0x0;
-	}
+
+    value = applesmc_port_read(port, base+offset, IOThreadSelf(), mach_absolute_time(), &s);
+
+    if (traceRing && (base+offset) == APPLESMC_DATA_PORT)
+        traceAccess(base+offset, value, 0, s);
     //	if(((base+offset) != APPLESMC_DATA_PORT) && ((base+offset) != APPLESMC_CMD_PORT)) IOLog("ioread8 to port %x.\n", base+offset);
     
 	//HWSensorsDebugLog("ioread8 called");
@@ -451,11 +336,14 @@ void FakeSMCDevice::ioWrite16( UInt16 offset, UInt16 value, IOMemoryMap * map )
 void FakeSMCDevice::ioWrite8( UInt16 offset, UInt8 value, IOMemoryMap * map )
 {
     UInt16 base = 0;
-	IODelay(10);
+	struct AppleSMCStatus *s;
+
     if (map) base = map->getPhysicalAddress();
-    
-	if((base+offset) == APPLESMC_DATA_PORT) applesmc_io_data_writeb(status, base+offset, value);
-	if((base+offset) == APPLESMC_CMD_PORT) applesmc_io_cmd_writeb(status, base+offset,value);
+
+    applesmc_port_write(port, base+offset, value, IOThreadSelf(), mach_absolute_time(), &s);
+
+    if (traceRing && ((base+offset) == APPLESMC_DATA_PORT || (base+offset) == APPLESMC_CMD_PORT))
+        traceAccess(base+offset, value, SMC_TRACE_WRITE, s);
 	//    outb( base + offset, value );
     //	if(((base+offset) != APPLESMC_DATA_PORT) && ((base+offset) != APPLESMC_CMD_PORT)) IOLog("iowrite8 to port %x.\n", base+offset);
     
@@ -492,6 +380,9 @@ IOReturn FakeSMCDevice::disableInterrupt(int source)
 	return kIOReturnSuccess;
 }
 
+// Nothing raises the interrupt on its own: AppleSMC reads the cause of an SMC interrupt through its
+// platform notification protocol, which is not emulated, so made up event codes would reach no client.
+// Threshold crossings are delivered to user clients through the threshold event queue instead
 IOReturn FakeSMCDevice::causeInterrupt(int source)
 {
 	if(interrupt_handler)
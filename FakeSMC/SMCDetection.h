@@ -0,0 +1,93 @@
+//
+//  SMCDetection.h
+//  HWSensors
+//
+//  Cached verdict of the hardware SMC (APP0001) lookup in FakeSMC::start. The ACPI tables define
+//  the device, so while their headers are unchanged the verdict of the previous boot holds and the
+//  registry isn't searched. Plain C with no IOKit dependencies, so the same code runs in the host
+//  tests (see Tests/)
+//
+
+#ifndef HWSensors_SMCDetection_h
+#define HWSensors_SMCDetection_h
+
+#define kSMCDetectionVerdictVersion     1
+#define kSMCDetectionTableHeaderLength  36      // signature, length, revision, checksum, OEM and creator ids
+#define kSMCDetectionChecksumSeed       2166136261U
+
+enum {
+    kSMCDetectionUnknown    = 0,                // no verdict or taken with other tables, look the device up
+    kSMCDetectionAbsent     = 1,
+    kSMCDetectionFound      = 2,
+};
+
+// Stored in NVRAM as is
+typedef struct {
+    UInt8               version;
+    UInt8               found;
+    UInt16              reserved;
+    UInt32              checksum;               // of the ACPI table headers the verdict was taken with
+} SMCDetectionVerdict;
+
+// FNV-1a
+static inline UInt32 smcDetectionHash(UInt32 hash, const void *bytes, UInt32 length)
+{
+    const UInt8 *data = (const UInt8 *)bytes;
+
+    for (UInt32 i = 0; i < length; i++)
+        hash = (hash ^ data[i]) * 16777619U;
+
+    return hash;
+}
+
+/**
+ *  Checksum of one ACPI table, add those of all tables up. The sum doesn't depend on the order the
+ *  tables are enumerated in. The header carries the table checksum and length, so any change to
+ *  the table changes it without hashing the whole table
+ *
+ *  @param name   Table name as listed by the platform expert, e.g. "DSDT" or "SSDT-2"
+ *  @param table  Table bytes, header first
+ *  @param length Table length
+ */
+static inline UInt32 smcDetectionTableChecksum(const char *name, const void *table, UInt32 length)
+{
+    UInt32 nameLength = 0;
+
+    while (name[nameLength])
+        nameLength++;
+
+    UInt32 hash = smcDetectionHash(kSMCDetectionChecksumSeed, name, nameLength);
+
+    return smcDetectionHash(hash, table, length < kSMCDetectionTableHeaderLength ? length : kSMCDetectionTableHeaderLength);
+}
+
+/**
+ *  Verdict stored by a previous boot
+ *
+ *  @param data     Stored bytes, may be NULL
+ *  @param length   Stored length
+ *  @param checksum Checksum of the current tables, 0 if the tables are unknown
+ *  @return kSMCDetection*
+ */
+static inline int smcDetectionCachedVerdict(const void *data, UInt32 length, UInt32 checksum)
+{
+    const SMCDetectionVerdict *verdict = (const SMCDetectionVerdict *)data;
+
+    if (!data || !checksum || length != sizeof(SMCDetectionVerdict))
+        return kSMCDetectionUnknown;
+
+    if (verdict->version != kSMCDetectionVerdictVersion || verdict->checksum != checksum)
+        return kSMCDetectionUnknown;
+
+    return verdict->found ? kSMCDetectionFound : kSMCDetectionAbsent;
+}
+
+static inline void smcDetectionMakeVerdict(SMCDetectionVerdict *verdict, UInt32 checksum, int found)
+{
+    verdict->version = kSMCDetectionVerdictVersion;
+    verdict->found = found ? 1 : 0;
+    verdict->reserved = 0;
+    verdict->checksum = checksum;
+}
+
+#endif
@@ -0,0 +1,116 @@
+//
+//  SyntheticScenario.h
+//  HWSensors
+//
+//  Load profile of SyntheticSensors: value patterns, read latency and failures. Plain C without
+//  kernel dependencies, so the same profiles can drive a benchmark built for the host.
+
+#ifndef __HWSensors__SyntheticScenario__
+#define __HWSensors__SyntheticScenario__
+
+#include <stdint.h>
+
+enum {
+    kSyntheticPatternConstant = 0,
+    kSyntheticPatternSine,
+    kSyntheticPatternRamp,
+    kSyntheticPatternRandom,
+};
+
+typedef struct {
+    uint32_t    pattern;            // kSyntheticPattern*
+    float       base;
+    float       amplitude;
+    uint32_t    period;             // milliseconds
+    uint32_t    latencyMin;         // microseconds
+    uint32_t    latencyMax;         // microseconds
+    uint32_t    slowReadRate;       // per mille
+    uint32_t    slowReadLatency;    // microseconds
+    uint32_t    failureRate;        // per mille
+} SyntheticScenario;
+
+// xorshift32, state must not be 0
+static inline uint32_t syntheticScenarioRandom(uint32_t *state)
+{
+    uint32_t x = *state;
+
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+
+    return *state = x;
+}
+
+static inline uint32_t syntheticScenarioSeed(uint32_t index)
+{
+    return (index + 1) * 2654435761U;
+}
+
+// Random state of one read of a sensor, so concurrent reads of the same sensor each draw from their own state
+// instead of sharing one. Reads are numbered by the caller, murmur3 finalizer mixes the number in
+static inline uint32_t syntheticScenarioReadState(uint32_t index, uint32_t read)
+{
+    uint32_t x = syntheticScenarioSeed(index) ^ (read * 0x85ebca6bU);
+
+    x ^= x >> 16;
+    x *= 0x7feb352dU;
+    x ^= x >> 15;
+    x *= 0x846ca68bU;
+    x ^= x >> 16;
+
+    return x ? x : 1;
+}
+
+// Sine of a full turn fraction, Bhaskara approximation is close enough and needs no libm in kernel
+static inline float syntheticScenarioSine(float turn)
+{
+    float sign = 1;
+
+    if (turn >= 0.5f) {
+        turn -= 0.5f;
+        sign = -1;
+    }
+
+    float x = 2 * turn * (1 - 2 * turn);
+
+    return sign * 4 * x / (1.25f - x);
+}
+
+// Value of a sensor at a moment, sensors are phase shifted by index so they don't move in lockstep
+static inline float syntheticScenarioValue(const SyntheticScenario *scenario, uint32_t *state, uint32_t index, uint64_t milliseconds)
+{
+    float turn = scenario->period ? (float)((milliseconds + (uint64_t)index * scenario->period / 16) % scenario->period) / scenario->period : 0;
+
+    switch (scenario->pattern) {
+        case kSyntheticPatternSine:
+            return scenario->base + scenario->amplitude * syntheticScenarioSine(turn);
+
+        case kSyntheticPatternRamp:
+            return scenario->base + scenario->amplitude * turn;
+
+        case kSyntheticPatternRandom:
+            return scenario->base + scenario->amplitude * ((float)syntheticScenarioRandom(state) / 4294967296.0f * 2 - 1);
+
+        default:
+            return scenario->base;
+    }
+}
+
+// Microseconds the next read should take
+static inline uint32_t syntheticScenarioLatency(const SyntheticScenario *scenario, uint32_t *state)
+{
+    if (scenario->slowReadRate && syntheticScenarioRandom(state) % 1000 < scenario->slowReadRate)
+        return scenario->slowReadLatency;
+
+    if (scenario->latencyMax > scenario->latencyMin)
+        return scenario->latencyMin + syntheticScenarioRandom(state) % (scenario->latencyMax - scenario->latencyMin + 1);
+
+    return scenario->latencyMin;
+}
+
+static inline int syntheticScenarioShouldFail(const SyntheticScenario *scenario, uint32_t *state)
+{
+    return scenario->failureRate && syntheticScenarioRandom(state) % 1000 < scenario->failureRate;
+}
+
+#endif /* defined(__HWSensors__SyntheticScenario__) */
@@ -0,0 +1,158 @@
+//
+//  SyntheticSensors.cpp
+//  HWSensors
+//
+
+#include "SyntheticSensors.h"
+
+#include "FakeSMCDefinitions.h"
+
+#include "timer.h"
+
+#define super FakeSMCPlugin
+OSDefineMetaClassAndStructors(SyntheticSensors, FakeSMCPlugin)
+
+static UInt32 syntheticSensorsGetNumber(OSDictionary *configuration, const char *name, UInt32 defaultValue)
+{
+    OSNumber *number = OSDynamicCast(OSNumber, configuration->getObject(name));
+
+    return number ? number->unsigned32BitValue() : defaultValue;
+}
+
+/**
+ *  For internal use, fractional values are multiplied by 1000 like sensor modifiers
+ *
+ */
+void SyntheticSensors::parseScenario(OSDictionary *configuration)
+{
+    scenario.pattern = kSyntheticPatternConstant;
+
+    if (OSString *pattern = OSDynamicCast(OSString, configuration->getObject("Pattern"))) {
+        if (pattern->isEqualTo("sine"))
+            scenario.pattern = kSyntheticPatternSine;
+        else if (pattern->isEqualTo("ramp"))
+            scenario.pattern = kSyntheticPatternRamp;
+        else if (pattern->isEqualTo("random"))
+            scenario.pattern = kSyntheticPatternRandom;
+    }
+
+    scenario.base = (float)syntheticSensorsGetNumber(configuration, "Base", 40000) / 1000.0f;
+    scenario.amplitude = (float)syntheticSensorsGetNumber(configuration, "Amplitude", 0) / 1000.0f;
+    scenario.period = syntheticSensorsGetNumber(configuration, "Period", 10000);
+    scenario.latencyMin = syntheticSensorsGetNumber(configuration, "LatencyMin", 0);
+    scenario.latencyMax = syntheticSensorsGetNumber(configuration, "LatencyMax", scenario.latencyMin);
+    scenario.slowReadRate = syntheticSensorsGetNumber(configuration, "SlowReadRate", 0);
+    scenario.slowReadLatency = syntheticSensorsGetNumber(configuration, "SlowReadLatency", 0);
+    scenario.failureRate = syntheticSensorsGetNumber(configuration, "FailureRate", 0);
+}
+
+bool SyntheticSensors::willReadSensorValue(FakeSMCSensor *sensor, float *outValue)
+{
+    UInt32 index = sensor->getIndex();
+
+    if (index >= readsCount)
+        return false;
+
+    // Readers and the sampling timer may read a sensor at the same time, each read gets a state of its own
+    UInt32 state = syntheticScenarioReadState(index, (UInt32)OSIncrementAtomic(&reads[index]));
+    UInt32 latency = syntheticScenarioLatency(&scenario, &state);
+
+    // Long waits sleep like an ACPI method would, short ones spin like a port read
+    if (latency >= 1000)
+        IOSleep(latency / 1000);
+    else if (latency)
+        IODelay(latency);
+
+    if (syntheticScenarioShouldFail(&scenario, &state))
+        return false;
+
+    *outValue = syntheticScenarioValue(&scenario, &state, index, (ptimer_uptime() - startTime) / NSEC_PER_MSEC);
+
+    return true;
+}
+
+IOService *SyntheticSensors::probe(IOService *provider, SInt32 *score)
+{
+    int arg_value = 1;
+
+    if (!PE_parse_boot_argn("-syntheticsensors", &arg_value, sizeof(arg_value)))
+        return NULL;
+
+    return super::probe(provider, score);
+}
+
+bool SyntheticSensors::shouldWaitForKeyStore()
+{
+    return false;
+}
+
+bool SyntheticSensors::startWithKeyStore(IOService *provider)
+{
+    UInt64 started = ptimer_uptime();
+
+    OSDictionary *configuration = getConfigurationNode();
+
+    if (!configuration) {
+        HWSensorsFatalLog("no scenario configured");
+        return false;
+    }
+
+    parseScenario(configuration);
+
+    UInt32 count = syntheticSensorsGetNumber(configuration, "KeyCount", 64);
+
+    if (count > kSyntheticSensorsMaxKeys)
+        count = kSyntheticSensorsMaxKeys;
+
+    if (!(reads = (volatile SInt32 *)IOMalloc(count * sizeof(SInt32)))) {
+        HWSensorsFatalLog("failed to allocate sensors state");
+        return false;
+    }
+
+    bzero((void *)reads, count * sizeof(SInt32));
+
+    readsCount = count;
+    startTime = ptimer_uptime();
+
+    OSBoolean *history = OSDynamicCast(OSBoolean, configuration->getObject("History"));
+
+    for (UInt32 index = 0; index < count; index++) {
+        char key[5];
+
+        snprintf(key, sizeof(key), "z%03x", (unsigned int)index);
+
+        FakeSMCSensor *sensor = addSensorForKey(key, TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCTemperatureSensor, index);
+
+        if (!sensor) {
+            HWSensorsWarningLog("failed to add synthetic sensor %s", key);
+            continue;
+        }
+
+        if (history && history->isTrue())
+            keepSensorHistory(sensor);
+    }
+
+    if (UInt32 period = syntheticSensorsGetNumber(configuration, "SamplingPeriod", 0))
+        setSamplingPeriod(kFakeSMCTemperatureSensor, period);
+
+    // Registration cost of a plugin with this many keys, e.g. KeyCount 500
+    UInt64 elapsed = (ptimer_uptime() - started) / NSEC_PER_USEC;
+
+    setProperty("Start Time", elapsed, 64);
+
+    registerService();
+
+    HWSensorsInfoLog("started with %u synthetic sensors in %llu us", (unsigned int)count, elapsed);
+
+    return true;
+}
+
+void SyntheticSensors::free(void)
+{
+    if (reads) {
+        IOFree((void *)reads, readsCount * sizeof(SInt32));
+        reads = NULL;
+    }
+
+    super::free();
+}
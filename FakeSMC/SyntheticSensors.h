@@ -0,0 +1,39 @@
+//
+//  SyntheticSensors.h
+//  HWSensors
+//
+//  Benchmarking plugin publishing any number of sensors driven by a SyntheticScenario load profile.
+//  Loads only with -syntheticsensors boot argument.
+//
+
+#ifndef __HWSensors__SyntheticSensors__
+#define __HWSensors__SyntheticSensors__
+
+#include "FakeSMCPlugin.h"
+#include "SyntheticScenario.h"
+
+#define kSyntheticSensorsMaxKeys    0x1000  // key names z000..zfff
+
+class EXPORT SyntheticSensors : public FakeSMCPlugin
+{
+    OSDeclareDefaultStructors(SyntheticSensors)
+
+private:
+    SyntheticScenario       scenario;
+    volatile SInt32         *reads;         // reads of every sensor so far, numbers the random state of the next one
+    UInt32                  readsCount;
+    UInt64                  startTime;      // monotonic nanoseconds
+
+    void                    parseScenario(OSDictionary *configuration);
+
+protected:
+    virtual bool            shouldWaitForKeyStore();
+    virtual bool            startWithKeyStore(IOService *provider);
+    virtual bool            willReadSensorValue(FakeSMCSensor *sensor, float *outValue);
+
+public:
+    virtual IOService       *probe(IOService *provider, SInt32 *score);
+    virtual void            free(void);
+};
+
+#endif /* defined(__HWSensors__SyntheticSensors__) */
@@ -0,0 +1,63 @@
+//
+//  FakeSMCConfigurationLinks.h
+//  HWSensors
+//
+//  Link resolution between platform profile nodes of FakeSMCPlugin. Plain C with no IOKit
+//  dependencies, so the same code runs in the host tests (see Tests/). Profile objects are
+//  opaque here, the caller tells nodes from links
+//
+
+#ifndef HWSensors_FakeSMCConfigurationLinks_h
+#define HWSensors_FakeSMCConfigurationLinks_h
+
+#define kFakeSMCConfigurationMaxLinks       8   // longest chain of links between profile nodes
+
+enum {
+    kFakeSMCConfigurationNone           = 0,    // missing, or neither a node nor a link
+    kFakeSMCConfigurationNode           = 1,
+    kFakeSMCConfigurationLink           = 2,
+    kFakeSMCConfigurationTooManyLinks   = 3,
+};
+
+/**
+ *  Look up a name in the profile list
+ *
+ *  @param root   Profile list
+ *  @param name   Name of the node
+ *  @param object Receives the node, or the name it links to
+ *
+ *  @return kFakeSMCConfigurationNone, kFakeSMCConfigurationNode or kFakeSMCConfigurationLink
+ */
+typedef int (*FakeSMCConfigurationLookup)(const void *root, const void *name, const void **object);
+
+/**
+ *  Follow links from a name to a profile node, no more than kFakeSMCConfigurationMaxLinks of them, so a profile linking back to itself ends
+ *
+ *  @param outNode Receives the node on kFakeSMCConfigurationNode
+ *
+ *  @return kFakeSMCConfigurationNode, kFakeSMCConfigurationNone or kFakeSMCConfigurationTooManyLinks
+ */
+static inline int fakeSMCConfigurationResolve(const void *root, const void *name, FakeSMCConfigurationLookup lookup, const void **outNode)
+{
+    for (int links = 0; ; links++) {
+        const void *object = 0;
+
+        switch (lookup(root, name, &object)) {
+            case kFakeSMCConfigurationNode:
+                *outNode = object;
+                return kFakeSMCConfigurationNode;
+
+            case kFakeSMCConfigurationLink:
+                if (links >= kFakeSMCConfigurationMaxLinks)
+                    return kFakeSMCConfigurationTooManyLinks;
+
+                name = object;
+                break;
+
+            default:
+                return kFakeSMCConfigurationNone;
+        }
+    }
+}
+
+#endif
@@ -30,12 +30,37 @@
 #include "FakeSMCDefinitions.h"
 #include "FakeSMCKey.h"
 #include "FakeSMCKeyHandler.h"
+#include "FakeSMCKeyStore.h"
+#include "FakeSMCPlugin.h"
 
 #include "timer.h"
 
 #define super OSObject
 OSDefineMetaClassAndStructors(FakeSMCKey, OSObject)
 
+// Per-key critical section, guards value buffer against concurrent refresh/copy/write. Lock order is
+// gFakeSMCPluginLock, then the key store keysLock, then valueLock. valueLock is a leaf: handlers and
+// threshold observers are always called with it released
+#define VALUELOCK    IORecursiveLockLock(valueLock)
+#define VALUEUNLOCK  IORecursiveLockUnlock(valueLock)
+
+// Changes every time type or size of any key changes, 0 is never used so clients can tell it is supported
+static volatile SInt32 gFakeSMCKeyTypesEpoch = 1;
+
+static void fakeSMCKeyTypesChanged()
+{
+    if (OSIncrementAtomic(&gFakeSMCKeyTypesEpoch) == -1)
+        OSIncrementAtomic(&gFakeSMCKeyTypesEpoch);
+}
+
+UInt32 FakeSMCKey::getTypesEpoch()
+{
+    return (UInt32)gFakeSMCKeyTypesEpoch;
+}
+
+static FakeSMCKeyReadBudget gFakeSMCKeyReadBudget;
+static FakeSMCKeyHandlerThreads gFakeSMCKeyHandlerThreads;
+
 FakeSMCKey *FakeSMCKey::withValue(const char *aKey, const char *aType, unsigned char aSize, const void *aValue)
 {
     FakeSMCKey *me = new FakeSMCKey;
@@ -61,12 +86,15 @@ bool FakeSMCKey::init(const char * aKey, const char * aType, const unsigned char
     if (!super::init())
         return false;
 
+    if (!(valueLock = IORecursiveLockAlloc()))
+        return false;
+
 	if (!aKey || strnlen(aKey, 4) == 0 || !(key = (char *)IOMalloc(5)))
 		return false;
 	
 	copySymbol(aKey, key);
     
-	size = aSize > 32 ? 32 : aSize;
+	size = fakeSMCKeyClampSize(aSize);
 	
 	if (!(type = (char *)IOMalloc(5)))
 		return false;
@@ -116,6 +144,9 @@ void FakeSMCKey::free()
 	
 	if (value)
 		IOFree(value, size);
+
+    if (valueLock)
+        IORecursiveLockFree(valueLock);
 	
 	super::free(); 
 }
@@ -128,35 +159,128 @@ const char *FakeSMCKey::getType() { return type; };
 
 const UInt8 FakeSMCKey::getSize() const { return size; };
 
-const void *FakeSMCKey::getValue() 
-{ 
-	if (handler) {
-        
-        double time = ptimer_read_seconds();
-
-        // Allows update value twice in a second
-        if (time - lastValueReadTime >= 0.5) {
-            
-            IOReturn result = handler->readKeyCallback(key, type, size, value);
-            
-            if (kIOReturnSuccess == result) {
-                lastValueReadTime = time;
-            }
-            else {
-                HWSensorsWarningLog("value update request callback returned error for key %s (%s)", key, handler->stringFromReturn(result));
-            }
-        }
-	}
-    
-	return value; 
-};
+/**
+ *  Called with the key locked, returns with it locked. The lock is dropped while the handler runs, so
+ *  the handler may take its own locks and read other keys, or this one, without deadlocking
+ */
+void FakeSMCKey::refreshValue(FakeSMCKeyReadPriority priority, FakeSMCKeyThresholdCrossings *crossings)
+{
+    IOThread thread = IOThreadSelf();
+    UInt32 generation = 0;
+    bool nested = false;
+
+    for (;;) {
+        if (!handler || priority == kFakeSMCKeyReadCached)
+            return;
+
+        nested = fakeSMCKeyIsHandlerThread(&gFakeSMCKeyHandlerThreads, thread);
+
+        int action = fakeSMCKeyRefreshBegin(&refresh, &gFakeSMCKeyReadBudget, ptimer_uptime(), priority == kFakeSMCKeyReadBackground, nested, &generation);
+
+        if (action == kFakeSMCKeyRefreshCallHandler)
+            break;
+
+        if (action != kFakeSMCKeyRefreshWait)
+            return;
+
+        // Never read yet, wait for the read in flight rather than return the initial zeros
+        IORecursiveLockSleep(valueLock, &refresh, THREAD_UNINT);
+    }
+
+    // A handler reading keys is registered once, by its outermost read
+    int slot = nested ? -1 : fakeSMCKeyHandlerThreadEnter(&gFakeSMCKeyHandlerThreads, thread);
+
+    if (!nested && slot < 0) {
+        fakeSMCKeyRefreshEnd(&refresh, generation, 0, false);
+        IORecursiveLockWakeup(valueLock, &refresh, false);
+        return;
+    }
+
+    // Read once and hold a reference, setHandler may replace or clear it while the lock is dropped
+    FakeSMCKeyHandler *current = handler;
+    char currentType[5];
+    UInt8 currentSize = size;
+    UInt8 buffer[kFakeSMCKeyMaxSize];
+
+    current->retain();
+    copySymbol(type, currentType);
+    bcopy(value, buffer, currentSize);
+
+    VALUEUNLOCK;
+
+    IOReturn result = current->readKeyCallback(key, currentType, currentSize, buffer);
+
+    if (kIOReturnSuccess != result)
+        HWSensorsWarningLog("value update request callback returned error for key %s (%s)", key, current->stringFromReturn(result));
+
+    current->release();
+
+    if (slot >= 0)
+        fakeSMCKeyHandlerThreadLeave(&gFakeSMCKeyHandlerThreads, slot);
+
+    VALUELOCK;
+
+    // Size can't differ here, setSize drops reads in flight
+    if (fakeSMCKeyRefreshEnd(&refresh, generation, ptimer_uptime(), kIOReturnSuccess == result)) {
+        bcopy(buffer, value, size);
+        evaluateThreshold(crossings);
+    }
+
+    IORecursiveLockWakeup(valueLock, &refresh, false);
+}
+
+/**
+ *  Refresh the value and copy it, so concurrent readers and writers of the key never see a partially updated value
+ *
+ *  @param outBuffer Buffer to copy value to, should be large enough to fit kFakeSMCKeyMaxSize bytes
+ *  @param priority  Background reads may be served the cached value, see FakeSMCKeyReadPriority
+ *
+ *  @return Number of bytes copied
+ */
+UInt8 FakeSMCKey::copyValue(void *outBuffer, FakeSMCKeyReadPriority priority)
+{
+    FakeSMCKeyThresholdCrossings crossings = { 0 };
+    bool interactive = priority == kFakeSMCKeyReadInteractive;
+
+    if (interactive)
+        fakeSMCKeyReadBudgetEnter(&gFakeSMCKeyReadBudget);
+
+    VALUELOCK;
+
+    refreshValue(priority, &crossings);
+
+    UInt8 copied = size;
+
+    bcopy(value, outBuffer, copied);
+
+    VALUEUNLOCK;
+
+    if (interactive)
+        fakeSMCKeyReadBudgetLeave(&gFakeSMCKeyReadBudget);
+
+    deliverThresholdCrossings(&crossings);
+
+    return copied;
+}
 
 FakeSMCKeyHandler *FakeSMCKey::getHandler() { return handler; };
 
 bool FakeSMCKey::setType(const char *aType)
 {
     if (aType) {
-        copySymbol(aType, type);
+        char newType[5];
+
+        copySymbol(aType, newType);
+
+        VALUELOCK;
+
+        if (strncmp(type, newType, 4)) {
+            copySymbol(newType, type);
+            fakeSMCKeyTypesChanged();
+        }
+
+        VALUEUNLOCK;
+
         return true;
     }
     
@@ -165,7 +289,34 @@ bool FakeSMCKey::setType(const char *aType)
 
 bool FakeSMCKey::setSize(UInt8 aSize)
 {
-    size = aSize;
+    if (aSize == 0)
+        return false;
+
+    aSize = fakeSMCKeyClampSize(aSize);
+
+    VALUELOCK;
+
+    if (aSize != size) {
+        void *newValue = IOMalloc(aSize);
+
+        if (!newValue) {
+            VALUEUNLOCK;
+            return false;
+        }
+
+        bzero(newValue, aSize);
+
+        if (value)
+            IOFree(value, size);
+
+        value = newValue;
+        size = aSize;
+
+        fakeSMCKeyRefreshInvalidate(&refresh, true);
+        fakeSMCKeyTypesChanged();
+    }
+
+    VALUEUNLOCK;
     
     return true;
 }
@@ -174,6 +325,12 @@ bool FakeSMCKey::setValueFromBuffer(const void *aBuffer, UInt8 aSize)
 {
 	if (!aBuffer || aSize == 0) 
 		return false;
+
+    aSize = fakeSMCKeyClampSize(aSize);
+
+    FakeSMCKeyThresholdCrossings crossings = { 0 };
+
+    VALUELOCK;
 	
 	if (aSize != size) {
 		if (value)
@@ -181,53 +338,133 @@ bool FakeSMCKey::setValueFromBuffer(const void *aBuffer, UInt8 aSize)
 		
 		size = aSize;
 		
-		if (!(value = IOMalloc(size)))
+		if (!(value = IOMalloc(size))) {
+            VALUEUNLOCK;
 			return false;
+        }
+
+        fakeSMCKeyTypesChanged();
 	}
 	
 	bcopy(aBuffer, value, size);
 
-	if (handler) {
-        
-        /*double time = ptimer_read_seconds();
-        
-        if (time - lastValueWrote >= 0.5) {
-            
-            IOReturn result = handler->writeKeyCallback(key, type, size, value);
-            
-            if (kIOReturnSuccess == result) {
-                lastValueWrote = time;
-            }
-            else {
-                HWSensorsWarningLog("value changed event callback returned error for key %s (%s)", key, handler->stringFromReturn(result));
-            }
-        }*/
-
-        IOReturn result = handler->writeKeyCallback(key, type, size, value);
+    // A handler read started before the write must not overwrite it
+    fakeSMCKeyRefreshInvalidate(&refresh, false);
+
+    evaluateThreshold(&crossings);
+
+    FakeSMCKeyHandler *current = handler;
+    char currentType[5];
+    UInt8 currentSize = size;
+    UInt8 buffer[kFakeSMCKeyMaxSize];
+
+    if (current) {
+        current->retain();
+        copySymbol(type, currentType);
+        bcopy(value, buffer, currentSize);
+    }
+
+    VALUEUNLOCK;
+
+	if (current) {
+        IOReturn result = current->writeKeyCallback(key, currentType, currentSize, buffer);
 
         if (kIOReturnSuccess != result) {
-            HWSensorsWarningLog("value changed event callback returned error for key %s (%s)", key, handler->stringFromReturn(result));
+            HWSensorsWarningLog("value changed event callback returned error for key %s (%s)", key, current->stringFromReturn(result));
         }
+
+        current->release();
     }
+
+    deliverThresholdCrossings(&crossings);
 	
 	return true;
 }
 
 bool FakeSMCKey::setHandler(FakeSMCKeyHandler *newHandler)
 {
-    if (handler && newHandler) {
-        if (newHandler->getProbeScore() < handler->getProbeScore()) {
-            HWSensorsErrorLog("key %s already handled with prioritized handler %s", key, handler->getName());
-            return false;
-        }
-        else {
-            handler = newHandler;
+    VALUELOCK;
 
-            HWSensorsInfoLog("key %s handler %s has been replaced with new prioritized handler %s", key, handler->getName(), newHandler->getName());
-        }
+    if (handler && newHandler && handler != newHandler && newHandler->getProbeScore() < handler->getProbeScore()) {
+        HWSensorsErrorLog("key %s already handled with prioritized handler %s", key, handler->getName());
+        VALUEUNLOCK;
+        return false;
     }
 
-	return false;
+    handler = newHandler;
+
+    // Value will be requested from the new handler on next read
+    fakeSMCKeyRefreshInvalidate(&refresh, true);
+
+    VALUEUNLOCK;
+
+	return true;
+}
+
+/**
+ *  Set threshold rule for the key. Rule is evaluated every time the key value is refreshed by handler or written, crossings are reported to observer once the key lock is released
+ *
+ *  @param aThreshold Threshold rule, rule with no flags set removes the threshold
+ *  @param anObserver Key store to report crossings to
+ *
+ *  @return True on success False otherwise
+ */
+bool FakeSMCKey::setThreshold(const SMCKeyThreshold_t *aThreshold, FakeSMCKeyStore *anObserver)
+{
+    VALUELOCK;
+
+    fakeSMCKeyThresholdSetRule(&threshold, aThreshold);
+
+    if (threshold.rule.flags)
+        thresholdObserver = anObserver;
+
+    VALUEUNLOCK;
+
+    return true;
+}
+
+bool FakeSMCKey::getThreshold(SMCKeyThreshold_t *outThreshold)
+{
+    if (!outThreshold)
+        return false;
+
+    VALUELOCK;
+
+    bcopy(&threshold.rule, outThreshold, sizeof(SMCKeyThreshold_t));
+
+    VALUEUNLOCK;
+
+    return true;
+}
+
+// Called with the key locked, only records the crossings
+void FakeSMCKey::evaluateThreshold(FakeSMCKeyThresholdCrossings *crossings)
+{
+    if (!threshold.rule.flags)
+        return;
+
+    float current = 0;
+
+    if (!fakeSMCPluginDecodeFloatValue(type, size, value, &current)) {
+        int intValue = 0;
+
+        if (!fakeSMCPluginDecodeIntValue(type, size, value, &intValue))
+            return;
+
+        current = intValue;
+    }
+
+    fakeSMCKeyThresholdEvaluate(&threshold, current, ptimer_uptime(), crossings);
+}
+
+// Called with the key unlocked, the observer takes its own locks
+void FakeSMCKey::deliverThresholdCrossings(const FakeSMCKeyThresholdCrossings *crossings)
+{
+    if (!thresholdObserver)
+        return;
+
+    for (UInt32 i = 0; i < crossings->count; i++)
+        thresholdObserver->thresholdCrossed(this, crossings->events[i], crossings->value);
 }
 
 bool FakeSMCKey::isEqualTo(const char *aKey)
@@ -30,6 +30,10 @@
 
 #include <IOKit/IOService.h>
 
+#include "smc.h"
+#include "FakeSMCKeyThreshold.h"
+#include "FakeSMCKeyRefresh.h"
+
 #ifndef EXPORT
 #define EXPORT __attribute__((visibility("default")))
 #endif
@@ -42,6 +46,15 @@ inline void copySymbol(const char *from, char* to)
 }
 
 class FakeSMCKeyHandler;
+class FakeSMCKeyStore;
+
+// Read priority classes. Background reads get handler refreshes only while no interactive read
+// is in flight and within a global budget, otherwise they are served the cached value
+enum FakeSMCKeyReadPriority {
+    kFakeSMCKeyReadInteractive  = 0,    // SMC port traffic, kernel consumers and user clients by default
+    kFakeSMCKeyReadBackground   = 1,    // user clients opened with SMC_CONNECTION_BACKGROUND, e.g. bulk enumeration
+    kFakeSMCKeyReadCached       = 2,    // never asks the handler, for callers holding the key store lock
+};
 
 class EXPORT FakeSMCKey : public OSObject
 {
@@ -53,13 +66,22 @@ private:
 	UInt8               size;
 	void *              value;
 	FakeSMCKeyHandler * handler;
+    IORecursiveLock *   valueLock;
+
+    FakeSMCKeyRefresh   refresh;
 
-    double              lastValueReadTime;
-    //double              lastValueWroteTime;
+    FakeSMCKeyThreshold threshold;
+    FakeSMCKeyStore     *thresholdObserver;
+
+    void                evaluateThreshold(FakeSMCKeyThresholdCrossings *crossings);
+    void                deliverThresholdCrossings(const FakeSMCKeyThresholdCrossings *crossings);
+    void                refreshValue(FakeSMCKeyReadPriority priority, FakeSMCKeyThresholdCrossings *crossings);
 	
 public:
 	static FakeSMCKey   *withValue(const char *aKey, const char *aType, const unsigned char aSize, const void *aValue);
 	static FakeSMCKey   *withHandler(const char *aKey, const char *aType, const unsigned char aSize, FakeSMCKeyHandler *aHandler);
+
+    static UInt32       getTypesEpoch(void);
     
     // Not for general use. Use withHandler or withValue instance creation method
 	virtual bool        init(const char * aKey, const char * aType, const unsigned char aSize, const void *aValue, FakeSMCKeyHandler *aHandler = 0);
@@ -71,13 +93,16 @@ public:
 	const char          *getKey();
 	const char          *getType();
 	const UInt8         getSize() const;
-	const void          *getValue();
+    UInt8               copyValue(void *outBuffer, FakeSMCKeyReadPriority priority = kFakeSMCKeyReadInteractive);
     FakeSMCKeyHandler   *getHandler();
 	
     bool                setType(const char *aType);
     bool                setSize(UInt8 aSize);
 	bool                setValueFromBuffer(const void *aBuffer, UInt8 aSize);
 	bool                setHandler(FakeSMCKeyHandler *aHandler);
+
+    bool                setThreshold(const SMCKeyThreshold_t *aThreshold, FakeSMCKeyStore *anObserver);
+    bool                getThreshold(SMCKeyThreshold_t *outThreshold);
 	
 	bool                isEqualTo(const char *aKey);
 	bool                isEqualTo(FakeSMCKey *aKey);
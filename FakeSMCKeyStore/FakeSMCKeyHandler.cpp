@@ -32,11 +32,16 @@ OSDefineMetaClassAndStructors(FakeSMCKeyHandler, IOService)
 
 UInt32 FakeSMCKeyHandler::getProbeScore()
 {
-    if (OSNumber *priority = OSDynamicCast(OSNumber, getProperty("IOProbeScore"))) {
-        return priority->unsigned32BitValue();
+    // Score is settled by matching before the handler starts registering keys, so look it up once
+    if (!probeScoreCached) {
+        if (OSNumber *priority = OSDynamicCast(OSNumber, getProperty("IOProbeScore"))) {
+            probeScore = priority->unsigned32BitValue();
+        }
+
+        probeScoreCached = true;
     }
 
-    return 0;
+    return probeScore;
 }
 
 IOReturn FakeSMCKeyHandler::readKeyCallback(const char *key, const char *type, const UInt8 size, void *buffer)
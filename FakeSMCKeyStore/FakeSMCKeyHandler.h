@@ -38,6 +38,9 @@ class EXPORT FakeSMCKeyHandler : public IOService {
     friend class FakeSMCKey;
 
 private:
+    UInt32              probeScore;
+    bool                probeScoreCached;
+
     virtual IOReturn    readKeyCallback(const char *key, const char *type, const UInt8 size, void *buffer);
     virtual IOReturn    writeKeyCallback(const char *key, const char *type, const UInt8 size, const void *value);
     
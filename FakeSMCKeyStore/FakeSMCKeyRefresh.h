@@ -0,0 +1,165 @@
+//
+//  FakeSMCKeyRefresh.h
+//  HWSensors
+//
+//  Decides when a key read asks the key handler for a new value. Plain C with no IOKit
+//  dependencies, so the same code runs in the host tests (see Tests/). Every call is made
+//  with the key lock held, the caller drops the lock while the handler runs
+//
+
+#ifndef HWSensors_FakeSMCKeyRefresh_h
+#define HWSensors_FakeSMCKeyRefresh_h
+
+#define kFakeSMCKeyValueLifetime                    500000000ull    // nanoseconds, handler is asked twice a second at most
+#define kFakeSMCKeyBackgroundRefreshesPerSecond     128
+#define kFakeSMCKeyHandlerThreads                   32
+#define kFakeSMCKeyMaxSize                          32              // bytes, the SMC protocol never carries more
+
+// Shared by all keys. Background reads of a key already read once get handler refreshes only
+// while no interactive read is in flight and within the per second budget
+typedef struct {
+    volatile SInt32     interactiveReads;   // in flight
+    volatile UInt32     window;             // current quarter of a second
+    volatile SInt32     refreshes;          // background refreshes spent in the window
+} FakeSMCKeyReadBudget;
+
+// Threads running a key handler. They never wait for the refresh of another key, so handlers
+// reading keys can't end up waiting on each other in a cycle
+typedef struct {
+    void * volatile     threads[kFakeSMCKeyHandlerThreads];
+} FakeSMCKeyHandlerThreads;
+
+typedef struct {
+    UInt64              lastRefresh;        // monotonic nanoseconds of the last handler read, 0 if never read
+    UInt32              refreshing;         // a handler read is in flight, readers don't start another one
+    UInt32              generation;         // changed by writes and by size and handler changes, a read started before is dropped
+} FakeSMCKeyRefresh;
+
+enum {
+    kFakeSMCKeyRefreshUseCached     = 0,
+    kFakeSMCKeyRefreshCallHandler   = 1,    // caller runs the handler and reports with fakeSMCKeyRefreshEnd
+    kFakeSMCKeyRefreshWait          = 2,    // value was never read, wait for the read in flight and ask again
+};
+
+/**
+ *  Size a key value is stored with, larger writes from the SMC port or user clients are truncated
+ */
+static inline UInt8 fakeSMCKeyClampSize(UInt32 size)
+{
+    return size > kFakeSMCKeyMaxSize ? kFakeSMCKeyMaxSize : (UInt8)size;
+}
+
+/**
+ *  Register the current thread before it calls a handler
+ *
+ *  @return Slot to pass to fakeSMCKeyHandlerThreadLeave, -1 if all slots are taken and the handler must not be called
+ */
+static inline int fakeSMCKeyHandlerThreadEnter(FakeSMCKeyHandlerThreads *set, void *thread)
+{
+    for (int slot = 0; slot < kFakeSMCKeyHandlerThreads; slot++)
+        if (!set->threads[slot] && __sync_bool_compare_and_swap(&set->threads[slot], (void *)0, thread))
+            return slot;
+
+    return -1;
+}
+
+static inline void fakeSMCKeyHandlerThreadLeave(FakeSMCKeyHandlerThreads *set, int slot)
+{
+    __sync_lock_release(&set->threads[slot]);
+}
+
+static inline int fakeSMCKeyIsHandlerThread(FakeSMCKeyHandlerThreads *set, void *thread)
+{
+    for (int slot = 0; slot < kFakeSMCKeyHandlerThreads; slot++)
+        if (set->threads[slot] == thread)
+            return 1;
+
+    return 0;
+}
+
+static inline void fakeSMCKeyReadBudgetEnter(FakeSMCKeyReadBudget *budget)
+{
+    __sync_fetch_and_add(&budget->interactiveReads, 1);
+}
+
+static inline void fakeSMCKeyReadBudgetLeave(FakeSMCKeyReadBudget *budget)
+{
+    __sync_fetch_and_sub(&budget->interactiveReads, 1);
+}
+
+static inline int fakeSMCKeyReadBudgetTake(FakeSMCKeyReadBudget *budget, UInt64 time)
+{
+    if (budget->interactiveReads > 0)
+        return 0;
+
+    UInt32 window = (UInt32)(time / (1000000000ull / 4));
+    UInt32 last = budget->window;
+
+    if (window != last && __sync_bool_compare_and_swap(&budget->window, last, window))
+        budget->refreshes = 0;
+
+    return __sync_fetch_and_add(&budget->refreshes, 1) < kFakeSMCKeyBackgroundRefreshesPerSecond / 4;
+}
+
+/**
+ *  Decide how a read of a handled key is served
+ *
+ *  @param refresh       Refresh state of the key
+ *  @param budget        Shared read budget
+ *  @param time          Monotonic time in nanoseconds
+ *  @param background    Read has background priority
+ *  @param nested        Reader is running a handler itself, see FakeSMCKeyHandlerThreads
+ *  @param outGeneration Receives the token to pass to fakeSMCKeyRefreshEnd
+ *
+ *  @return kFakeSMCKeyRefresh*
+ */
+static inline int fakeSMCKeyRefreshBegin(FakeSMCKeyRefresh *refresh, FakeSMCKeyReadBudget *budget, UInt64 time, int background, int nested, UInt32 *outGeneration)
+{
+    if (refresh->refreshing)
+        return refresh->lastRefresh || nested ? kFakeSMCKeyRefreshUseCached : kFakeSMCKeyRefreshWait;
+
+    if (refresh->lastRefresh && time - refresh->lastRefresh < kFakeSMCKeyValueLifetime)
+        return kFakeSMCKeyRefreshUseCached;
+
+    // A key never read has no cached value to fall back to, it is read whatever the budget
+    if (background && refresh->lastRefresh && !fakeSMCKeyReadBudgetTake(budget, time))
+        return kFakeSMCKeyRefreshUseCached;
+
+    refresh->refreshing = 1;
+    *outGeneration = refresh->generation;
+
+    return kFakeSMCKeyRefreshCallHandler;
+}
+
+/**
+ *  Finish a handler read started with fakeSMCKeyRefreshBegin, then wake up readers waiting for it
+ *
+ *  @return True if the value read should be stored
+ */
+static inline int fakeSMCKeyRefreshEnd(FakeSMCKeyRefresh *refresh, UInt32 generation, UInt64 time, int succeeded)
+{
+    refresh->refreshing = 0;
+
+    if (!succeeded || generation != refresh->generation)
+        return 0;
+
+    refresh->lastRefresh = time ? time : 1;
+
+    return 1;
+}
+
+/**
+ *  Drop handler reads in flight
+ *
+ *  @param refresh Refresh state of the key
+ *  @param stale   Value no longer comes from the handler, next read asks the handler right away
+ */
+static inline void fakeSMCKeyRefreshInvalidate(FakeSMCKeyRefresh *refresh, int stale)
+{
+    refresh->generation++;
+
+    if (stale)
+        refresh->lastRefresh = 0;
+}
+
+#endif
@@ -33,13 +33,17 @@
 
 #include "OEMInfo.h"
 
+#include "timer.h"
+
 #include <IOKit/IONVRAM.h>
+#include <IOKit/IOBufferMemoryDescriptor.h>
 #include <IOKit/IOLib.h>
 
 #define super IOService
 OSDefineMetaClassAndStructors(FakeSMCKeyStore, IOService)
 
 //REVIEW_REHABMAN: This code *IS NOT* thread safe.  Need locks...
+// Taken after gFakeSMCPluginLock and before any key valueLock, see FakeSMCKey.cpp
 #define KEYSLOCK    IORecursiveLockLock(keysLock)
 #define KEYSUNLOCK  IORecursiveLockUnlock(keysLock)
 
@@ -55,6 +59,11 @@ void FakeSMCKeyStore::updateKeyCounterKey()
 {
     KEYSLOCK;
 
+    if (bulkInsertDepth) {
+        KEYSUNLOCK;
+        return;
+    }
+
 	UInt32 count = OSSwapHostToBigInt32(keys->getCount());
 
 	//char value[] = { static_cast<char>(count << 24), static_cast<char>(count << 16), static_cast<char>(count << 8), static_cast<char>(count) };
@@ -88,6 +97,9 @@ FakeSMCKey *FakeSMCKeyStore::addKeyWithValue(const char *name, const char *type,
     
     FakeSMCKey* key;
 	if ((key = getKey(name))) {
+
+        // Keys are never removed, so the key outlives the lock. The write may call the key handler, which must not run under the store lock
+        KEYSUNLOCK;
         
 //        if (type && strncmp(type, key->getType(), 4) == 0) {
 //            key->setType(type);
@@ -99,8 +111,12 @@ FakeSMCKey *FakeSMCKeyStore::addKeyWithValue(const char *name, const char *type,
         
 #ifdef DEBUG
         if (kHWSensorsDebug) {
+            SMCBytes_t bytes;
+
+            key->copyValue(bytes, kFakeSMCKeyReadCached);
+
             if (strncmp("NATJ", key->getKey(), 5) == 0) {
-                UInt8 val = *(UInt8*)key->getValue();
+                UInt8 val = bytes[0];
                 
                 switch (val) {
                     case 0:
@@ -124,12 +140,12 @@ FakeSMCKey *FakeSMCKeyStore::addKeyWithValue(const char *name, const char *type,
                 }
             }
             else if (strncmp("NATi", key->getKey(), 5) == 0) {
-                UInt16 val = *(UInt16*)key->getValue();
+                UInt16 val = *(UInt16*)bytes;
                 
                 HWSensorsInfoLog("Ninja Action Timer is set to %d", val);
             }
             else if (strncmp("MSDW", key->getKey(), 5) == 0) {
-                UInt8 val = *(UInt8*)key->getValue();
+                UInt8 val = bytes[0];
                 
                 switch (val) {
                     case 0:
@@ -148,6 +164,8 @@ FakeSMCKey *FakeSMCKeyStore::addKeyWithValue(const char *name, const char *type,
         
 		HWSensorsDebugLog("value updated for key %s, type: %s, size: %d", key->getKey(), key->getType(), key->getSize());
 #endif
+
+        return key;
 	}
     else {
         
@@ -160,6 +178,8 @@ FakeSMCKey *FakeSMCKeyStore::addKeyWithValue(const char *name, const char *type,
         key = FakeSMCKey::withValue(name, type ? type : wellKnownType ? wellKnownType->getCStringNoCopy() : 0, size, value);
         if (key) {
             keys->setObject(key);
+            keyIndex->setObject(key->getKey(), key);
+            applyKeyThreshold(key);
             updateKeyCounterKey();
         }
 	}
@@ -172,22 +192,26 @@ FakeSMCKey *FakeSMCKeyStore::addKeyWithValue(const char *name, const char *type,
 	return key;
 }
 
-FakeSMCKey *FakeSMCKeyStore::addKeyWithHandler(const char *name, const char *type, unsigned char size, FakeSMCKeyHandler *handler)
+FakeSMCKey *FakeSMCKeyStore::addKeyWithHandler(const char *name, const char *type, unsigned char size, FakeSMCKeyHandler *handler, bool *outCreated)
 {
     FakeSMCKey *key = 0;
     
+    if (outCreated)
+        *outCreated = false;
+    
     KEYSLOCK;
     
     if ((key = getKey(name))) {
         
         FakeSMCKeyHandler *existedHandler = key->getHandler();
         
-        if (handler->getProbeScore() < existedHandler->getProbeScore()) {
-            HWSensorsErrorLog("key %s already handled with prioritized handler %s", name, existedHandler ? existedHandler->getName() : "*Unreferenced*");
+        if (existedHandler && existedHandler != handler && handler->getProbeScore() < existedHandler->getProbeScore()) {
+            HWSensorsErrorLog("key %s already handled with prioritized handler %s", name, existedHandler->getName());
             key = 0;
         }
         else {
-            HWSensorsInfoLog("key %s handler %s has been replaced with new prioritized handler %s", name, existedHandler ? existedHandler->getName() : "*Unreferenced*", handler ? handler->getName() : "*Unreferenced*");
+            if (existedHandler && existedHandler != handler)
+                HWSensorsInfoLog("key %s handler %s has been replaced with new prioritized handler %s", name, existedHandler->getName(), handler ? handler->getName() : "*Unreferenced*");
             
             key->setType(type);
             key->setSize(size);
@@ -201,8 +225,13 @@ FakeSMCKey *FakeSMCKeyStore::addKeyWithHandler(const char *name, const char *typ
         if ((key = FakeSMCKey::withHandler(name, type, size, handler))) {
             ////KEYSLOCK;
             keys->setObject(key);
+            keyIndex->setObject(key->getKey(), key);
             ////KEYSUNLOCK;
+            applyKeyThreshold(key);
             updateKeyCounterKey();
+            
+            if (outCreated)
+                *outCreated = true;
         }
     }
     
@@ -216,25 +245,14 @@ FakeSMCKey *FakeSMCKeyStore::addKeyWithHandler(const char *name, const char *typ
 
 FakeSMCKey *FakeSMCKeyStore::getKey(const char *name)
 {
+    // Made the key name valid (4 char long): add trailing spaces if needed
+    char validKeyNameBuffer[5];
+    copySymbol(name, validKeyNameBuffer);
+
     KEYSLOCK;
     
-    FakeSMCKey* key = 0;
-    if (OSCollectionIterator *iterator = OSCollectionIterator::withCollection(keys)) {
-        
-        // Made the key name valid (4 char long): add trailing spaces if needed
-        char validKeyNameBuffer[5];
-        copySymbol(name, validKeyNameBuffer);
-        
-		while ((key = OSDynamicCast(FakeSMCKey, iterator->getNextObject()))) {
-            UInt32 key1 = HWSensorsKeyToInt(&validKeyNameBuffer);
-			UInt32 key2 = HWSensorsKeyToInt(key->getKey());
-			if (key1 == key2) {
-				break;
-			}
-		}
-        
-        OSSafeRelease(iterator);
-	}
+    FakeSMCKey* key = OSDynamicCast(FakeSMCKey, keyIndex->getObject(validKeyNameBuffer));
+
     KEYSUNLOCK;
     
     if (!key)
@@ -267,6 +285,17 @@ UInt32 FakeSMCKeyStore::addKeysFromDictionary(OSDictionary* dictionary)
     UInt32 keysAdded = 0;
 
     if (dictionary) {
+        // Storage grows once and #KEY is written once at the end. The store lock isn't held across
+        // the loop: writing a key that exists already calls its handler
+        KEYSLOCK;
+
+        keys->ensureCapacity(keys->getCount() + dictionary->getCount());
+        keyIndex->ensureCapacity(keyIndex->getCount() + dictionary->getCount());
+
+        bulkInsertDepth++;
+
+        KEYSUNLOCK;
+
         if (OSIterator *iterator = OSCollectionIterator::withCollection(dictionary)) {
             while (const OSSymbol *key = (const OSSymbol *)iterator->getNextObject()) {
                 if (OSArray *array = OSDynamicCast(OSArray, dictionary->getObject(key))) {
@@ -288,6 +317,15 @@ UInt32 FakeSMCKeyStore::addKeysFromDictionary(OSDictionary* dictionary)
             
             OSSafeRelease(iterator);
         }
+
+        // Keys added meanwhile by other threads skipped the update too, the count covers them
+        KEYSLOCK;
+
+        bulkInsertDepth--;
+
+        updateKeyCounterKey();
+
+        KEYSUNLOCK;
     }
 
     return keysAdded;
@@ -310,6 +348,265 @@ UInt32 FakeSMCKeyStore::addWellKnownTypesFromDictionary(OSDictionary* dictionary
     return typesCount;
 }
 
+#pragma mark -
+#pragma mark Thresholds
+
+void FakeSMCKeyStore::applyKeyThreshold(FakeSMCKey *key)
+{
+    if (OSData *data = OSDynamicCast(OSData, thresholds->getObject(key->getKey()))) {
+        key->setThreshold((const SMCKeyThreshold_t *)data->getBytesNoCopy(), this);
+    }
+}
+
+bool FakeSMCKeyStore::setKeyThreshold(const char *name, const SMCKeyThreshold_t *threshold)
+{
+    if (!name || !threshold)
+        return false;
+
+    char validKeyNameBuffer[5];
+    copySymbol(name, validKeyNameBuffer);
+
+    KEYSLOCK;
+
+    // Keep the rule so keys added later by plugins pick it up
+    if (threshold->flags) {
+        if (OSData *data = OSData::withBytes(threshold, sizeof(SMCKeyThreshold_t))) {
+            thresholds->setObject(validKeyNameBuffer, data);
+            OSSafeRelease(data);
+        }
+    }
+    else {
+        thresholds->removeObject(validKeyNameBuffer);
+    }
+
+    bool result = true;
+
+    if (FakeSMCKey *key = getKey(validKeyNameBuffer))
+        result = key->setThreshold(threshold, this);
+
+    KEYSUNLOCK;
+
+    return result;
+}
+
+bool FakeSMCKeyStore::getKeyThreshold(const char *name, SMCKeyThreshold_t *threshold)
+{
+    if (!name || !threshold)
+        return false;
+
+    char validKeyNameBuffer[5];
+    copySymbol(name, validKeyNameBuffer);
+
+    KEYSLOCK;
+
+    bool result = false;
+
+    if (OSData *data = OSDynamicCast(OSData, thresholds->getObject(validKeyNameBuffer))) {
+        bcopy(data->getBytesNoCopy(), threshold, sizeof(SMCKeyThreshold_t));
+        result = true;
+    }
+
+    KEYSUNLOCK;
+
+    return result;
+}
+
+/**
+ *  Load threshold rules from configuration dictionary. Every key node may contain "High", "Low", "Hysteresis" and "Rate" (per second) numbers, all values are in thousandths of the key units
+ */
+UInt32 FakeSMCKeyStore::addThresholdsFromDictionary(OSDictionary* dictionary)
+{
+    UInt32 count = 0;
+
+    if (OSIterator *iterator = OSCollectionIterator::withCollection(dictionary)) {
+        while (OSString *key = OSDynamicCast(OSString, iterator->getNextObject())) {
+            if (OSDictionary *node = OSDynamicCast(OSDictionary, dictionary->getObject(key))) {
+
+                SMCKeyThreshold_t threshold;
+
+                bzero(&threshold, sizeof(threshold));
+
+                if (OSNumber *number = OSDynamicCast(OSNumber, node->getObject("High"))) {
+                    threshold.high = (float)(SInt64)number->unsigned64BitValue() / 1000.0f;
+                    bit_set(threshold.flags, SMC_THRESHOLD_HIGH);
+                }
+
+                if (OSNumber *number = OSDynamicCast(OSNumber, node->getObject("Low"))) {
+                    threshold.low = (float)(SInt64)number->unsigned64BitValue() / 1000.0f;
+                    bit_set(threshold.flags, SMC_THRESHOLD_LOW);
+                }
+
+                if (OSNumber *number = OSDynamicCast(OSNumber, node->getObject("Rate"))) {
+                    threshold.rate = (float)number->unsigned64BitValue() / 1000.0f;
+                    bit_set(threshold.flags, SMC_THRESHOLD_RATE);
+                }
+
+                if (OSNumber *number = OSDynamicCast(OSNumber, node->getObject("Hysteresis")))
+                    threshold.hysteresis = (float)number->unsigned64BitValue() / 1000.0f;
+
+                if (threshold.flags && setKeyThreshold(key->getCStringNoCopy(), &threshold))
+                    count++;
+            }
+        }
+        OSSafeRelease(iterator);
+    }
+
+    return count;
+}
+
+/**
+ *  Invoked by a key when its value crosses threshold rule limits, after the key lock is released. Delivers the event to every subscribed user client
+ */
+void FakeSMCKeyStore::thresholdCrossed(FakeSMCKey *key, UInt32 event, float value)
+{
+    SMCThresholdEvent_t record;
+
+    record.key = OSSwapBigToHostInt32(HWSensorsKeyToInt(key->getKey()));
+    record.event = event;
+    record.value = value;
+    record.timestamp = ptimer_uptime();
+
+    KEYSLOCK;
+
+    for (unsigned int i = 0; i < thresholdSubscribers->getCount(); i++) {
+        if (FakeSMCKeyStoreUserClient *client = OSDynamicCast(FakeSMCKeyStoreUserClient, thresholdSubscribers->getObject(i)))
+            client->enqueueThresholdEvent(&record);
+    }
+
+    KEYSUNLOCK;
+}
+
+/**
+ *  Publish the port protocol trace ring (SMCTraceRing_t) so user clients can map it
+ *
+ *  @param buffer Ring memory, 0 to withdraw it
+ */
+void FakeSMCKeyStore::setTraceBuffer(IOMemoryDescriptor *buffer)
+{
+    KEYSLOCK;
+
+    if (buffer)
+        buffer->retain();
+
+    OSSafeReleaseNULL(traceBuffer);
+
+    traceBuffer = buffer;
+
+    KEYSUNLOCK;
+}
+
+IOMemoryDescriptor *FakeSMCKeyStore::copyTraceBuffer(void)
+{
+    KEYSLOCK;
+
+    IOMemoryDescriptor *buffer = traceBuffer;
+
+    if (buffer)
+        buffer->retain();
+
+    KEYSUNLOCK;
+
+    return buffer;
+}
+
+/**
+ *  Take a sample history ring for a key, the shared history buffer is allocated with the first ring taken. A ring already taken for the key is handed out again, so history survives plugin reload
+ *
+ *  @param name   Key name
+ *  @param period Sampling period in milliseconds published to readers, 0 when sampled on demand
+ *
+ *  @return Ring to write samples into or 0 when no rings are left
+ */
+SMCHistoryRing_t *FakeSMCKeyStore::takeHistoryRing(const char *name, UInt32 period)
+{
+    SMCHistoryRing_t *ring = NULL;
+
+    if (!name)
+        return NULL;
+
+    KEYSLOCK;
+
+    if (!historyBuffer && (historyBuffer = IOBufferMemoryDescriptor::withOptions(kIODirectionInOut | kIOMemoryKernelUserShared, sizeof(SMCHistoryBuffer_t), PAGE_SIZE))) {
+        SMCHistoryBuffer_t *buffer = (SMCHistoryBuffer_t *)historyBuffer->getBytesNoCopy();
+
+        bzero(buffer, sizeof(SMCHistoryBuffer_t));
+
+        buffer->capacity = SMC_HISTORY_RINGS;
+        buffer->samples = SMC_HISTORY_SAMPLES;
+        buffer->sampleSize = sizeof(SMCHistorySample_t);
+    }
+
+    if (historyBuffer) {
+        SMCHistoryBuffer_t *buffer = (SMCHistoryBuffer_t *)historyBuffer->getBytesNoCopy();
+        UInt32 key = OSSwapBigToHostInt32(HWSensorsKeyToInt(name));
+
+        for (UInt32 index = 0; index < buffer->count; index++) {
+            if (buffer->rings[index].key == key) {
+                ring = &buffer->rings[index];
+                break;
+            }
+        }
+
+        if (!ring && buffer->count < buffer->capacity) {
+            ring = &buffer->rings[buffer->count];
+            ring->key = key;
+
+            // Readers only look at rings below count
+            OSSynchronizeIO();
+            buffer->count++;
+        }
+
+        if (ring)
+            ring->period = period;
+        else
+            HWSensorsErrorLog("no history rings left for %s", name);
+    }
+    else HWSensorsErrorLog("failed to allocate history buffer");
+
+    KEYSUNLOCK;
+
+    return ring;
+}
+
+IOMemoryDescriptor *FakeSMCKeyStore::copyHistoryBuffer(void)
+{
+    KEYSLOCK;
+
+    IOMemoryDescriptor *buffer = historyBuffer;
+
+    if (buffer)
+        buffer->retain();
+
+    KEYSUNLOCK;
+
+    return buffer;
+}
+
+void FakeSMCKeyStore::subscribeThresholdEvents(FakeSMCKeyStoreUserClient *client)
+{
+    KEYSLOCK;
+
+    if (thresholdSubscribers->getNextIndexOfObject(client, 0) < 0)
+        thresholdSubscribers->setObject(client);
+
+    KEYSUNLOCK;
+}
+
+void FakeSMCKeyStore::unsubscribeThresholdEvents(FakeSMCKeyStoreUserClient *client)
+{
+    KEYSLOCK;
+
+    int index = thresholdSubscribers->getNextIndexOfObject(client, 0);
+
+    if (index >= 0)
+        thresholdSubscribers->removeObject(index);
+
+    KEYSUNLOCK;
+}
+
+#pragma mark -
+#pragma mark GPU and Fan indexes
+
 SInt8 FakeSMCKeyStore::takeVacantGPUIndex()
 {
     //REVIEW_REHABMAN: lock required?
@@ -399,10 +696,18 @@ void FakeSMCKeyStore::saveKeyToNVRAM(FakeSMCKey *key)
 
         const OSSymbol *tempName = OSSymbol::withCString(name);
 
-        if (genericNVRAM)
-            nvram->IORegistryEntry::setProperty(tempName, OSData::withBytes(key->getValue(), key->getSize()));
-        else
-            nvram->setProperty(tempName, OSData::withBytes(key->getValue(), key->getSize()));
+        // Saved value is the one just written, don't call the handler under the store lock
+        SMCBytes_t bytes;
+        UInt8 size = key->copyValue(bytes, kFakeSMCKeyReadCached);
+
+        if (OSData *data = OSData::withBytes(bytes, size)) {
+            if (genericNVRAM)
+                nvram->IORegistryEntry::setProperty(tempName, data);
+            else
+                nvram->setProperty(tempName, data);
+
+            OSSafeRelease(data);
+        }
 
         OSSafeRelease(tempName);
         OSSafeRelease(nvram);
@@ -512,12 +817,17 @@ bool FakeSMCKeyStore::init(OSDictionary *properties)
         return false;
 
 	keys = OSArray::withCapacity(64);
+    keyIndex = OSDictionary::withCapacity(64);
     types = OSDictionary::withCapacity(16);
+    thresholds = OSDictionary::withCapacity(0);
+    thresholdSubscribers = OSArray::withCapacity(0);
 
     keyCounterKey = FakeSMCKey::withValue(KEY_COUNTER, TYPE_UI32, TYPE_UI32_SIZE, "\0\0\0\1");
     keys->setObject(keyCounterKey);
+    keyIndex->setObject(keyCounterKey->getKey(), keyCounterKey);
     fanCounterKey = FakeSMCKey::withValue(KEY_FAN_NUMBER, TYPE_UI8, TYPE_UI8_SIZE, "\0");
     keys->setObject(fanCounterKey);
+    keyIndex->setObject(fanCounterKey->getKey(), fanCounterKey);
 
 	return true;
 }
@@ -580,7 +890,12 @@ void FakeSMCKeyStore::free()
     }
     
     OSSafeRelease(keys);
+    OSSafeRelease(keyIndex);
     OSSafeRelease(types);
+    OSSafeRelease(thresholds);
+    OSSafeRelease(thresholdSubscribers);
+    OSSafeRelease(traceBuffer);
+    OSSafeRelease(historyBuffer);
 
     super::free();
 }
@@ -731,10 +1046,8 @@ IOReturn FakeSMCKeyStore::callPlatformFunction(const OSSymbol *functionName, boo
                 
                 if (param2 && param3) {
                     UInt8 *size = (UInt8*)param2;
-                    const void **value = (const void **)param3;
                     
-                    *size = key->getSize();
-                    *value = key->getValue();
+                    *size = key->copyValue(param3);
                     
                     result = kIOReturnSuccess;
                 }
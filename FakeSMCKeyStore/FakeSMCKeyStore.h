@@ -30,8 +30,12 @@
 
 #include <IOKit/IOService.h>
 
+#include "smc.h"
+
 class FakeSMCKey;
+class IOBufferMemoryDescriptor;
 class FakeSMCKeyHandler;
+class FakeSMCKeyStoreUserClient;
 
 class EXPORT FakeSMCKeyStore : public IOService
 {
@@ -40,14 +44,24 @@ class EXPORT FakeSMCKeyStore : public IOService
 private:
     IORecursiveLock     *keysLock;
     OSArray             *keys;
+    OSDictionary        *keyIndex;
     OSDictionary        *types;
+    OSDictionary        *thresholds;
+    OSArray             *thresholdSubscribers;
+
+    IOMemoryDescriptor  *traceBuffer;
+    IOBufferMemoryDescriptor *historyBuffer;
 
    	FakeSMCKey			*keyCounterKey;
     FakeSMCKey          *fanCounterKey;
 
+    UInt32              bulkInsertDepth;    // #KEY is updated once when the outermost bulk insert ends
+
     UInt16              vacantGPUIndex;
     UInt16              vacantFanIndex;
 
+    void                applyKeyThreshold(FakeSMCKey *key);
+
 #if NVRAMKEYS
     bool                useNVRAM;
     bool                genericNVRAM;
@@ -59,7 +73,7 @@ private:
 
 public:
     FakeSMCKey          *addKeyWithValue(const char *name, const char *type, unsigned char size, const void *value);
-	FakeSMCKey          *addKeyWithHandler(const char *name, const char *type, unsigned char size, FakeSMCKeyHandler *handler);
+	FakeSMCKey          *addKeyWithHandler(const char *name, const char *type, unsigned char size, FakeSMCKeyHandler *handler, bool *outCreated = 0);
 	FakeSMCKey          *getKey(const char *name);
 	FakeSMCKey          *getKey(unsigned int index);
     OSArray             *getKeys(void);
@@ -70,6 +84,18 @@ public:
 
     UInt32              addKeysFromDictionary(OSDictionary* dictionary);
     UInt32              addWellKnownTypesFromDictionary(OSDictionary* dictionary);
+    UInt32              addThresholdsFromDictionary(OSDictionary* dictionary);
+
+    bool                setKeyThreshold(const char *name, const SMCKeyThreshold_t *threshold);
+    bool                getKeyThreshold(const char *name, SMCKeyThreshold_t *threshold);
+    void                thresholdCrossed(FakeSMCKey *key, UInt32 event, float value);
+    void                subscribeThresholdEvents(FakeSMCKeyStoreUserClient *client);
+    void                unsubscribeThresholdEvents(FakeSMCKeyStoreUserClient *client);
+
+    void                setTraceBuffer(IOMemoryDescriptor *buffer);
+    IOMemoryDescriptor  *copyTraceBuffer(void);
+    SMCHistoryRing_t    *takeHistoryRing(const char *name, UInt32 period);
+    IOMemoryDescriptor  *copyHistoryBuffer(void);
 #if NVRAMKEYS
     void                saveKeyToNVRAM(FakeSMCKey *key);
     UInt32              loadKeysFromNVRAM();
@@ -59,11 +59,6 @@ inline UInt32 _strtoul(const char *str, int size, int base)
     return total;
 }
 
-static IORecursiveLock *gClientSyncLock = 0;
-
-#define SYNCLOCK        if (!gClientSyncLock) gClientSyncLock = IORecursiveLockAlloc(); IORecursiveLockLock(gClientSyncLock)
-#define SYNCUNLOCK      IORecursiveLockUnlock(gClientSyncLock)
-
 #define super IOUserClient
 OSDefineMetaClassAndStructors(FakeSMCKeyStoreUserClient, IOUserClient);
 
@@ -82,9 +77,19 @@ bool FakeSMCKeyStoreUserClient::start(IOService* provider)
 
 void FakeSMCKeyStoreUserClient::stop(IOService* provider)
 {
+    if (keyStore)
+        keyStore->unsubscribeThresholdEvents(this);
+
     super::stop(provider);
 }
 
+void FakeSMCKeyStoreUserClient::free(void)
+{
+    OSSafeReleaseNULL(thresholdEvents);
+
+    super::free();
+}
+
 bool FakeSMCKeyStoreUserClient::initWithTask(task_t owningTask, void* securityID, UInt32 type, OSDictionary* properties)
 {
     if (!owningTask) {
@@ -97,19 +102,93 @@ bool FakeSMCKeyStoreUserClient::initWithTask(task_t owningTask, void* securityID
 	}
 
     keyStore = NULL;
+
+    // Created once here, registerNotificationPort and clientMemoryForType may run at the same time
+    if (!(thresholdEvents = IOSharedDataQueue::withEntries(64, sizeof(SMCThresholdEvent_t)))) {
+        HWSensorsFatalLog("failed to allocate threshold events queue!");
+        return false;
+    }
+
     clientHasAdminPrivilegue = clientHasPrivilege(securityID, kIOClientPrivilegeAdministrator);
 
+    // Reads of a client are interactive unless it opened the connection for background use
+    readPriority = type == SMC_CONNECTION_BACKGROUND ? kFakeSMCKeyReadBackground : kFakeSMCKeyReadInteractive;
+
     return true;
 }
 
 IOReturn FakeSMCKeyStoreUserClient::clientClose(void)
 {
+    if (keyStore)
+        keyStore->unsubscribeThresholdEvents(this);
+
 	if( !isInactive())
         terminate();
 
     return kIOReturnSuccess;
 }
 
+IOReturn FakeSMCKeyStoreUserClient::registerNotificationPort(mach_port_t port, UInt32 type, io_user_reference_t refCon)
+{
+    if (type != SMC_THRESHOLD_EVENTS_QUEUE)
+        return kIOReturnBadArgument;
+
+    if (keyStore == NULL || isInactive())
+        return kIOReturnNotAttached;
+
+    thresholdEvents->setNotificationPort(port);
+
+    if (port == MACH_PORT_NULL)
+        keyStore->unsubscribeThresholdEvents(this);
+    else
+        keyStore->subscribeThresholdEvents(this);
+
+    return kIOReturnSuccess;
+}
+
+IOReturn FakeSMCKeyStoreUserClient::clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory)
+{
+    switch (type) {
+        case SMC_TRACE_RING_MEMORY:
+            if (!clientHasAdminPrivilegue)
+                return kIOReturnNotPermitted;
+
+            // Only there while FakeSMCDevice tracing is enabled
+            if (!(*memory = keyStore->copyTraceBuffer()))
+                return kIOReturnNotReady;
+
+            *options = kIOMapReadOnly;
+
+            return kIOReturnSuccess;
+
+        case SMC_HISTORY_MEMORY:
+            // Only there once a sensor keeps history
+            if (!(*memory = keyStore->copyHistoryBuffer()))
+                return kIOReturnNotReady;
+
+            *options = kIOMapReadOnly;
+
+            return kIOReturnSuccess;
+
+        case SMC_THRESHOLD_EVENTS_QUEUE:
+            // getMemoryDescriptor() returns a new reference which is consumed by the caller
+            if (!(*memory = thresholdEvents->getMemoryDescriptor()))
+                return kIOReturnNoMemory;
+
+            *options = 0;
+
+            return kIOReturnSuccess;
+    }
+
+    return kIOReturnBadArgument;
+}
+
+void FakeSMCKeyStoreUserClient::enqueueThresholdEvent(const SMCThresholdEvent_t *event)
+{
+    if (!thresholdEvents->enqueue((void *)event, sizeof(SMCThresholdEvent_t)))
+        HWSensorsDebugLog("threshold events queue is full, event dropped");
+}
+
 IOReturn FakeSMCKeyStoreUserClient::externalMethod(uint32_t selector, IOExternalMethodArguments* arguments, IOExternalMethodDispatch * dispatch, OSObject * target, void * reference )
 {
 	IOReturn result = kIOReturnError;
@@ -121,7 +200,8 @@ IOReturn FakeSMCKeyStoreUserClient::externalMethod(uint32_t selector, IOExternal
 //		return kIOReturnNotOpen;
 //	}
 
-    SYNCLOCK;
+    // No client-wide lock here: requests only touch the caller's own structures, the key store
+    // index lock and the per-key value lock, so clients reading different keys run in parallel
 
     switch (selector) {
         case KERNEL_INDEX_SMC: {
@@ -131,9 +211,11 @@ IOReturn FakeSMCKeyStoreUserClient::externalMethod(uint32_t selector, IOExternal
 
             switch (input->data8) {
                 case SMC_CMD_READ_INDEX: {
-                    FakeSMCKey *key = keyStore->getKey(input->data32);
-                    output->key = _strtoul(key->getKey(), 4, 16);
-                    result = kIOReturnSuccess;
+                    if (FakeSMCKey *key = keyStore->getKey(input->data32)) {
+                        output->key = _strtoul(key->getKey(), 4, 16);
+                        result = kIOReturnSuccess;
+                    }
+                    else result = kIOReturnNotFound;
                     break;
                 }
 
@@ -146,6 +228,8 @@ IOReturn FakeSMCKeyStoreUserClient::externalMethod(uint32_t selector, IOExternal
 
                     if (key) {
 
+                        // Take the epoch first, so a type change racing with this request invalidates the reply
+                        output->data32 = FakeSMCKey::getTypesEpoch();
                         output->keyInfo.dataSize = key->getSize();
                         output->keyInfo.dataType = _strtoul(key->getType(), 4, 16);
 
@@ -165,7 +249,8 @@ IOReturn FakeSMCKeyStoreUserClient::externalMethod(uint32_t selector, IOExternal
 
                     if (key) {
 
-                        memcpy(output->bytes, key->getValue(), key->getSize());
+                        output->data32 = FakeSMCKey::getTypesEpoch();
+                        output->keyInfo.dataSize = key->copyValue(output->bytes, readPriority);
 
                         result = kIOReturnSuccess;
                     }
@@ -184,7 +269,7 @@ IOReturn FakeSMCKeyStoreUserClient::externalMethod(uint32_t selector, IOExternal
 
                         if (key) {
 
-                            key->setValueFromBuffer(input->bytes, input->keyInfo.dataSize);
+                            key->setValueFromBuffer(input->bytes, fakeSMCKeyClampSize(input->keyInfo.dataSize));
 
                             result = kIOReturnSuccess;
                         }
@@ -198,7 +283,7 @@ IOReturn FakeSMCKeyStoreUserClient::externalMethod(uint32_t selector, IOExternal
                                 type[0] = '\0';
                             }
 
-                            keyStore->addKeyWithValue(name, type, input->keyInfo.dataSize, input->bytes);
+                            keyStore->addKeyWithValue(name, type, fakeSMCKeyClampSize(input->keyInfo.dataSize), input->bytes);
 
                             result = kIOReturnSuccess;
                         }
@@ -208,6 +293,37 @@ IOReturn FakeSMCKeyStoreUserClient::externalMethod(uint32_t selector, IOExternal
                     }
                     break;
 
+                case SMC_CMD_READ_TYPES_EPOCH:
+                    output->data32 = FakeSMCKey::getTypesEpoch();
+                    result = kIOReturnSuccess;
+                    break;
+
+                case SMC_CMD_READ_THRESHOLD: {
+                    char name[5];
+
+                    _ultostr(name, input->key);
+
+                    if (!keyStore->getKeyThreshold(name, (SMCKeyThreshold_t *)output->bytes))
+                        bzero(output->bytes, sizeof(SMCKeyThreshold_t));
+
+                    result = kIOReturnSuccess;
+
+                    break;
+                }
+
+                case SMC_CMD_WRITE_THRESHOLD:
+                    if (clientHasAdminPrivilegue) {
+                        char name[5];
+
+                        _ultostr(name, input->key);
+
+                        result = keyStore->setKeyThreshold(name, (const SMCKeyThreshold_t *)input->bytes) ? kIOReturnSuccess : kIOReturnError;
+                    }
+                    else {
+                        result = kIOReturnNotPermitted;
+                    }
+                    break;
+
                 default:
                     result = kIOReturnBadArgument;
                     break;
@@ -221,7 +337,5 @@ IOReturn FakeSMCKeyStoreUserClient::externalMethod(uint32_t selector, IOExternal
             break;
     }
 
-    SYNCUNLOCK;
-
     return result;
 }
@@ -29,6 +29,10 @@
 #define __HWSensors__FakeSMCKeyStoreUserClient__
 
 #include <IOKit/IOUserClient.h>
+#include <IOKit/IOSharedDataQueue.h>
+
+#include "smc.h"
+#include "FakeSMCKey.h"
 
 class FakeSMCKeyStore;
 
@@ -39,6 +43,9 @@ class EXPORT FakeSMCKeyStoreUserClient : public IOUserClient
 private:
 	FakeSMCKeyStore *keyStore;
     bool clientHasAdminPrivilegue;
+    FakeSMCKeyReadPriority readPriority;
+
+    IOSharedDataQueue *thresholdEvents;
 
 public:
 	/* IOService overrides */
@@ -50,6 +57,11 @@ public:
 	virtual IOReturn clientClose(void);
 	virtual IOReturn externalMethod(uint32_t selector, IOExternalMethodArguments* arguments,
 									IOExternalMethodDispatch* dispatch, OSObject* target, void* reference);
+    virtual IOReturn registerNotificationPort(mach_port_t port, UInt32 type, io_user_reference_t refCon);
+    virtual IOReturn clientMemoryForType(UInt32 type, IOOptionBits *options, IOMemoryDescriptor **memory);
+    virtual void free(void);
+
+    void enqueueThresholdEvent(const SMCThresholdEvent_t *event);
 };
 
 #endif /* defined(__HWSensors__FakeSMCKeyStoreUserClient__) */
@@ -0,0 +1,119 @@
+//
+//  FakeSMCKeyThreshold.h
+//  HWSensors
+//
+//  Threshold rule evaluation for FakeSMCKey. Plain C with no IOKit dependencies, so the
+//  same code runs in the host tests (see Tests/)
+//
+
+#ifndef HWSensors_FakeSMCKeyThreshold_h
+#define HWSensors_FakeSMCKeyThreshold_h
+
+#include "smc.h"
+
+typedef struct FakeSMCKeyThreshold {
+    SMCKeyThreshold_t   rule;           // no flags set means no rule
+    UInt32              state;          // last reported SMC_THRESHOLD_EVENT_*
+    UInt32              rateExceeded;
+    float               lastValue;
+    UInt64              lastTime;       // nanoseconds of monotonic time, 0 before the first evaluation
+} FakeSMCKeyThreshold;
+
+// Crossings found by one evaluation: a state change and a rate event at most
+typedef struct {
+    UInt32              count;
+    UInt32              events[2];      // SMC_THRESHOLD_EVENT_*
+    float               value;
+} FakeSMCKeyThresholdCrossings;
+
+/**
+ *  Add, replace or remove the rule. A replaced rule keeps the alarm state and the last sample, so
+ *  the next evaluation reports a return to normal if the new limits no longer hold the alarm
+ *
+ *  @param threshold Threshold state of the key
+ *  @param rule      New rule, 0 or a rule with no flags set removes it
+ */
+static inline void fakeSMCKeyThresholdSetRule(FakeSMCKeyThreshold *threshold, const SMCKeyThreshold_t *rule)
+{
+    if (!rule || !rule->flags) {
+        FakeSMCKeyThreshold none = { { 0, 0, 0, 0, 0 }, SMC_THRESHOLD_EVENT_NORMAL, 0, 0, 0 };
+        *threshold = none;
+        return;
+    }
+
+    if (!threshold->rule.flags) {
+        threshold->state = SMC_THRESHOLD_EVENT_NORMAL;
+        threshold->rateExceeded = 0;
+        threshold->lastValue = 0;
+        threshold->lastTime = 0;
+    }
+    else if (!(rule->flags & SMC_THRESHOLD_RATE)) {
+        threshold->rateExceeded = 0;
+    }
+
+    threshold->rule = *rule;
+}
+
+/**
+ *  Evaluate the rule against a new value. Only updates the threshold state, the caller delivers the crossings
+ *
+ *  @param threshold Threshold state of the key
+ *  @param current   New value of the key
+ *  @param time      Monotonic time of the value in nanoseconds
+ *  @param crossings Receives the events to deliver
+ *
+ *  @return Number of events in crossings
+ */
+static inline UInt32 fakeSMCKeyThresholdEvaluate(FakeSMCKeyThreshold *threshold, float current, UInt64 time, FakeSMCKeyThresholdCrossings *crossings)
+{
+    const SMCKeyThreshold_t *rule = &threshold->rule;
+    UInt32 state = threshold->state;
+
+    crossings->count = 0;
+    crossings->value = current;
+
+    if (!rule->flags)
+        return 0;
+
+    // Leave alarm state only when value is back within limits plus hysteresis
+    switch (state) {
+        case SMC_THRESHOLD_EVENT_HIGH:
+            if (!(rule->flags & SMC_THRESHOLD_HIGH) || current < rule->high - rule->hysteresis)
+                state = SMC_THRESHOLD_EVENT_NORMAL;
+            break;
+
+        case SMC_THRESHOLD_EVENT_LOW:
+            if (!(rule->flags & SMC_THRESHOLD_LOW) || current > rule->low + rule->hysteresis)
+                state = SMC_THRESHOLD_EVENT_NORMAL;
+            break;
+    }
+
+    if (state == SMC_THRESHOLD_EVENT_NORMAL) {
+        if ((rule->flags & SMC_THRESHOLD_HIGH) && current >= rule->high)
+            state = SMC_THRESHOLD_EVENT_HIGH;
+        else if ((rule->flags & SMC_THRESHOLD_LOW) && current <= rule->low)
+            state = SMC_THRESHOLD_EVENT_LOW;
+    }
+
+    if (state != threshold->state) {
+        threshold->state = state;
+        crossings->events[crossings->count++] = state;
+    }
+
+    if ((rule->flags & SMC_THRESHOLD_RATE) && threshold->lastTime && time > threshold->lastTime) {
+        float rate = (current - threshold->lastValue) * 1e9f / (float)(time - threshold->lastTime);
+        UInt32 exceeded = (rate < 0 ? -rate : rate) >= rule->rate;
+
+        if (exceeded && !threshold->rateExceeded)
+            crossings->events[crossings->count++] = SMC_THRESHOLD_EVENT_RATE;
+
+        threshold->rateExceeded = exceeded;
+    }
+
+    threshold->lastValue = current;
+    threshold->lastTime = time;
+
+    return crossings->count;
+}
+
+#endif
@@ -30,6 +30,16 @@
 
 #include <IOKit/IOLib.h>
 
+#include "timer.h"
+#include "FakeSMCConfigurationLinks.h"
+
+// On demand reads slower than this many microseconds count as slow, "Sensor Read Budget" plugin property overrides, 0 disables
+#define kFakeSMCSensorReadBudget            5000
+#define kFakeSMCSensorSlowReadsToDemote     3       // in a row
+#define kFakeSMCSensorDemotedPeriod         5000    // milliseconds
+
+#define kFakeSMCPluginAccountingInterval    10      // seconds between "Resource Usage" updates
+
 #pragma mark FakeSMCPSensor
 
 static UInt8 fakeSMCPluginGetIndexFromChar(char c)
@@ -344,6 +354,67 @@ bool FakeSMCSensor::parseModifiers(OSDictionary *node, float *reference, float *
     return false;
 }
 
+/**
+ *  Read optional filter settings from sensor configuration node: "filter-ema" (weight of a new sample), "filter-median" (window size) and "filter-spike" (largest believable change between samples). Fractional values are multiplied by 1000 like other modifiers
+ *
+ *  @param node Sensor configuration node
+ *
+ *  @return True if any filter is configured
+ */
+bool FakeSMCSensor::parseFilter(OSDictionary *node)
+{
+    float alpha = 0, spike = 0;
+    UInt8 median = 0;
+
+    if (!OSDynamicCast(OSDictionary, node))
+        return false;
+
+    if (OSNumber *number = OSDynamicCast(OSNumber, node->getObject("filter-ema")))
+        alpha = (float)number->unsigned64BitValue() / 1000.0f;
+
+    if (OSNumber *number = OSDynamicCast(OSNumber, node->getObject("filter-median")))
+        median = number->unsigned8BitValue();
+
+    if (OSNumber *number = OSDynamicCast(OSNumber, node->getObject("filter-spike")))
+        spike = (float)number->unsigned64BitValue() / 1000.0f;
+
+    setFilter(alpha, median, spike);
+
+    return alpha > 0 || median > 1 || spike > 0;
+}
+
+/**
+ *  Set filter stages applied to every value read, in order: spike rejection, median of last samples, exponential moving average
+ *
+ *  @param alpha  EMA weight of a new sample (0..1), 0 or 1 disables
+ *  @param median Median window size up to kFakeSMCSensorFilterMaxMedian, 0 or 1 disables
+ *  @param spike  Largest believable change between samples, 0 disables
+ */
+void FakeSMCSensor::setFilter(float alpha, UInt8 median, float spike)
+{
+    IOLockLock(valueLock);
+    fakeSMCSensorFilterSet(&filter, alpha, median, spike);
+    IOLockUnlock(valueLock);
+}
+
+/**
+ *  For internal use, run a new sample read on demand through the filter stages and record it in the history.
+ *  The sampling timer, batch reads and on demand reads of the sensor may run at once
+ *
+ */
+float FakeSMCSensor::filterValue(float value)
+{
+    IOLockLock(valueLock);
+
+    value = fakeSMCSensorFilterApply(&filter, value);
+
+    recordHistory(value);
+
+    IOLockUnlock(valueLock);
+
+    return value;
+}
+
 /**
  *  Create new FakeSMCSensor object
  *
@@ -395,9 +466,22 @@ bool FakeSMCSensor::initWithOwner(FakeSMCPlugin *aOwner, const char *aKey, const
     gain = aGain;
     offset = aOffset;
 
+    if (!(valueLock = IOLockAlloc()))
+        return false;
+
 	return true;
 }
 
+void FakeSMCSensor::free(void)
+{
+    if (valueLock) {
+        IOLockFree(valueLock);
+        valueLock = 0;
+    }
+
+    OSObject::free();
+}
+
 const char *FakeSMCSensor::getKey()
 {
 	return key;
@@ -438,6 +522,99 @@ float FakeSMCSensor::getOffset()
     return offset;
 }
 
+/**
+ *  Set the sensor value from FakeSMCPlugin::willReadSensorValues
+ *
+ *  @param value Value read, the same willReadSensorValue would return for this sensor
+ */
+void FakeSMCSensor::setBatchValue(float value)
+{
+    IOLockLock(valueLock);
+
+    batchValue = fakeSMCSensorFilterApply(&filter, value);
+    batchTime = ptimer_uptime();
+
+    recordHistory(batchValue);
+
+    IOLockUnlock(valueLock);
+}
+
+/**
+ *  For internal use, serve an already filtered value like a sampled one
+ *
+ */
+void FakeSMCSensor::publishValue(float value)
+{
+    IOLockLock(valueLock);
+
+    batchValue = value;
+    batchTime = ptimer_uptime();
+
+    IOLockUnlock(valueLock);
+}
+
+/**
+ *  For internal use
+ *
+ *  @param time Monotonic time in nanoseconds
+ *
+ *  @return True if a batch or sampled value is still fresh, see fakeSMCSensorValueIsFresh
+ */
+bool FakeSMCSensor::getBatchValue(float *outValue, UInt64 time)
+{
+    IOLockLock(valueLock);
+
+    bool fresh = fakeSMCSensorValueIsFresh(batchTime, samplingPeriod, time);
+
+    if (fresh)
+        *outValue = batchValue;
+
+    IOLockUnlock(valueLock);
+
+    return fresh;
+}
+
+/**
+ *  For internal use, the value served once the batch or sampled value is not fresh anymore
+ *
+ *  @return kFakeSMCSensorStale*, the last value is copied on kFakeSMCSensorStaleServe
+ */
+int FakeSMCSensor::getStaleValue(float *outValue)
+{
+    IOLockLock(valueLock);
+
+    int action = fakeSMCSensorStaleAction(demotion != kFakeSMCSensorOnDemand, batchTime);
+
+    if (action == kFakeSMCSensorStaleServe)
+        *outValue = batchValue;
+
+    IOLockUnlock(valueLock);
+
+    return action;
+}
+
+/**
+ *  For internal use, append a value to the sensor history ring if the sensor keeps one
+ *
+ */
+void FakeSMCSensor::recordHistory(float value)
+{
+    if (!history)
+        return;
+
+    UInt32 position = (UInt32)OSIncrementAtomic((volatile SInt32 *)&history->head);
+    SMCHistorySample_t *sample = &history->samples[position & (SMC_HISTORY_SAMPLES - 1)];
+
+    sample->sequence = 0;
+    __sync_synchronize();
+
+    sample->timestamp = ptimer_read();
+    sample->value = value;
+
+    __sync_synchronize();
+    sample->sequence = position + 1;
+}
+
 void FakeSMCSensor::encodeNumericValue(float value, void *outBuffer)
 {
     if (!fakeSMCPluginEncodeFloatValue(value, type, size, outBuffer)) {
@@ -457,6 +634,30 @@ static IORecursiveLock *gFakeSMCPluginLock = 0;
 #define super FakeSMCKeyHandler
 OSDefineMetaClassAndStructors(FakeSMCPlugin, FakeSMCKeyHandler)
 
+#pragma mark -
+#pragma mark Sensor definitions lookup
+
+// Built once on first use under gFakeSMCPluginLock
+static FakeSMCSensorDefinitionsHash gFakeSMCSensorDefinitionsHash;
+static bool gFakeSMCSensorDefinitionsHashed = false;
+
+// Counter slots known to be taken, indexed by definition, keys are never removed so a taken slot stays taken
+static UInt16 gFakeSMCSensorDefinitionsTaken[kFakeSMCSensorDefinitionsHashSize];
+
+static int fakeSMCSensorDefinitionLookup(const char *name, FakeSMCSensorCategory category)
+{
+    if (!gFakeSMCSensorDefinitionsHashed) {
+        if (!fakeSMCSensorDefinitionsHashBuild(&gFakeSMCSensorDefinitionsHash, FakeSMCSensorDefinitions)) {
+            IOLog("FakeSMCPlugin: [Fatal] too many sensor definitions for the lookup table\n");
+            return -1;
+        }
+
+        gFakeSMCSensorDefinitionsHashed = true;
+    }
+
+    return fakeSMCSensorDefinitionsHashLookup(&gFakeSMCSensorDefinitionsHash, FakeSMCSensorDefinitions, name, category);
+}
+
 #pragma mark -
 #pragma mark FakeSMCPlugin::methods
 
@@ -467,7 +668,7 @@ OSDefineMetaClassAndStructors(FakeSMCPlugin, FakeSMCKeyHandler)
  */
 OSString *FakeSMCPlugin::getPlatformManufacturer(void)
 {
-    return OSDynamicCast(OSString, keyStore->getProperty(kOEMInfoManufacturer));
+    return keyStore ? OSDynamicCast(OSString, keyStore->getProperty(kOEMInfoManufacturer)) : NULL;
 }
 
 /**
@@ -477,7 +678,7 @@ OSString *FakeSMCPlugin::getPlatformManufacturer(void)
  */
 OSString *FakeSMCPlugin::getPlatformProduct(void)
 {
-    return OSDynamicCast(OSString, keyStore->getProperty(kOEMInfoProduct));
+    return keyStore ? OSDynamicCast(OSString, keyStore->getProperty(kOEMInfoProduct)) : NULL;
 }
 
 /**
@@ -566,16 +767,13 @@ bool FakeSMCPlugin::setKeyValue(const char *key, const char *type, UInt8 size, v
  */
 bool FakeSMCPlugin::getKeyValue(const char *key, void *value)
 {
-    LOCK;
-
+    // Keys are never removed and the read may call another plugin, so the plugins lock isn't held over it
     FakeSMCKey *smcKey = keyStore->getKey(key);
 
     if (smcKey) {
-        memcpy(value, smcKey->getValue(), smcKey->getSize());
+        smcKey->copyValue(value);
     }
 
-    UNLOCK;
-
     return smcKey != NULL;
 }
 
@@ -629,29 +827,36 @@ FakeSMCSensor *FakeSMCPlugin::addSensorUsingAbbreviation(const char *abbreviatio
 
     FakeSMCSensor *sensor = NULL;
 
-    if (abbreviation && strlen(abbreviation) >= 3) {
-        for (int i = 0; FakeSMCSensorDefinitions[i].name; i++) {
+    int i;
 
-            FakeSMCSensorDefinitionEntry entry = FakeSMCSensorDefinitions[i];
+    if (abbreviation && strlen(abbreviation) >= 3 && (i = fakeSMCSensorDefinitionLookup(abbreviation, category)) >= 0) {
 
-            if (entry.category == category && 0 == strcasecmp(entry.name, abbreviation)) {
-                if (entry.count) {
-                    for (int counter = 0; counter < entry.count; counter++) {
+        FakeSMCSensorDefinitionEntry entry = FakeSMCSensorDefinitions[i];
 
-                        char key[5];
-                        snprintf(key, 5, entry.key, entry.shift + counter);
+        if (entry.count) {
+            for (int counter = 0; counter < entry.count; counter++) {
 
-                        if (!isKeyExists(key)) {
-                            sensor = addSensorForKey(key, entry.type, entry.size, group, index, reference, gain, offset);
-                            break;
-                        }
-                    }
-                }
-                else {
-                    sensor = addSensorForKey(entry.key, entry.type, entry.size, group, index, reference, gain, offset);
+                if (bit_get(gFakeSMCSensorDefinitionsTaken[i], BIT(counter)))
+                    continue;
+
+                char key[5];
+                snprintf(key, 5, entry.key, entry.shift + counter);
+
+                // Slot may also be taken by a key added without a definition, remember it either way
+                if (isKeyExists(key)) {
+                    bit_set(gFakeSMCSensorDefinitionsTaken[i], BIT(counter));
+                    continue;
                 }
+
+                if ((sensor = addSensorForKey(key, entry.type, entry.size, group, index, reference, gain, offset)))
+                    bit_set(gFakeSMCSensorDefinitionsTaken[i], BIT(counter));
+
+                break;
             }
         }
+        else {
+            sensor = addSensorForKey(entry.key, entry.type, entry.size, group, index, reference, gain, offset);
+        }
     }
 
     UNLOCK;
@@ -689,6 +894,14 @@ FakeSMCSensor *FakeSMCPlugin::addSensorFromNode(OSObject *node, FakeSMCSensorCat
 
         if (abbreviation)
             sensor = addSensorUsingAbbreviation(abbreviation->getCStringNoCopy(), category, group, index, reference, gain, offset);
+
+        if (sensor && OSDynamicCast(OSDictionary, node)) {
+            sensor->parseFilter((OSDictionary *)node);
+
+            if (OSBoolean *history = OSDynamicCast(OSBoolean, ((OSDictionary *)node)->getObject("history")))
+                if (history->isTrue())
+                    keepSensorHistory(sensor);
+        }
     }
 
     UNLOCK;
@@ -706,10 +919,26 @@ bool FakeSMCPlugin::addSensor(FakeSMCSensor *sensor)
 {
     LOCK;
 
-    bool added = keyStore->addKeyWithHandler(sensor->getKey(), sensor->getType(), sensor->getSize(), this);
+    bool created;
+    bool added = keyStore->addKeyWithHandler(sensor->getKey(), sensor->getType(), sensor->getSize(), this, &created);
 
     if (added) {
         sensors->setObject(sensor->getKey(), sensor);
+
+        OSAddAtomic64(sensor->getMetaClass()->getClassSize(), &sensorMemory);
+
+        // A key already in the store, e.g. from the plist, was there before the plugin
+        if (created)
+            OSAddAtomic64(FakeSMCKey::metaClass->getClassSize() + sensor->getSize(), &sensorMemory);
+
+        char group[16];
+
+        snprintf(group, sizeof(group), "%u", (unsigned int)sensor->getGroup());
+
+        if (OSNumber *period = OSDynamicCast(OSNumber, samplingPeriods->getObject(group))) {
+            scheduleSensorSampling(sensor, period->unsigned32BitValue(), ptimer_uptime());
+            samplingTimer->setTimeoutMS(1);
+        }
     }
 
     UNLOCK;
@@ -718,169 +947,662 @@ bool FakeSMCPlugin::addSensor(FakeSMCSensor *sensor)
 }
 
 /**
- *  Synchronized method to add tachometer sensor type into FakeSMCKeyStore. This will update fan counter key.
+ *  Sample sensors of a group in the background every given period instead of on demand. Each sensor gets its own phase within the period, so sampling doesn't hit the hardware all at the same tick. Readers are served the last sample
  *
- *  @param index    Key index not related to key position in FakeSMCKeyStore key list
- *  @param name     SMC fan name string up to 12 bytes long
- *  @param type     SMC fan type
- *  @param zone     SMC fan zone
- *  @param location SMC fan location
- *  @param fanIndex SMC fan index is returned on success
+ *  @param group        Sensor group, also applies to sensors of the group added later
+ *  @param milliseconds Sampling period, 0 to return to on demand reads
  *
- *  @return new FakeSMCSensor object or NULL otherwise
+ *  @return True on success
  */
-FakeSMCSensor *FakeSMCPlugin::addTachometer(UInt32 index, const char *name, FanType type, UInt8 zone, FanLocationType location, SInt8 *fanIndex)
+bool FakeSMCPlugin::setSamplingPeriod(UInt32 group, UInt32 milliseconds)
 {
-    LOCK;
-
-    SInt8 vacantFanIndex = keyStore->takeVacantFanIndex();
+    if (!initSamplingTimer())
+        return false;
 
-    if (vacantFanIndex >= 0) {
-        char key[5];
-        snprintf(key, 5, KEY_FORMAT_FAN_SPEED, vacantFanIndex);
+    LOCK;
 
-        if (FakeSMCSensor *sensor = addSensorForKey(key, TYPE_FPE2, TYPE_FPXX_SIZE, kFakeSMCTachometerSensor, index)) {
-            FanTypeDescStruct fds;
+    char name[16];
 
-            bzero(&fds, sizeof(fds));
+    snprintf(name, sizeof(name), "%u", (unsigned int)group);
 
-            fds.type = type;
-            fds.ui8Zone = zone;
-            fds.location = location;
+    if (milliseconds) {
+        if (OSNumber *period = OSNumber::withNumber(milliseconds, 32)) {
+            samplingPeriods->setObject(name, period);
+            OSSafeRelease(period);
+        }
+    }
+    else samplingPeriods->removeObject(name);
 
-            if (name)
-                strlcpy(fds.strFunction, name, DIAG_FUNCTION_STR_LEN);
-            else
-                snprintf(fds.strFunction, DIAG_FUNCTION_STR_LEN, "MB Fan %X", index);
+    UInt64 time = ptimer_uptime();
 
-            snprintf(key, 5, KEY_FORMAT_FAN_ID, vacantFanIndex);
+    if (OSCollectionIterator *iterator = OSCollectionIterator::withCollection(sensors)) {
+        while (const OSSymbol *key = (const OSSymbol *)iterator->getNextObject()) {
+            FakeSMCSensor *sensor = OSDynamicCast(FakeSMCSensor, sensors->getObject(key));
 
-            if (!setKeyValue(key, TYPE_FDS, sizeof(fds), &fds))
-                HWSensorsWarningLog("failed to add tachometer name for key %s", key);
+            if (sensor && sensor->getGroup() == group)
+                scheduleSensorSampling(sensor, milliseconds, time);
+        }
 
-            if (fanIndex) *fanIndex = vacantFanIndex;
+        OSSafeRelease(iterator);
+    }
 
-            UNLOCK;
+    samplingTimer->setTimeoutMS(1);
 
-            return sensor;
-        }
-        else HWSensorsErrorLog("failed to add tachometer sensor for key %s", key);
-    }
-    else HWSensorsErrorLog("failed to take vacant Fan index");
+    if (demotionTimer)
+        demotionTimer->setTimeoutMS(1);
 
     UNLOCK;
 
-	return 0;
+    return true;
 }
 
 /**
- *  Method to get a key by name
- *
- *  @param key Key name
+ *  For internal use, call without the plugins lock: adding the timer closes the workloop gate and the timer action takes the plugins lock with the gate closed
  *
- *  @return FakeSMCSensor object or NULL if the key not found
  */
-FakeSMCSensor *FakeSMCPlugin::getSensor(const char* key)
+bool FakeSMCPlugin::initSamplingTimer(void)
 {
-	return OSDynamicCast(FakeSMCSensor, sensors->getObject(key));
-}
+    if (samplingTimer)
+        return true;
 
-/**
- *  Callback method invoked before key value will be read. Can be used by plugin to provide custom key value that can be calculated or obtained in the moment of key read action. Blocks key reading thread until returned
- *
- *  @param sensor   FakeSMCSensor object representing specific SMC key will be read
- *  @param outValue floating point key value will be exposed to SMC
- *
- *  @return if True is returned outValue will be used as a value for sensor handled SMC key. if False is returned SMC key value will not be changed
- */
-bool FakeSMCPlugin::willReadSensorValue(FakeSMCSensor *sensor, float *outValue)
-{
-    return false;
+    IOWorkLoop *workloop = getWorkLoop();
+    IOTimerEventSource *timer;
+
+    if (!workloop || !(timer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &FakeSMCPlugin::samplingTimerAction)))) {
+        HWSensorsErrorLog("failed to initialize sampling timer");
+        return false;
+    }
+
+    if (kIOReturnSuccess != workloop->addEventSource(timer)) {
+        OSSafeRelease(timer);
+        HWSensorsErrorLog("failed to add sampling timer into workloop");
+        return false;
+    }
+
+    // Another thread got there first
+    if (!OSCompareAndSwapPtr(NULL, timer, (void * volatile *)&samplingTimer)) {
+        workloop->removeEventSource(timer);
+        OSSafeRelease(timer);
+    }
+
+    return true;
 }
 
 /**
- *  Callback method invoked after the new value has been written to specific key. Can be used by plugin to handle key writes. Blocks key writing thread until returned
- *
- *  @param sensor FakeSMCSensor object representing specific SMC key has been written
- *  @param value  floating point value written to SMC key
+ *  For internal use, call without the plugins lock, same as initSamplingTimer. Demoted sensors get a workloop of their own
  *
- *  @return not used
  */
-bool FakeSMCPlugin::didWriteSensorValue(FakeSMCSensor *sensor, float value)
+bool FakeSMCPlugin::initDemotionTimer(void)
 {
-    return false;
+    if (demotionTimer)
+        return true;
+
+    IOWorkLoop *workloop = IOWorkLoop::workLoop();
+    IOTimerEventSource *timer = NULL;
+
+    if (!workloop || !(timer = IOTimerEventSource::timerEventSource(this, OSMemberFunctionCast(IOTimerEventSource::Action, this, &FakeSMCPlugin::demotionTimerAction)))) {
+        OSSafeRelease(workloop);
+        HWSensorsErrorLog("failed to initialize demotion timer");
+        return false;
+    }
+
+    if (kIOReturnSuccess != workloop->addEventSource(timer)) {
+        OSSafeRelease(timer);
+        OSSafeRelease(workloop);
+        HWSensorsErrorLog("failed to add demotion timer into workloop");
+        return false;
+    }
+
+    // The workloop is set first, so stop has it once the timer is there. Until then a loser has no timer to use
+    if (!OSCompareAndSwapPtr(NULL, workloop, (void * volatile *)&demotionWorkLoop)) {
+        workloop->removeEventSource(timer);
+        OSSafeRelease(timer);
+        OSSafeRelease(workloop);
+        return demotionTimer != NULL;
+    }
+
+    demotionTimer = timer;
+
+    return true;
 }
 
 /**
- *  Synchronized method that tries to take vacant GPU index available from internal list
+ *  For internal use, add time spent in a plugin handler to the plugin resource usage
  *
- *  @return Index taken (starting from 0) or -1 on failure
+ *  @return Nanoseconds since started
  */
-SInt8 FakeSMCPlugin::takeVacantGPUIndex(void)
+UInt64 FakeSMCPlugin::accountHandlerTime(volatile SInt64 *time, volatile SInt64 *calls, UInt64 started)
 {
-    LOCK;
+    UInt64 finished, elapsed;
 
-    SInt8 index = keyStore->takeVacantGPUIndex();
+    clock_get_uptime(&finished);
+    absolutetime_to_nanoseconds(finished - started, &elapsed);
 
-    UNLOCK;
+    OSAddAtomic64(elapsed, time);
+    OSIncrementAtomic64(calls);
 
-    return index;
+    return elapsed;
 }
 
-/**
- *  Synchronized method that tries to take specific GPU index available from internal list
- *
- *  @param index GPU index to take
- *
- *  @return True if the index was taken successfully False otherwise
- */
-bool FakeSMCPlugin::takeGPUIndex(UInt8 index)
+bool FakeSMCPlugin::timedReadSensorValue(FakeSMCSensor *sensor, float *outValue, UInt64 *outElapsed)
 {
-    LOCK;
+    UInt64 started;
 
-    bool taken = keyStore->takeGPUIndex(index);
+    clock_get_uptime(&started);
 
-    UNLOCK;
+    bool read = willReadSensorValue(sensor, outValue);
+    UInt64 elapsed = accountHandlerTime(&readTime, &readCalls, started);
 
-    return taken;
+    if (outElapsed)
+        *outElapsed = elapsed;
+
+    return read;
 }
 
-/**
- *  Synchronized method that releases previousely taken GPU index by this or another plugin
- *
- *  @param index Index to release
- */
-void FakeSMCPlugin::releaseGPUIndex(UInt8 index)
+bool FakeSMCPlugin::timedReadSensorValues(OSArray *staleSensors)
 {
-    LOCK;
+    UInt64 started;
 
-    keyStore->releaseGPUIndex(index);
+    clock_get_uptime(&started);
 
-    UNLOCK;
+    bool read = willReadSensorValues(staleSensors);
+
+    accountHandlerTime(&readTime, &readCalls, started);
+
+    return read;
 }
 
-/**
- *  Synchronized method that takes vacant Fan index available from internal list. Will update fan counter key on success
- *
- *  @return Index taken (starting from 0) or -1 on failure
- */
-SInt8 FakeSMCPlugin::takeVacantFanIndex(void)
+bool FakeSMCPlugin::timedWriteSensorValue(FakeSMCSensor *sensor, float value)
 {
-    LOCK;
+    UInt64 started;
 
-    SInt8 index = keyStore->takeVacantFanIndex();
+    clock_get_uptime(&started);
 
-    UNLOCK;
+    bool written = didWriteSensorValue(sensor, value);
 
-    return index;
+    accountHandlerTime(&writeTime, &writeCalls, started);
+
+    return written;
 }
 
 /**
- *  Synchronized method that releases previousely taken Fan index by this or another plugin. Will update fan counter key on success
+ *  Count hardware accesses made on behalf of sensor reads and writes, published with plugin resource usage. Call from the lowest level helper of the plugin that touches the hardware
  *
- *  @param index Index to release
+ *  @param type  Kind of access
+ *  @param count Number of accesses, e.g. port reads and writes in one register read
  */
-void FakeSMCPlugin::releaseFanIndex(UInt8 index)
+void FakeSMCPlugin::accountHardwareAccess(FakeSMCHardwareAccess type, UInt32 count)
+{
+    if (type < kFakeSMCHardwareAccessTypes)
+        OSAddAtomic64(count, &hardwareAccesses[type]);
+}
+
+static void fakeSMCPluginSetNumber(OSDictionary *dictionary, const char *key, UInt64 value)
+{
+    if (OSNumber *number = OSNumber::withNumber(value, 64)) {
+        dictionary->setObject(key, number);
+        OSSafeRelease(number);
+    }
+}
+
+/**
+ *  For internal use, publish plugin resource usage as "Resource Usage" registry property, no more often than every kFakeSMCPluginAccountingInterval
+ *
+ */
+void FakeSMCPlugin::publishResourceUsage(void)
+{
+    UInt64 time = ptimer_uptime();
+    UInt64 published = resourceUsagePublished;
+
+    if (time - published < kFakeSMCPluginAccountingInterval * NSEC_PER_SEC || !OSCompareAndSwap64(published, time, &resourceUsagePublished))
+        return;
+
+    if (OSDictionary *usage = OSDictionary::withCapacity(9)) {
+        fakeSMCPluginSetNumber(usage, "Sensor Memory", sensorMemory);
+        fakeSMCPluginSetNumber(usage, "Read Calls", readCalls);
+        fakeSMCPluginSetNumber(usage, "Read Time", readTime / NSEC_PER_USEC);
+        fakeSMCPluginSetNumber(usage, "Write Calls", writeCalls);
+        fakeSMCPluginSetNumber(usage, "Write Time", writeTime / NSEC_PER_USEC);
+        fakeSMCPluginSetNumber(usage, "Port I/O", hardwareAccesses[kFakeSMCPortAccess]);
+        fakeSMCPluginSetNumber(usage, "MSR", hardwareAccesses[kFakeSMCMSRAccess]);
+        fakeSMCPluginSetNumber(usage, "MMIO", hardwareAccesses[kFakeSMCMMIOAccess]);
+        fakeSMCPluginSetNumber(usage, "ACPI", hardwareAccesses[kFakeSMCACPIAccess]);
+
+        setProperty("Resource Usage", usage);
+
+        OSSafeRelease(usage);
+    }
+}
+
+/**
+ *  For internal use, demote sensors whose reads keep exceeding the read budget to background sampling, so a slow handler doesn't hold up SMC readers. Called from SMC reads, so the demotion is only claimed here and applied by the demotion timer
+ *
+ *  @param sensor  Sensor just read on demand
+ *  @param elapsed Nanoseconds the read took
+ *  @param value   Value read, served until the first background sample
+ */
+void FakeSMCPlugin::accountSensorRead(FakeSMCSensor *sensor, UInt64 elapsed, float value)
+{
+    UInt32 latency = (UInt32)(elapsed / NSEC_PER_USEC);
+
+    if (!readBudget || latency <= readBudget) {
+        sensor->slowReads = 0;
+        return;
+    }
+
+    if (sensor->demotion || ++sensor->slowReads < kFakeSMCSensorSlowReadsToDemote || !initDemotionTimer())
+        return;
+
+    if (!OSCompareAndSwap(kFakeSMCSensorOnDemand, kFakeSMCSensorDemoting, &sensor->demotion))
+        return;
+
+    sensor->demotionLatency = latency;
+
+    // Already filtered
+    sensor->publishValue(value);
+
+    demotionTimer->setTimeoutMS(1);
+}
+
+/**
+ *  Keep recent values of a sensor in a history ring user clients can map (SMC_HISTORY_MEMORY), so a reader gets the last minutes of samples in one copy instead of polling. Best used with setSamplingPeriod so samples come at a steady pace
+ *
+ *  @param sensor Sensor object
+ *
+ *  @return True on success, false when all history rings are taken
+ */
+bool FakeSMCPlugin::keepSensorHistory(FakeSMCSensor *sensor)
+{
+    if (!sensor)
+        return false;
+
+    LOCK;
+
+    if (!sensor->history && (sensor->history = keyStore->takeHistoryRing(sensor->getKey(), sensor->samplingPeriod)))
+        OSAddAtomic64(sizeof(SMCHistoryRing_t), &sensorMemory);
+
+    UNLOCK;
+
+    return sensor->history != NULL;
+}
+
+/**
+ *  For internal use, phase is derived from the key name so it stays the same across restarts
+ *
+ */
+void FakeSMCPlugin::scheduleSensorSampling(FakeSMCSensor *sensor, UInt32 period, UInt64 time)
+{
+    // Demoted sensors never go back to on demand reads
+    if (sensor->demotion && period < kFakeSMCSensorDemotedPeriod)
+        period = kFakeSMCSensorDemotedPeriod;
+
+    sensor->samplingPeriod = period;
+
+    if (sensor->history)
+        sensor->history->period = period;
+
+    if (period) {
+        UInt32 phase = (HWSensorsKeyToInt(sensor->getKey()) * 2654435761U) % period;
+
+        sensor->nextSampleTime = time + (UInt64)phase * NSEC_PER_MSEC;
+    }
+}
+
+/**
+ *  For internal use, call with the plugins lock held. Collects sensors due for sampling and moves them to their next sample
+ *
+ *  @param due     Receives the due sensors
+ *  @param demoted True for demoted sensors, false for the others
+ *  @param time    Monotonic nanoseconds
+ *
+ *  @return Monotonic nanoseconds of the next sample, 0 if none of the sensors is sampled
+ */
+UInt64 FakeSMCPlugin::collectDueSensors(OSArray *due, bool demoted, UInt64 time)
+{
+    UInt64 next = 0;
+
+    if (OSCollectionIterator *iterator = OSCollectionIterator::withCollection(sensors)) {
+        while (const OSSymbol *key = (const OSSymbol *)iterator->getNextObject()) {
+            FakeSMCSensor *sensor = OSDynamicCast(FakeSMCSensor, sensors->getObject(key));
+
+            if (!sensor || !sensor->samplingPeriod || (sensor->demotion == kFakeSMCSensorDemoted) != demoted)
+                continue;
+
+            // Not sampled until the demotion timer takes it over
+            if (sensor->demotion == kFakeSMCSensorDemoting)
+                continue;
+
+            if (sensor->nextSampleTime <= time) {
+                due->setObject(sensor);
+
+                // Keep the phase, but don't try to catch up on missed samples
+                sensor->nextSampleTime += (UInt64)sensor->samplingPeriod * NSEC_PER_MSEC;
+
+                if (sensor->nextSampleTime <= time)
+                    sensor->nextSampleTime = time + (UInt64)sensor->samplingPeriod * NSEC_PER_MSEC;
+            }
+
+            if (!next || sensor->nextSampleTime < next)
+                next = sensor->nextSampleTime;
+        }
+
+        OSSafeRelease(iterator);
+    }
+
+    return next;
+}
+
+/**
+ *  For internal use, samples due sensors and sleeps until the next one is due
+ *
+ */
+void FakeSMCPlugin::samplingTimerAction(IOTimerEventSource *sender)
+{
+    if (OSArray *due = OSArray::withCapacity(sensors->getCount())) {
+        UInt64 time = ptimer_uptime();
+
+        // Sensors are added and rescheduled under the plugins lock, due ones are read without it
+        LOCK;
+
+        UInt64 next = collectDueSensors(due, false, time);
+
+        UNLOCK;
+
+        bool batched = false;
+
+        if (due->getCount() && kFakeSMCSensorBatchRead == beginBatchRead(NULL, NULL)) {
+            batched = timedReadSensorValues(due);
+            endBatchRead(batched);
+        }
+
+        if (due->getCount() && !batched) {
+            for (unsigned int i = 0; i < due->getCount(); i++) {
+                FakeSMCSensor *sensor = (FakeSMCSensor *)due->getObject(i);
+                float value;
+
+                if (timedReadSensorValue(sensor, &value, NULL))
+                    sensor->setBatchValue(value);
+            }
+        }
+
+        OSSafeRelease(due);
+
+        publishResourceUsage();
+
+        if (next) {
+            UInt64 delay = next > time ? (next - time) / NSEC_PER_MSEC : 0;
+
+            sender->setTimeoutMS(delay ? (UInt32)delay : 1);
+        }
+    }
+}
+
+/**
+ *  For internal use, applies demotions claimed by readers, then samples due demoted sensors one by one
+ *
+ */
+void FakeSMCPlugin::demotionTimerAction(IOTimerEventSource *sender)
+{
+    if (OSArray *due = OSArray::withCapacity(1)) {
+        UInt64 time = ptimer_uptime();
+        bool demoted = false;
+
+        LOCK;
+
+        if (OSCollectionIterator *iterator = OSCollectionIterator::withCollection(sensors)) {
+            while (const OSSymbol *key = (const OSSymbol *)iterator->getNextObject()) {
+                FakeSMCSensor *sensor = OSDynamicCast(FakeSMCSensor, sensors->getObject(key));
+
+                if (!sensor || !OSCompareAndSwap(kFakeSMCSensorDemoting, kFakeSMCSensorDemoted, &sensor->demotion))
+                    continue;
+
+                scheduleSensorSampling(sensor, sensor->samplingPeriod, time);
+
+                if (OSNumber *number = OSNumber::withNumber(sensor->demotionLatency, 32)) {
+                    demotedSensors->setObject(sensor->getKey(), number);
+                    OSSafeRelease(number);
+                }
+
+                HWSensorsInfoLog("%s reads take %u us, demoted to background refresh every %u ms", sensor->getKey(), (unsigned int)sensor->demotionLatency, (unsigned int)sensor->samplingPeriod);
+
+                demoted = true;
+            }
+
+            OSSafeRelease(iterator);
+        }
+
+        // Publish a copy, the registry may be serializing the previous one
+        if (demoted) {
+            if (OSDictionary *copy = OSDictionary::withDictionary(demotedSensors)) {
+                setProperty("Demoted Sensors", copy);
+                OSSafeRelease(copy);
+            }
+        }
+
+        UInt64 next = collectDueSensors(due, true, time);
+
+        UNLOCK;
+
+        // Slow ones, a batch read would wait for all of them
+        for (unsigned int i = 0; i < due->getCount(); i++) {
+            FakeSMCSensor *sensor = (FakeSMCSensor *)due->getObject(i);
+            float value;
+
+            if (timedReadSensorValue(sensor, &value, NULL))
+                sensor->setBatchValue(value);
+        }
+
+        OSSafeRelease(due);
+
+        if (next) {
+            UInt64 delay = next > time ? (next - time) / NSEC_PER_MSEC : 0;
+
+            sender->setTimeoutMS(delay ? (UInt32)delay : 1);
+        }
+    }
+}
+
+/**
+ *  Synchronized method to add tachometer sensor type into FakeSMCKeyStore. This will update fan counter key.
+ *
+ *  @param index    Key index not related to key position in FakeSMCKeyStore key list
+ *  @param name     SMC fan name string up to 12 bytes long
+ *  @param type     SMC fan type
+ *  @param zone     SMC fan zone
+ *  @param location SMC fan location
+ *  @param fanIndex SMC fan index is returned on success
+ *
+ *  @return new FakeSMCSensor object or NULL otherwise
+ */
+FakeSMCSensor *FakeSMCPlugin::addTachometer(UInt32 index, const char *name, FanType type, UInt8 zone, FanLocationType location, SInt8 *fanIndex)
+{
+    LOCK;
+
+    SInt8 vacantFanIndex = keyStore->takeVacantFanIndex();
+
+    if (vacantFanIndex >= 0) {
+        char key[5];
+        snprintf(key, 5, KEY_FORMAT_FAN_SPEED, vacantFanIndex);
+
+        if (FakeSMCSensor *sensor = addSensorForKey(key, TYPE_FPE2, TYPE_FPXX_SIZE, kFakeSMCTachometerSensor, index)) {
+            FanTypeDescStruct fds;
+
+            bzero(&fds, sizeof(fds));
+
+            fds.type = type;
+            fds.ui8Zone = zone;
+            fds.location = location;
+
+            if (name)
+                strlcpy(fds.strFunction, name, DIAG_FUNCTION_STR_LEN);
+            else
+                snprintf(fds.strFunction, DIAG_FUNCTION_STR_LEN, "MB Fan %X", index);
+
+            snprintf(key, 5, KEY_FORMAT_FAN_ID, vacantFanIndex);
+
+            if (!setKeyValue(key, TYPE_FDS, sizeof(fds), &fds))
+                HWSensorsWarningLog("failed to add tachometer name for key %s", key);
+
+            if (fanIndex) *fanIndex = vacantFanIndex;
+
+            UNLOCK;
+
+            return sensor;
+        }
+        else HWSensorsErrorLog("failed to add tachometer sensor for key %s", key);
+    }
+    else HWSensorsErrorLog("failed to take vacant Fan index");
+
+    UNLOCK;
+
+	return 0;
+}
+
+/**
+ *  Method to get a key by name
+ *
+ *  @param key Key name
+ *
+ *  @return FakeSMCSensor object or NULL if the key not found
+ */
+FakeSMCSensor *FakeSMCPlugin::getSensor(const char* key)
+{
+    LOCK;
+
+	FakeSMCSensor *sensor = OSDynamicCast(FakeSMCSensor, sensors->getObject(key));
+
+    UNLOCK;
+
+    return sensor;
+}
+
+/**
+ *  For internal use, like getSensor but retained, so stop can't free the sensor while a key callback uses it
+ *
+ *  @return FakeSMCSensor object to release, or NULL if the key not found
+ */
+FakeSMCSensor *FakeSMCPlugin::copySensor(const char *key)
+{
+    LOCK;
+
+    FakeSMCSensor *sensor = getSensor(key);
+
+    if (sensor)
+        sensor->retain();
+
+    UNLOCK;
+
+    return sensor;
+}
+
+/**
+ *  Callback method invoked before key value will be read. Can be used by plugin to provide custom key value that can be calculated or obtained in the moment of key read action. Blocks key reading thread until returned
+ *
+ *  @param sensor   FakeSMCSensor object representing specific SMC key will be read
+ *  @param outValue floating point key value will be exposed to SMC
+ *
+ *  @return if True is returned outValue will be used as a value for sensor handled SMC key. if False is returned SMC key value will not be changed
+ */
+bool FakeSMCPlugin::willReadSensorValue(FakeSMCSensor *sensor, float *outValue)
+{
+    return false;
+}
+
+/**
+ *  Optional callback method to read values of many sensors in one pass, so the plugin can sweep its hardware once instead of once per sensor. Call setBatchValue on every sensor read. Sensors left without a value fall back to willReadSensorValue, so do keys of this plugin read from the callback
+ *
+ *  @param staleSensors FakeSMCSensor objects of this plugin with no fresh value
+ *
+ *  @return False if not implemented, willReadSensorValue is used for all reads from then on
+ */
+bool FakeSMCPlugin::willReadSensorValues(OSArray *staleSensors)
+{
+    return false;
+}
+
+/**
+ *  Callback method invoked after the new value has been written to specific key. Can be used by plugin to handle key writes. Blocks key writing thread until returned
+ *
+ *  @param sensor FakeSMCSensor object representing specific SMC key has been written
+ *  @param value  floating point value written to SMC key
+ *
+ *  @return not used
+ */
+bool FakeSMCPlugin::didWriteSensorValue(FakeSMCSensor *sensor, float value)
+{
+    return false;
+}
+
+/**
+ *  Synchronized method that tries to take vacant GPU index available from internal list
+ *
+ *  @return Index taken (starting from 0) or -1 on failure
+ */
+SInt8 FakeSMCPlugin::takeVacantGPUIndex(void)
+{
+    LOCK;
+
+    SInt8 index = keyStore->takeVacantGPUIndex();
+
+    UNLOCK;
+
+    return index;
+}
+
+/**
+ *  Synchronized method that tries to take specific GPU index available from internal list
+ *
+ *  @param index GPU index to take
+ *
+ *  @return True if the index was taken successfully False otherwise
+ */
+bool FakeSMCPlugin::takeGPUIndex(UInt8 index)
+{
+    LOCK;
+
+    bool taken = keyStore->takeGPUIndex(index);
+
+    UNLOCK;
+
+    return taken;
+}
+
+/**
+ *  Synchronized method that releases previousely taken GPU index by this or another plugin
+ *
+ *  @param index Index to release
+ */
+void FakeSMCPlugin::releaseGPUIndex(UInt8 index)
+{
+    LOCK;
+
+    keyStore->releaseGPUIndex(index);
+
+    UNLOCK;
+}
+
+/**
+ *  Synchronized method that takes vacant Fan index available from internal list. Will update fan counter key on success
+ *
+ *  @return Index taken (starting from 0) or -1 on failure
+ */
+SInt8 FakeSMCPlugin::takeVacantFanIndex(void)
+{
+    LOCK;
+
+    SInt8 index = keyStore->takeVacantFanIndex();
+
+    UNLOCK;
+
+    return index;
+}
+
+/**
+ *  Synchronized method that releases previousely taken Fan index by this or another plugin. Will update fan counter key on success
+ *
+ *  @param index Index to release
+ */
+void FakeSMCPlugin::releaseFanIndex(UInt8 index)
 {
     LOCK;
 
@@ -903,14 +1625,17 @@ bool FakeSMCPlugin::decodeFloatValueForKey(const char *name, float *outValue)
         return false;
 
     if (FakeSMCKey *key = keyStore->getKey(name)) {
-        if (fakeSMCPluginDecodeFloatValue(key->getType(), key->getSize(), key->getValue(), outValue)) {
+        SMCBytes_t value;
+        UInt8 size = key->copyValue(value);
+
+        if (fakeSMCPluginDecodeFloatValue(key->getType(), size, value, outValue)) {
             return true;
         }
         else {
 
             int intValue = 0;
 
-            if (fakeSMCPluginDecodeIntValue(key->getType(), key->getSize(), key->getValue(), &intValue)) {
+            if (fakeSMCPluginDecodeIntValue(key->getType(), size, value, &intValue)) {
                 *outValue = (float)intValue;
                 return true;
             }
@@ -934,14 +1659,17 @@ bool FakeSMCPlugin::decodeIntValueForKey(const char *name, int *outValue)
         return false;
 
     if (FakeSMCKey *key = keyStore->getKey(name)) {
-        if (fakeSMCPluginDecodeIntValue(key->getType(), key->getSize(), key->getValue(), outValue)) {
+        SMCBytes_t value;
+        UInt8 size = key->copyValue(value);
+
+        if (fakeSMCPluginDecodeIntValue(key->getType(), size, value, outValue)) {
             return true;
         }
         else {
 
             float floatValue = 0;
 
-            if (fakeSMCPluginDecodeFloatValue(key->getType(), key->getSize(), key->getValue(), &floatValue)) {
+            if (fakeSMCPluginDecodeFloatValue(key->getType(), size, value, &floatValue)) {
                 *outValue = (int)floatValue;
                 return true;
             }
@@ -951,19 +1679,32 @@ bool FakeSMCPlugin::decodeIntValueForKey(const char *name, int *outValue)
     return false;
 }
 
+static int fakeSMCPluginLookupConfiguration(const void *root, const void *name, const void **object)
+{
+    OSObject *node = ((OSDictionary *)root)->getObject((const OSString *)name);
+
+    if ((*object = OSDynamicCast(OSDictionary, node)))
+        return kFakeSMCConfigurationNode;
+
+    if ((*object = OSDynamicCast(OSString, node)))
+        return kFakeSMCConfigurationLink;
+
+    return kFakeSMCConfigurationNone;
+}
+
 OSDictionary *FakeSMCPlugin::getConfigurationNode(OSDictionary *root, OSString *name)
 {
-    OSDictionary *configuration = NULL;
+    const void *configuration = NULL;
 
     if (root && name) {
         HWSensorsDebugLog("looking up for configuration node: %s", name->getCStringNoCopy());
 
-        if (!(configuration = OSDynamicCast(OSDictionary, root->getObject(name))))
-            if (OSString *link = OSDynamicCast(OSString, root->getObject(name)))
-                configuration = getConfigurationNode(root, link);
+        // Follow links iteratively, a profile linking back to itself must not exhaust the kernel stack
+        if (kFakeSMCConfigurationTooManyLinks == fakeSMCConfigurationResolve(root, name, fakeSMCPluginLookupConfiguration, &configuration))
+            HWSensorsErrorLog("too many links in configuration node: %s", name->getCStringNoCopy());
     }
 
-    return configuration;
+    return (OSDictionary *)configuration;
 }
 
 OSDictionary *FakeSMCPlugin::getConfigurationNode(OSDictionary *root, const char *name)
@@ -991,6 +1732,16 @@ OSDictionary *FakeSMCPlugin::getConfigurationNode(OSDictionary *root, const char
 OSDictionary *FakeSMCPlugin::getConfigurationNode(OSString *model)
 {
     OSDictionary *configuration = NULL;
+    const char *name = model ? model->getCStringNoCopy() : "";
+
+    LOCK;
+
+    // Platform and profiles don't change once the plugin is loaded, resolve every model once
+    if (OSObject *cached = configurations->getObject(name)) {
+        configuration = OSDynamicCast(OSDictionary, cached);
+        UNLOCK;
+        return configuration;
+    }
 
     if (OSDictionary *list = OSDynamicCast(OSDictionary, getProperty("Platform Profile")))
     {
@@ -1004,6 +1755,12 @@ OSDictionary *FakeSMCPlugin::getConfigurationNode(OSString *model)
             configuration = getConfigurationNode(list, "Default");
     }
 
+    // Without the key store the platform is not known yet
+    if (keyStore)
+        configurations->setObject(name, configuration ? (OSObject *)configuration : (OSObject *)kOSBooleanFalse);
+
+    UNLOCK;
+
     return configuration;
 }
 
@@ -1024,6 +1781,23 @@ bool FakeSMCPlugin::init(OSDictionary *properties)
     if (!sensors)
         return false;
 
+    if (!(batchLock = IOLockAlloc()))
+        return false;
+
+    if (!(samplingPeriods = OSDictionary::withCapacity(1)))
+        return false;
+
+    if (!(configurations = OSDictionary::withCapacity(1)))
+        return false;
+
+    if (!(demotedSensors = OSDictionary::withCapacity(1)))
+        return false;
+
+    if (OSNumber *budget = OSDynamicCast(OSNumber, getProperty("Sensor Read Budget")))
+        readBudget = budget->unsigned32BitValue();
+    else
+        readBudget = kFakeSMCSensorReadBudget;
+
 	return true;
 }
 
@@ -1036,18 +1810,128 @@ bool FakeSMCPlugin::start(IOService *provider)
 	if (!super::start(provider))
         return false;
 
-    if (OSDictionary *matching = serviceMatching(kFakeSMCKeyStoreService)) {
-        if (!(keyStore = OSDynamicCast(FakeSMCKeyStore, waitForMatchingService(matching, kFakeSMCDefaultWaitTimeout)))) {
+    OSDictionary *matching = serviceMatching(kFakeSMCKeyStoreService);
+
+    if (!matching)
+        return false;
+
+    if (shouldWaitForKeyStore()) {
+        keyStore = OSDynamicCast(FakeSMCKeyStore, waitForMatchingService(matching, kFakeSMCDefaultWaitTimeout));
+
+        OSSafeRelease(matching);
+
+        if (!keyStore) {
             HWSensorsFatalLog("still waiting for FakeSMCKeyStore...");
             return false;
         }
 
+        return true;
+    }
+
+    // Don't hold a thread while the key store is on its way, continue in startWithKeyStore once it's published
+    if (OSIterator *iterator = getMatchingServices(matching)) {
+        keyStore = OSDynamicCast(FakeSMCKeyStore, iterator->getNextObject());
+        OSSafeRelease(iterator);
+    }
+
+    if (keyStore) {
+        OSSafeRelease(matching);
+        return startWithKeyStore(provider);
+    }
+
+    // The notification only hands over, startWithKeyStore runs on its own thread
+    if (!(keyStoreCall = thread_call_allocate(OSMemberFunctionCast(thread_call_func_t, this, &FakeSMCPlugin::keyStoreCallout), this))) {
         OSSafeRelease(matching);
+        HWSensorsFatalLog("failed to allocate FakeSMCKeyStore thread call");
+        return false;
     }
 
+    IONotifier *notifier = addMatchingNotification(gIOFirstPublishNotification, matching, OSMemberFunctionCast(IOServiceMatchingNotificationHandler, this, &FakeSMCPlugin::keyStorePublished), this);
+
+    OSSafeRelease(matching);
+
+    if (!notifier) {
+        HWSensorsFatalLog("failed to install FakeSMCKeyStore notification");
+        return false;
+    }
+
+    LOCK;
+
+    // The notification may have fired and removed itself already
+    if (!keyStore)
+        keyStoreNotifier = notifier;
+
+    UNLOCK;
+
+    HWSensorsDebugLog("waiting for FakeSMCKeyStore in background");
+
 	return true;
 }
 
+/**
+ *  For internal use, FakeSMCKeyStore publish notification handler
+ *
+ */
+bool FakeSMCPlugin::keyStorePublished(void *refCon, IOService *newService, IONotifier *notifier)
+{
+    LOCK;
+
+    if (keyStore || !(keyStore = OSDynamicCast(FakeSMCKeyStore, newService))) {
+        UNLOCK;
+        return true;
+    }
+
+    notifier->remove();
+    keyStoreNotifier = NULL;
+
+    // Released by the callout, or by stop if it never runs
+    retain();
+
+    // True if already pending, holding a reference then
+    if (thread_call_enter(keyStoreCall))
+        release();
+
+    UNLOCK;
+
+    return true;
+}
+
+/**
+ *  For internal use, starts the plugin with FakeSMCKeyStore off the publish notification thread
+ *
+ */
+void FakeSMCPlugin::keyStoreCallout(void)
+{
+    if (!startWithKeyStore(getProvider())) {
+        HWSensorsErrorLog("failed to start with FakeSMCKeyStore");
+        terminate();
+    }
+
+    release();
+}
+
+/**
+ *  Override and return false to make start return without waiting for FakeSMCKeyStore, sensors are then added in startWithKeyStore. Plugins waiting in start (the default) have the key store ready once FakeSMCPlugin::start returns
+ *
+ *  @return True to wait for FakeSMCKeyStore in start
+ */
+bool FakeSMCPlugin::shouldWaitForKeyStore(void)
+{
+    return true;
+}
+
+/**
+ *  Called for plugins not waiting for FakeSMCKeyStore (see shouldWaitForKeyStore) once the key store is available, right from start if it is already published or later on a thread call once the publish notification arrives. Anything using the key store (sensors, platform profiles) belongs here. A plugin is terminated if it returns false after start returned
+ *
+ *  @param provider Plugin provider
+ *
+ *  @return True on success
+ */
+bool FakeSMCPlugin::startWithKeyStore(IOService *provider)
+{
+    return true;
+}
+
 inline UInt8 index_of_hex_char(char c)
 {
 	return c > 96 && c < 103 ? c - 87 : c > 47 && c < 58 ? c - 48 : 0;
@@ -1059,9 +1943,22 @@ inline UInt8 index_of_hex_char(char c)
  */
 void FakeSMCPlugin::stop(IOService* provider)
 {
+    LOCK;
+
+    if (keyStoreNotifier) {
+        keyStoreNotifier->remove();
+        keyStoreNotifier = NULL;
+    }
+
+    UNLOCK;
+
+    // Let a running startWithKeyStore finish before its keys are cleaned up
+    if (keyStoreCall && thread_call_cancel_wait(keyStoreCall))
+        release();
+
     HWSensorsDebugLog("removing handler");
 
-    if (OSCollectionIterator *iterator = OSCollectionIterator::withCollection(keyStore->getKeys())) {
+    if (OSCollectionIterator *iterator = keyStore ? OSCollectionIterator::withCollection(keyStore->getKeys()) : NULL) {
         while (FakeSMCKey *key = OSDynamicCast(FakeSMCKey, iterator->getNextObject())) {
             if (key->getHandler() == this) {
                 if (FakeSMCSensor *sensor = getSensor(key->getKey())) {
@@ -1078,9 +1975,26 @@ void FakeSMCPlugin::stop(IOService* provider)
         OSSafeRelease(iterator);
     }
 
+    if (samplingTimer) {
+        samplingTimer->cancelTimeout();
+
+        if (IOWorkLoop *workloop = getWorkLoop())
+            workloop->removeEventSource(samplingTimer);
+    }
+
+    if (demotionTimer) {
+        demotionTimer->cancelTimeout();
+        demotionWorkLoop->removeEventSource(demotionTimer);
+    }
+
     HWSensorsDebugLog("releasing sensors collection");
 
+    // Callbacks still in flight hold their own reference to the sensor
+    LOCK;
     sensors->flushCollection();
+    UNLOCK;
+
+    sensorMemory = 0;
 
 	super::stop(provider);
 }
@@ -1093,9 +2007,132 @@ void FakeSMCPlugin::free()
 {
     HWSensorsDebugLog("freenig sensors collection");
     OSSafeRelease(sensors);
+    OSSafeRelease(samplingPeriods);
+    OSSafeRelease(configurations);
+    OSSafeRelease(demotedSensors);
+    OSSafeRelease(samplingTimer);
+    OSSafeRelease(demotionTimer);
+    OSSafeRelease(demotionWorkLoop);
+
+    if (keyStoreCall) {
+        thread_call_free(keyStoreCall);
+        keyStoreCall = 0;
+    }
+
+    if (batchLock) {
+        IOLockFree(batchLock);
+        batchLock = 0;
+    }
+
 	super::free();
 }
 
+/**
+ *  For internal use, waits while another thread reads the batch. The batch lock is not held on return, so the plugin never reads its hardware under it
+ *
+ *  @param sensor   Sensor to read, 0 to start a batch read whatever the values
+ *  @param outValue Receives the value of the sensor on kFakeSMCSensorBatchUseValue
+ *
+ *  @return kFakeSMCSensorBatch*, on kFakeSMCSensorBatchRead finish with endBatchRead
+ */
+int FakeSMCPlugin::beginBatchRead(FakeSMCSensor *sensor, float *outValue)
+{
+    int action;
+
+    IOLockLock(batchLock);
+
+    while (kFakeSMCSensorBatchWait == (action = fakeSMCSensorBatchBegin(&batch, IOThreadSelf(), sensor && sensor->getBatchValue(outValue, ptimer_uptime()))))
+        IOLockSleep(batchLock, &batch, THREAD_UNINT);
+
+    IOLockUnlock(batchLock);
+
+    return action;
+}
+
+void FakeSMCPlugin::endBatchRead(bool supported)
+{
+    IOLockLock(batchLock);
+
+    fakeSMCSensorBatchEnd(&batch, supported);
+
+    IOLockWakeup(batchLock, &batch, false);
+    IOLockUnlock(batchLock);
+}
+
+/**
+ *  For internal use, read through willReadSensorValues when the plugin implements it
+ *
+ */
+bool FakeSMCPlugin::readSensorValue(FakeSMCSensor *sensor, float *outValue)
+{
+    // Sampled or batch read value
+    if (sensor->getBatchValue(outValue, ptimer_uptime()))
+        return true;
+
+    // Demoted sensors are read by the demotion timer only, a reader never waits for their hardware
+    switch (sensor->getStaleValue(outValue)) {
+        case kFakeSMCSensorStaleServe:
+            return true;
+
+        case kFakeSMCSensorStaleFail:
+            return false;
+    }
+
+    switch (beginBatchRead(sensor, outValue)) {
+        case kFakeSMCSensorBatchUseValue:
+            // Another key of this plugin refreshed the batch while we were waiting
+            return true;
+
+        case kFakeSMCSensorBatchRead: {
+            bool supported = true;
+
+            if (OSArray *staleSensors = OSArray::withCapacity(sensors->getCount())) {
+                // Sensors are added under the plugins lock, the stale ones are read without it
+                LOCK;
+
+                if (OSCollectionIterator *iterator = OSCollectionIterator::withCollection(sensors)) {
+                    UInt64 time = ptimer_uptime();
+                    float value;
+
+                    while (const OSSymbol *key = (const OSSymbol *)iterator->getNextObject()) {
+                        FakeSMCSensor *candidate = OSDynamicCast(FakeSMCSensor, sensors->getObject(key));
+
+                        // Demoted sensors are left to the demotion timer
+                        if (candidate && candidate->demotion == kFakeSMCSensorOnDemand && !candidate->getBatchValue(&value, time))
+                            staleSensors->setObject(candidate);
+                    }
+
+                    OSSafeRelease(iterator);
+                }
+
+                UNLOCK;
+
+                supported = timedReadSensorValues(staleSensors);
+
+                OSSafeRelease(staleSensors);
+            }
+
+            endBatchRead(supported);
+
+            if (sensor->getBatchValue(outValue, ptimer_uptime()))
+                return true;
+
+            break;
+        }
+    }
+
+    UInt64 elapsed;
+
+    if (!timedReadSensorValue(sensor, outValue, &elapsed))
+        return false;
+
+    *outValue = sensor->filterValue(*outValue);
+
+    accountSensorRead(sensor, elapsed, *outValue);
+
+    return true;
+}
+
 /**
  *  For internal use, do not override
  *
@@ -1103,17 +2140,25 @@ void FakeSMCPlugin::free()
 IOReturn FakeSMCPlugin::readKeyCallback(const char *key, const char *type, const UInt8 size, void *buffer)
 {
     if (key && buffer) {
-        if (FakeSMCSensor *sensor = getSensor(key)) {
+        if (FakeSMCSensor *sensor = copySensor(key)) {
+            IOReturn result = kIOReturnBadArgument;
+
             if (size == sensor->getSize()) {
 
                 float value;
 
-                if (willReadSensorValue(sensor, &value)) {
+                if (readSensorValue(sensor, &value)) {
                     sensor->encodeNumericValue(value, buffer);
                 }
 
-                return kIOReturnSuccess;
+                publishResourceUsage();
+
+                result = kIOReturnSuccess;
             }
+
+            sensor->release();
+
+            return result;
         }
         else return kIOReturnNotFound;
     }
@@ -1128,20 +2173,28 @@ IOReturn FakeSMCPlugin::readKeyCallback(const char *key, const char *type, const
 IOReturn FakeSMCPlugin::writeKeyCallback(const char *key, const char *type, const UInt8 size, const void *buffer)
 {       
     if (key && type && buffer) {
-        if (FakeSMCSensor *sensor = getSensor(key)) {
+        if (FakeSMCSensor *sensor = copySensor(key)) {
+            IOReturn result = kIOReturnBadArgument;
+
             if (size == sensor->getSize()) {
                 float floatValue = 0;
                 int intValue = 0;
 
                 if (fakeSMCPluginDecodeFloatValue(type, size, buffer, &floatValue)) {
-                    didWriteSensorValue(sensor, floatValue);
+                    timedWriteSensorValue(sensor, floatValue);
                 }
                 else if (fakeSMCPluginDecodeIntValue(type, size, buffer, &intValue)) {
-                    didWriteSensorValue(sensor, intValue);
+                    timedWriteSensorValue(sensor, intValue);
                 }
+
+                publishResourceUsage();
                 
-                return kIOReturnSuccess;
+                result = kIOReturnSuccess;
             }
+
+            sensor->release();
+
+            return result;
         }
         else return kIOReturnNotFound;
     }
@@ -25,10 +25,15 @@
 #define HWSensors_FakeSMCFamily_h
 
 #include <IOKit/IOService.h>
+#include <IOKit/IOTimerEventSource.h>
+#include <kern/thread_call.h>
 
 #include "FakeSMCDefinitions.h"
 #include "FakeSMCKeyStore.h"
 #include "FakeSMCKeyHandler.h"
+#include "FakeSMCSensorBatch.h"
+#include "FakeSMCSensorFilter.h"
+#include "FakeSMCSensorDefinitions.h"
 
 #define kFakeSMCTemperatureSensor   1
 #define kFakeSMCVoltageSensor       2
@@ -38,147 +43,6 @@
 #define kFakeSMCCurrentSensor       6
 #define kFakeSMCPowerSensor         7
 
-/**
- *  Sensor category used to look up for proper sensor definitions
- */
-enum FakeSMCSensorCategory {
-    kFakeSMCCategoryNone = 0,
-    kFakeSMCCategoryTemperature,
-    kFakeSMCCategoryMultiplier,
-    kFakeSMCCategoryFrequency,
-    kFakeSMCCategoryVoltage,
-    kFakeSMCCategoryCurrent,
-    kFakeSMCCategoryPower,
-    kFakeSMCCategoryFan,
-};
-
-struct FakeSMCSensorDefinitionEntry {
-    const char              *name;
-    const char              *key;
-    const char              *type;
-    UInt8                   size;
-    FakeSMCSensorCategory   category;
-    UInt8                   shift;
-    UInt8                   count;
-};
-
-#ifdef DEFINE_FAKESMC_SENSOR_PARAMS
-
-const struct FakeSMCSensorDefinitionEntry FakeSMCSensorDefinitions[] =
-{
-    {"Ambient",                 "TA0P", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 0},
-    {"CPU Die",                 "TC%XD", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 0xF},
-    {"CPU Package",             "TC%XC", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0xA, 0x6},
-    //{"CPU Core",                "TC%XC", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 0xF},
-    {"CPU GFX",                 "TC%XG", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 0xF},
-    {"CPU Heatsink",            "TC%XH", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
-    {"CPU Proximity",           "TC%XP", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
-    {"Northbridge Die",         "TN%XD", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
-    {"Northbridge Proximity",   "TN%XP", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
-    {"MCH Die",                 "TN%XC", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
-    {"MCH Heatsink",            "TN%XH", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
-    {"PCH Die",                 "TP%XD", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
-    {"PCH Proximity",           "TP%XP", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
-    {"Memory Module",           "TM%XS", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 0xF},
-    {"Memory Proximity",        "TM%XP", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 0xF},
-    {"LCD",                     "TL0P", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 0},
-    {"Airport",                 "TW0P", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 0},
-    {"Battery",                 "TB%XP", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
-    {"Mainboard",               "Tm0P", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 0},
-    /*{"GPU Die",                 "TG%XD", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
-    {"GPU Heatsink",            "TG%XH", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
-    {"GPU Proximity",           "TG%Xp", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
-    {"GPU Memory",              "TG%XM", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},*/
-    {"Thermal Zone",            "TZ%XC", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 0xF},
-    
-    // Multipliers
-    {"CPU Core",                "MlC%X", TYPE_FP88, TYPE_FPXX_SIZE, kFakeSMCCategoryMultiplier, 0, 0xF},
-    {"CPU Package",             "MlCP", TYPE_FP88, TYPE_FPXX_SIZE, kFakeSMCCategoryMultiplier, 0, 0},
-    
-    // Clocks
-    {"CPU Core",                "CC%XC", TYPE_UI32, TYPE_UI32_SIZE, kFakeSMCCategoryFrequency, 0, 0xF},
-    {"CPU Package",             "CCPC", TYPE_UI32, TYPE_UI32_SIZE, kFakeSMCCategoryFrequency, 0, 0},
-    /*{"GPU Core",                "CG%XC", TYPE_UI32, TYPE_UI32_SIZE, kFakeSMCCategoryFrequency, 0, 4},
-    {"GPU Memory",              "CG%XM", TYPE_UI32, TYPE_UI32_SIZE, kFakeSMCCategoryFrequency, 0, 4},
-    {"GPU Shaders",             "CG%XS", TYPE_UI32, TYPE_UI32_SIZE, kFakeSMCCategoryFrequency, 0, 4},
-    {"GPU ROPs",                "CG%XR", TYPE_UI32, TYPE_UI32_SIZE, kFakeSMCCategoryFrequency, 0, 4},*/
-    
-    // Voltages
-    {"CPU Core",                "VC0C", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 0},
-    {"CPU GFX",                 "VC%XG", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 0xF},
-    {"CPU VTT",                 "VV1R", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 0},
-    {"PCH",                     "VN1R", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 0},
-    {"Memory",                  "VM0R", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 0},
-    {"MCH",                     "VN0C", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 0},
-    {"Main 3V",                 "VV2S", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 0},
-    {"Main 5V",                 "VV1S", "fp4c", 2, kFakeSMCCategoryVoltage, 0, 0},
-    {"Main 12V",                "VV9S", "fp4c", 2, kFakeSMCCategoryVoltage, 0, 0},
-    {"Auxiliary 3V",            "VV7S", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 0},
-    {"Standby 3V",              "VV3S", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 0},
-    {"Standby 5V",              "VV8S", "fp4c", 2, kFakeSMCCategoryVoltage, 0, 0},
-    {"PCIe 12V",                "VeES", "fp4c", 2, kFakeSMCCategoryVoltage, 0, 0},
-    {"+12V Rail",               "VP0R", "fp4c", 2, kFakeSMCCategoryVoltage, 0, 0},
-    {"12V Vcc",                 "Vp0C", "fp4c", 2, kFakeSMCCategoryVoltage, 0, 0},
-    {"Power Supply",            "Vp%XC", "fp4c", 2, kFakeSMCCategoryVoltage, 1, 0xE},
-    {"Mainboard S0 Rail",       "VD0R", "fp4c", 2, kFakeSMCCategoryVoltage, 0, 0},
-    {"Mainboard S5 Rail",       "VD5R", "fp4c", 2, kFakeSMCCategoryVoltage, 0, 0},
-    {"CMOS Battery",            "Vb0R", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 0},
-    {"Battery",                 "VBAT", "fp4c", 2, kFakeSMCCategoryVoltage, 0, 0},
-    {"CPU VRM",                 "VS%XC", "fp4c", 2, kFakeSMCCategoryVoltage, 0, 0xF},
-
-    /*{"GPU Core",                "VC%XG", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 4},*/
-    
-    // Currents
-    {"CPU Core",                "IC0C", "sp78", 2, kFakeSMCCategoryCurrent, 0, 0},
-    {"CPU VccIO",               "IC1C", "sp5a", 2, kFakeSMCCategoryCurrent, 0, 0},
-    {"CPU VccSA",               "IC2C", "sp5a", 2, kFakeSMCCategoryCurrent, 0, 0},
-    {"CPU DRAM",                "IC5R", "sp4b", 2, kFakeSMCCategoryCurrent, 0, 0},
-    {"CPU PLL",                 "IC8R", "sp5a", 2, kFakeSMCCategoryCurrent, 0, 0},
-    {"CPU",                     "IC%XC", "sp78", 2, kFakeSMCCategoryCurrent, 0, 0xF},
-    {"CPU GFX",                 "IC0G", "sp5a", 2, kFakeSMCCategoryCurrent, 0, 0},
-    {"Memory Bank",             "IM%XS", "sp5a", 2, kFakeSMCCategoryCurrent, 0, 0xF},
-    {"MCH",                     "IN0C", "sp87", 2, kFakeSMCCategoryCurrent, 0, 0},
-    
-    /*{"GPU",                     "IG%XC", "sp78", 2, kFakeSMCCategoryCurrent, 0, 4},*/
-    
-//    [NSArray arrayWithObjects:@"IM0R",       @"Memory Rail", nil],
-//    [NSArray arrayWithObjects:@"IW0E",       @"Airport Rail", nil],
-//    [NSArray arrayWithObjects:@"IB0R",       @"Battery Rail", nil],
-//    [NSArray arrayWithObjects:@"Ie:081S",    @"PCIe Slot %X", nil],
-//    [NSArray arrayWithObjects:@"IM:A4AS",    @"PCIe Booster %X", nil],
-//    [NSArray arrayWithObjects:@"ID0R",       @"Mainboard S0 Rail", nil],
-//    [NSArray arrayWithObjects:@"ID5R",       @"Mainboard S5 Rail", nil],
-    
-    // Powers
-    {"CPU Core",                "PC%XC", "sp96", 2, kFakeSMCCategoryPower, 0, 0x8},
-    {"CPU",                     "PC%XC", "sp96", 2, kFakeSMCCategoryPower, 0xA, 6},
-    {"CPU GFX",                 "PC%XG", "sp96", 2, kFakeSMCCategoryPower, 0, 0x4},
-    {"CPU Package Cores",       "PCPC", "sp96", 2, kFakeSMCCategoryPower, 0, 0},
-    {"CPU Package Graphics",    "PCPG", "sp96", 2, kFakeSMCCategoryPower, 0, 0},
-    {"CPU Package Total",       "PCTR", "sp96", 2, kFakeSMCCategoryPower, 0, 0},
-    {"CPU Package DRAM",        "PCPD", "sp96", 2, kFakeSMCCategoryPower, 0, 0},
-//    [NSArray arrayWithObjects:@"PC1R",       @"CPU Rail", nil],
-//    [NSArray arrayWithObjects:@"PC5R",       @"CPU 1.5V S0 Rail", nil],
-//    [NSArray arrayWithObjects:@"PM0R",       @"Memory Rail", nil],
-//    [NSArray arrayWithObjects:@"PM:A4AS",    @"Memory Bank %X", nil],
-//    [NSArray arrayWithObjects:@"Pe:041S",    @"PCIe Slot %X", nil],
-//    [NSArray arrayWithObjects:@"Pe:A4AS",    @"PCIe Booster %X", nil],
-    
-    /*{"GPU",                     "PG%XC", "sp96", 2, kFakeSMCCategoryPower, 0, 4},*/
-    
-//    [NSArray arrayWithObjects:@"PG0R",       @"GPU Rail", nil],
-//    [NSArray arrayWithObjects:@"PG:132R",    @"GPU %X Rail", nil],
-//    [NSArray arrayWithObjects:@"PD0R",       @"Mainboard S0 Rail", nil],
-//    [NSArray arrayWithObjects:@"PD5R",       @"Mainboard S5 Rail", nil],
-//    [NSArray arrayWithObjects:@"Pp0C",       @"Power Supply 12V", nil],
-    {"System Total",            "PDTR", "sp96", 2, kFakeSMCCategoryPower, 0, 0},
-//    [NSArray arrayWithObjects:@"PZ:041G",    @"Zone %X Average", nil],
-    
-    {NULL, NULL, NULL, 0, kFakeSMCCategoryNone, 0, 0}
-};
-
-#endif // DEFINE_FAKESMC_SENSOR_PARAMS
-
 ////UInt8   fakeSMCPluginGetIndexFromChar(char c);
 bool 	fakeSMCPluginIsValidIntegerType(const char *type);
 bool    fakeSMCPluginIsValidFloatingType(const char *type);
@@ -189,6 +53,26 @@ bool    fakeSMCPluginDecodeIntValue(const char *type, const UInt8 size, const vo
 
 class FakeSMCPlugin;
 
+/**
+ *  Hardware access kinds counted with FakeSMCPlugin::accountHardwareAccess
+ */
+enum FakeSMCHardwareAccess {
+    kFakeSMCPortAccess = 0,
+    kFakeSMCMSRAccess,
+    kFakeSMCMMIOAccess,
+    kFakeSMCACPIAccess,
+    kFakeSMCHardwareAccessTypes
+};
+
+/**
+ *  Demotion states of a sensor, see FakeSMCPlugin::accountSensorRead
+ */
+enum {
+    kFakeSMCSensorOnDemand = 0,
+    kFakeSMCSensorDemoting,         // claimed by a slow reader, applied by the demotion timer
+    kFakeSMCSensorDemoted           // sampled in the background only
+};
+
 class EXPORT FakeSMCSensor : public OSObject {
     OSDeclareDefaultStructors(FakeSMCSensor)
     	
@@ -202,13 +86,36 @@ protected:
     float               reference;
     float               gain;
     float               offset;
+
+    IOLock              *valueLock;         // guards filter, batchValue and batchTime, a leaf never held while reading hardware
+    float               batchValue;
+    UInt64              batchTime;          // monotonic nanoseconds, 0 if none
+
+    UInt32              samplingPeriod;     // milliseconds, 0 when sampled on demand
+    UInt64              nextSampleTime;     // monotonic nanoseconds
+
+    FakeSMCSensorFilter filter;
+
+    SMCHistoryRing_t    *history;           // shared with user clients, see FakeSMCKeyStore::takeHistoryRing
+
+    UInt8               slowReads;          // on demand reads over the plugin read budget in a row
+    volatile UInt32     demotion;           // kFakeSMCSensor*, changed atomically
+    UInt32              demotionLatency;    // microseconds, of the read that demoted the sensor
+
+    void                recordHistory(float value);
+    void                publishValue(float value);
+    int                 getStaleValue(float *outValue);
+
+    friend class FakeSMCPlugin;
 	
 public:
     static bool         parseModifiers(OSDictionary *node, float *reference, float *gain, float *offset);
+    bool                parseFilter(OSDictionary *node);
     
 	static FakeSMCSensor *withOwner(FakeSMCPlugin *aOwner, const char* aKey, const char* aType, UInt8 aSize, UInt32 aGroup, UInt32 aIndex, float aReference = 0.0f, float aGain = 0.0f, float aOffset = 0.0f);
     
    	virtual bool		initWithOwner(FakeSMCPlugin *aOwner, const char* aKey, const char* aType, UInt8 aSize, UInt32 aGroup, UInt32 aIndex, float aReference, float aGain, float aOffset);
+    virtual void        free(void);
     
     const char          *getKey();
     const char          *getType();
@@ -220,12 +127,67 @@ public:
     float               getOffset();
     
     void                encodeNumericValue(float value, void *outBuffer);
+
+    void                setFilter(float alpha, UInt8 median, float spike);
+    float               filterValue(float value);
+
+    void                setBatchValue(float value);
+    bool                getBatchValue(float *outValue, UInt64 time);
 };
 
 class EXPORT FakeSMCPlugin : public FakeSMCKeyHandler {
 	OSDeclareDefaultStructors(FakeSMCPlugin)
 
 private:
+    FakeSMCSensorBatch      batch;
+    IOLock                  *batchLock;         // guards batch only, never held while the plugin reads
+
+    OSDictionary            *samplingPeriods;
+    IOTimerEventSource      *samplingTimer;
+
+    IOWorkLoop              *demotionWorkLoop;  // demoted sensors are slow, sampled apart from the shared workloop
+    IOTimerEventSource      *demotionTimer;
+
+    OSDictionary            *configurations;    // resolved configuration nodes by model, kOSBooleanFalse if none
+
+    IONotifier              *keyStoreNotifier;
+    thread_call_t           keyStoreCall;       // runs startWithKeyStore for plugins not waiting in start
+
+    UInt32                  readBudget;         // microseconds
+    OSDictionary            *demotedSensors;    // read latency in microseconds by key
+
+    // Resource usage, times in nanoseconds
+    volatile SInt64         sensorMemory;
+    volatile SInt64         readCalls;
+    volatile SInt64         readTime;
+    volatile SInt64         writeCalls;
+    volatile SInt64         writeTime;
+    volatile SInt64         hardwareAccesses[kFakeSMCHardwareAccessTypes];
+    volatile UInt64         resourceUsagePublished;
+
+    bool                    initSamplingTimer(void);
+    bool                    initDemotionTimer(void);
+    void                    accountSensorRead(FakeSMCSensor *sensor, UInt64 elapsed, float value);
+
+    UInt64                  accountHandlerTime(volatile SInt64 *time, volatile SInt64 *calls, UInt64 started);
+    bool                    timedReadSensorValue(FakeSMCSensor *sensor, float *outValue, UInt64 *outElapsed);
+    bool                    timedReadSensorValues(OSArray *staleSensors);
+    bool                    timedWriteSensorValue(FakeSMCSensor *sensor, float value);
+    void                    publishResourceUsage(void);
+
+    bool                    keyStorePublished(void *refCon, IOService *newService, IONotifier *notifier);
+    void                    keyStoreCallout(void);
+
+    void                    scheduleSensorSampling(FakeSMCSensor *sensor, UInt32 period, UInt64 time);
+    UInt64                  collectDueSensors(OSArray *due, bool demoted, UInt64 time);
+    void                    samplingTimerAction(IOTimerEventSource *sender);
+    void                    demotionTimerAction(IOTimerEventSource *sender);
+
+    int                     beginBatchRead(FakeSMCSensor *sensor, float *outValue);
+    void                    endBatchRead(bool supported);
+    bool                    readSensorValue(FakeSMCSensor *sensor, float *outValue);
+    FakeSMCSensor           *copySensor(const char *key);
+
     virtual IOReturn        readKeyCallback(const char *key, const char *type, const UInt8 size, void *buffer);
     virtual IOReturn        writeKeyCallback(const char *key, const char *type, const UInt8 size, const void *buffer);
 
@@ -256,13 +218,20 @@ protected:
     virtual FakeSMCSensor   *addSensorFromNode(OSObject *node, FakeSMCSensorCategory category, UInt32 group, UInt32 index);
     	virtual FakeSMCSensor   *addTachometer(UInt32 index, const char *name = 0, FanType type = FAN_RPM, UInt8 zone = 0, FanLocationType location = CENTER_MID_FRONT, SInt8 *fanIndex = 0);
     virtual bool            addSensor(FakeSMCSensor *sensor);
+    bool                    setSamplingPeriod(UInt32 group, UInt32 milliseconds);
+    bool                    keepSensorHistory(FakeSMCSensor *sensor);
+    void                    accountHardwareAccess(FakeSMCHardwareAccess type, UInt32 count = 1);
 	virtual FakeSMCSensor   *getSensor(const char *key);
     
     OSDictionary            *getConfigurationNode(OSDictionary *root, OSString *name);
     OSDictionary            *getConfigurationNode(OSDictionary *root, const char *name);
     OSDictionary            *getConfigurationNode(OSString *model = NULL);
 
+    virtual bool            shouldWaitForKeyStore(void);
+    virtual bool            startWithKeyStore(IOService *provider);
+
     virtual bool            willReadSensorValue(FakeSMCSensor *sensor, float *outValue);
+    virtual bool            willReadSensorValues(OSArray *staleSensors);
     virtual bool            didWriteSensorValue(FakeSMCSensor *sensor, float value);
     
 public:
@@ -0,0 +1,108 @@
+//
+//  FakeSMCSensorBatch.h
+//  HWSensors
+//
+//  Decides how FakeSMCPlugin serves a sensor read when the plugin reads all of its stale sensors
+//  in one pass. Plain C with no IOKit dependencies, so the same code runs in the host tests (see
+//  Tests/). Every call is made with the plugin batch lock held, the lock is dropped while the
+//  plugin reads its hardware
+//
+
+#ifndef HWSensors_FakeSMCSensorBatch_h
+#define HWSensors_FakeSMCSensorBatch_h
+
+#define kFakeSMCSensorBatchValueLifetime    500000000ull    // nanoseconds, as fresh as FakeSMCKey allows a handler value to be
+
+typedef struct {
+    void                *thread;            // running willReadSensorValues, 0 if none
+    UInt32              unsupported;        // plugin has no willReadSensorValues, sensors are read one by one
+} FakeSMCSensorBatch;
+
+enum {
+    kFakeSMCSensorBatchUseValue     = 0,
+    kFakeSMCSensorBatchRead         = 1,    // caller reads the stale sensors and reports with fakeSMCSensorBatchEnd
+    kFakeSMCSensorBatchWait         = 2,    // another thread is reading, wait for it and ask again
+    kFakeSMCSensorBatchReadOne      = 3,    // caller reads the sensor alone
+};
+
+/**
+ *  @param valueTime Monotonic nanoseconds of the last batch or sampled value, 0 if none
+ *  @param period    Sampling period of the sensor in milliseconds, 0 when read on demand
+ *  @param time      Monotonic time in nanoseconds
+ *
+ *  @return True if the value can still be served
+ */
+static inline int fakeSMCSensorValueIsFresh(UInt64 valueTime, UInt32 period, UInt64 time)
+{
+    // Sampled values stay valid until the sample after next is overdue
+    UInt64 lifetime = (UInt64)period * 2000000ull;
+
+    if (lifetime < kFakeSMCSensorBatchValueLifetime)
+        lifetime = kFakeSMCSensorBatchValueLifetime;
+
+    return valueTime && time - valueTime < lifetime;
+}
+
+enum {
+    kFakeSMCSensorStaleRead         = 0,    // read on demand, see fakeSMCSensorBatchBegin
+    kFakeSMCSensorStaleServe        = 1,    // serve the last sampled value however old
+    kFakeSMCSensorStaleFail         = 2,    // nothing sampled yet
+};
+
+/**
+ *  Decide how a read of a sensor without a fresh value goes on. Demoted sensors are too slow to be
+ *  read on demand, only the background sampling reads them
+ *
+ *  @param demoted   Sensor is demoted or being demoted
+ *  @param valueTime Monotonic nanoseconds of the last batch or sampled value, 0 if none
+ *
+ *  @return kFakeSMCSensorStale*
+ */
+static inline int fakeSMCSensorStaleAction(int demoted, UInt64 valueTime)
+{
+    if (!demoted)
+        return kFakeSMCSensorStaleRead;
+
+    return valueTime ? kFakeSMCSensorStaleServe : kFakeSMCSensorStaleFail;
+}
+
+/**
+ *  Decide how a read of a sensor is served
+ *
+ *  @param batch  Batch state of the plugin
+ *  @param thread Reading thread
+ *  @param fresh  Sensor has a fresh value, see fakeSMCSensorValueIsFresh
+ *
+ *  @return kFakeSMCSensorBatch*
+ */
+static inline int fakeSMCSensorBatchBegin(FakeSMCSensorBatch *batch, void *thread, int fresh)
+{
+    if (fresh)
+        return kFakeSMCSensorBatchUseValue;
+
+    // The thread running the batch gets here again when willReadSensorValues reads a key of its own plugin
+    if (batch->unsupported || batch->thread == thread)
+        return kFakeSMCSensorBatchReadOne;
+
+    if (batch->thread)
+        return kFakeSMCSensorBatchWait;
+
+    batch->thread = thread;
+
+    return kFakeSMCSensorBatchRead;
+}
+
+/**
+ *  Finish a batch read started with fakeSMCSensorBatchBegin, then wake up readers waiting for it
+ *
+ *  @param supported False if the plugin has no willReadSensorValues
+ */
+static inline void fakeSMCSensorBatchEnd(FakeSMCSensorBatch *batch, int supported)
+{
+    batch->thread = 0;
+
+    if (!supported)
+        batch->unsupported = 1;
+}
+
+#endif
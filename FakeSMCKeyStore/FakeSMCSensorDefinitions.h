@@ -0,0 +1,221 @@
+//
+//  FakeSMCSensorDefinitions.h
+//  HWSensors
+//
+//  Sensor definitions looked up by FakeSMCPlugin::addSensorUsingAbbreviation. Plain C with no
+//  IOKit dependencies, so the same code runs in the host tests (see Tests/)
+//
+
+#ifndef HWSensors_FakeSMCSensorDefinitions_h
+#define HWSensors_FakeSMCSensorDefinitions_h
+
+#include "FakeSMCDefinitions.h"
+
+/**
+ *  Sensor category used to look up for proper sensor definitions
+ */
+typedef enum FakeSMCSensorCategory {
+    kFakeSMCCategoryNone = 0,
+    kFakeSMCCategoryTemperature,
+    kFakeSMCCategoryMultiplier,
+    kFakeSMCCategoryFrequency,
+    kFakeSMCCategoryVoltage,
+    kFakeSMCCategoryCurrent,
+    kFakeSMCCategoryPower,
+    kFakeSMCCategoryFan,
+} FakeSMCSensorCategory;
+
+typedef struct FakeSMCSensorDefinitionEntry {
+    const char              *name;
+    const char              *key;
+    const char              *type;
+    UInt8                   size;
+    FakeSMCSensorCategory   category;
+    UInt8                   shift;
+    UInt8                   count;
+} FakeSMCSensorDefinitionEntry;
+
+#ifdef DEFINE_FAKESMC_SENSOR_PARAMS
+
+const struct FakeSMCSensorDefinitionEntry FakeSMCSensorDefinitions[] =
+{
+    {"Ambient",                 "TA0P", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 0},
+    {"CPU Die",                 "TC%XD", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 0xF},
+    {"CPU Package",             "TC%XC", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0xA, 0x6},
+    //{"CPU Core",                "TC%XC", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 0xF},
+    {"CPU GFX",                 "TC%XG", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 0xF},
+    {"CPU Heatsink",            "TC%XH", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
+    {"CPU Proximity",           "TC%XP", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
+    {"Northbridge Die",         "TN%XD", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
+    {"Northbridge Proximity",   "TN%XP", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
+    {"MCH Die",                 "TN%XC", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
+    {"MCH Heatsink",            "TN%XH", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
+    {"PCH Die",                 "TP%XD", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
+    {"PCH Proximity",           "TP%XP", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
+    {"Memory Module",           "TM%XS", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 0xF},
+    {"Memory Proximity",        "TM%XP", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 0xF},
+    {"LCD",                     "TL0P", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 0},
+    {"Airport",                 "TW0P", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 0},
+    {"Battery",                 "TB%XP", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
+    {"Mainboard",               "Tm0P", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 0},
+    /*{"GPU Die",                 "TG%XD", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
+    {"GPU Heatsink",            "TG%XH", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
+    {"GPU Proximity",           "TG%Xp", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},
+    {"GPU Memory",              "TG%XM", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 4},*/
+    {"Thermal Zone",            "TZ%XC", TYPE_SP78, TYPE_SPXX_SIZE, kFakeSMCCategoryTemperature, 0, 0xF},
+    
+    // Multipliers
+    {"CPU Core",                "MlC%X", TYPE_FP88, TYPE_FPXX_SIZE, kFakeSMCCategoryMultiplier, 0, 0xF},
+    {"CPU Package",             "MlCP", TYPE_FP88, TYPE_FPXX_SIZE, kFakeSMCCategoryMultiplier, 0, 0},
+    
+    // Clocks
+    {"CPU Core",                "CC%XC", TYPE_UI32, TYPE_UI32_SIZE, kFakeSMCCategoryFrequency, 0, 0xF},
+    {"CPU Package",             "CCPC", TYPE_UI32, TYPE_UI32_SIZE, kFakeSMCCategoryFrequency, 0, 0},
+    /*{"GPU Core",                "CG%XC", TYPE_UI32, TYPE_UI32_SIZE, kFakeSMCCategoryFrequency, 0, 4},
+    {"GPU Memory",              "CG%XM", TYPE_UI32, TYPE_UI32_SIZE, kFakeSMCCategoryFrequency, 0, 4},
+    {"GPU Shaders",             "CG%XS", TYPE_UI32, TYPE_UI32_SIZE, kFakeSMCCategoryFrequency, 0, 4},
+    {"GPU ROPs",                "CG%XR", TYPE_UI32, TYPE_UI32_SIZE, kFakeSMCCategoryFrequency, 0, 4},*/
+    
+    // Voltages
+    {"CPU Core",                "VC0C", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 0},
+    {"CPU GFX",                 "VC%XG", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 0xF},
+    {"CPU VTT",                 "VV1R", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 0},
+    {"PCH",                     "VN1R", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 0},
+    {"Memory",                  "VM0R", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 0},
+    {"MCH",                     "VN0C", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 0},
+    {"Main 3V",                 "VV2S", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 0},
+    {"Main 5V",                 "VV1S", "fp4c", 2, kFakeSMCCategoryVoltage, 0, 0},
+    {"Main 12V",                "VV9S", "fp4c", 2, kFakeSMCCategoryVoltage, 0, 0},
+    {"Auxiliary 3V",            "VV7S", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 0},
+    {"Standby 3V",              "VV3S", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 0},
+    {"Standby 5V",              "VV8S", "fp4c", 2, kFakeSMCCategoryVoltage, 0, 0},
+    {"PCIe 12V",                "VeES", "fp4c", 2, kFakeSMCCategoryVoltage, 0, 0},
+    {"+12V Rail",               "VP0R", "fp4c", 2, kFakeSMCCategoryVoltage, 0, 0},
+    {"12V Vcc",                 "Vp0C", "fp4c", 2, kFakeSMCCategoryVoltage, 0, 0},
+    {"Power Supply",            "Vp%XC", "fp4c", 2, kFakeSMCCategoryVoltage, 1, 0xE},
+    {"Mainboard S0 Rail",       "VD0R", "fp4c", 2, kFakeSMCCategoryVoltage, 0, 0},
+    {"Mainboard S5 Rail",       "VD5R", "fp4c", 2, kFakeSMCCategoryVoltage, 0, 0},
+    {"CMOS Battery",            "Vb0R", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 0},
+    {"Battery",                 "VBAT", "fp4c", 2, kFakeSMCCategoryVoltage, 0, 0},
+    {"CPU VRM",                 "VS%XC", "fp4c", 2, kFakeSMCCategoryVoltage, 0, 0xF},
+
+    /*{"GPU Core",                "VC%XG", "fp2e", 2, kFakeSMCCategoryVoltage, 0, 4},*/
+    
+    // Currents
+    {"CPU Core",                "IC0C", "sp78", 2, kFakeSMCCategoryCurrent, 0, 0},
+    {"CPU VccIO",               "IC1C", "sp5a", 2, kFakeSMCCategoryCurrent, 0, 0},
+    {"CPU VccSA",               "IC2C", "sp5a", 2, kFakeSMCCategoryCurrent, 0, 0},
+    {"CPU DRAM",                "IC5R", "sp4b", 2, kFakeSMCCategoryCurrent, 0, 0},
+    {"CPU PLL",                 "IC8R", "sp5a", 2, kFakeSMCCategoryCurrent, 0, 0},
+    {"CPU",                     "IC%XC", "sp78", 2, kFakeSMCCategoryCurrent, 0, 0xF},
+    {"CPU GFX",                 "IC0G", "sp5a", 2, kFakeSMCCategoryCurrent, 0, 0},
+    {"Memory Bank",             "IM%XS", "sp5a", 2, kFakeSMCCategoryCurrent, 0, 0xF},
+    {"MCH",                     "IN0C", "sp87", 2, kFakeSMCCategoryCurrent, 0, 0},
+    
+    /*{"GPU",                     "IG%XC", "sp78", 2, kFakeSMCCategoryCurrent, 0, 4},*/
+    
+//    [NSArray arrayWithObjects:@"IM0R",       @"Memory Rail", nil],
+//    [NSArray arrayWithObjects:@"IW0E",       @"Airport Rail", nil],
+//    [NSArray arrayWithObjects:@"IB0R",       @"Battery Rail", nil],
+//    [NSArray arrayWithObjects:@"Ie:081S",    @"PCIe Slot %X", nil],
+//    [NSArray arrayWithObjects:@"IM:A4AS",    @"PCIe Booster %X", nil],
+//    [NSArray arrayWithObjects:@"ID0R",       @"Mainboard S0 Rail", nil],
+//    [NSArray arrayWithObjects:@"ID5R",       @"Mainboard S5 Rail", nil],
+    
+    // Powers
+    {"CPU Core",                "PC%XC", "sp96", 2, kFakeSMCCategoryPower, 0, 0x8},
+    {"CPU",                     "PC%XC", "sp96", 2, kFakeSMCCategoryPower, 0xA, 6},
+    {"CPU GFX",                 "PC%XG", "sp96", 2, kFakeSMCCategoryPower, 0, 0x4},
+    {"CPU Package Cores",       "PCPC", "sp96", 2, kFakeSMCCategoryPower, 0, 0},
+    {"CPU Package Graphics",    "PCPG", "sp96", 2, kFakeSMCCategoryPower, 0, 0},
+    {"CPU Package Total",       "PCTR", "sp96", 2, kFakeSMCCategoryPower, 0, 0},
+    {"CPU Package DRAM",        "PCPD", "sp96", 2, kFakeSMCCategoryPower, 0, 0},
+//    [NSArray arrayWithObjects:@"PC1R",       @"CPU Rail", nil],
+//    [NSArray arrayWithObjects:@"PC5R",       @"CPU 1.5V S0 Rail", nil],
+//    [NSArray arrayWithObjects:@"PM0R",       @"Memory Rail", nil],
+//    [NSArray arrayWithObjects:@"PM:A4AS",    @"Memory Bank %X", nil],
+//    [NSArray arrayWithObjects:@"Pe:041S",    @"PCIe Slot %X", nil],
+//    [NSArray arrayWithObjects:@"Pe:A4AS",    @"PCIe Booster %X", nil],
+    
+    /*{"GPU",                     "PG%XC", "sp96", 2, kFakeSMCCategoryPower, 0, 4},*/
+    
+//    [NSArray arrayWithObjects:@"PG0R",       @"GPU Rail", nil],
+//    [NSArray arrayWithObjects:@"PG:132R",    @"GPU %X Rail", nil],
+//    [NSArray arrayWithObjects:@"PD0R",       @"Mainboard S0 Rail", nil],
+//    [NSArray arrayWithObjects:@"PD5R",       @"Mainboard S5 Rail", nil],
+//    [NSArray arrayWithObjects:@"Pp0C",       @"Power Supply 12V", nil],
+    {"System Total",            "PDTR", "sp96", 2, kFakeSMCCategoryPower, 0, 0},
+//    [NSArray arrayWithObjects:@"PZ:041G",    @"Zone %X Average", nil],
+    
+    {NULL, NULL, NULL, 0, kFakeSMCCategoryNone, 0, 0}
+};
+
+#endif // DEFINE_FAKESMC_SENSOR_PARAMS
+
+#define kFakeSMCSensorDefinitionsHashSize   256     // power of two, well above the number of definitions
+
+// Open addressing table of definition index + 1
+typedef struct {
+    UInt8               slots[kFakeSMCSensorDefinitionsHashSize];
+} FakeSMCSensorDefinitionsHash;
+
+/**
+ *  FNV-1a of the case folded name, seeded with the category
+ */
+static inline UInt32 fakeSMCSensorDefinitionHash(const char *name, FakeSMCSensorCategory category)
+{
+    UInt32 hash = 2166136261U ^ category;
+
+    for (; *name; name++) {
+        char c = *name;
+
+        hash = (hash ^ (UInt8)(c >= 'A' && c <= 'Z' ? c + ('a' - 'A') : c)) * 16777619U;
+    }
+
+    return hash;
+}
+
+/**
+ *  Hash definitions up to the terminating entry with no name
+ *
+ *  @return False if the table can't take all definitions
+ */
+static inline int fakeSMCSensorDefinitionsHashBuild(FakeSMCSensorDefinitionsHash *hash, const FakeSMCSensorDefinitionEntry *definitions)
+{
+    memset(hash, 0, sizeof(*hash));
+
+    for (int i = 0; definitions[i].name; i++) {
+        // Keep a free slot so lookups of missing names stop
+        if (i + 1 >= kFakeSMCSensorDefinitionsHashSize - 1)
+            return 0;
+
+        UInt32 slot = fakeSMCSensorDefinitionHash(definitions[i].name, definitions[i].category);
+
+        while (hash->slots[slot & (kFakeSMCSensorDefinitionsHashSize - 1)])
+            slot++;
+
+        hash->slots[slot & (kFakeSMCSensorDefinitionsHashSize - 1)] = (UInt8)(i + 1);
+    }
+
+    return 1;
+}
+
+/**
+ *  @return Index of the definition with the name in the category, case insensitive, -1 if none
+ */
+static inline int fakeSMCSensorDefinitionsHashLookup(const FakeSMCSensorDefinitionsHash *hash, const FakeSMCSensorDefinitionEntry *definitions, const char *name, FakeSMCSensorCategory category)
+{
+    for (UInt32 slot = fakeSMCSensorDefinitionHash(name, category); ; slot++) {
+        UInt8 entry = hash->slots[slot & (kFakeSMCSensorDefinitionsHashSize - 1)];
+
+        if (!entry)
+            return -1;
+
+        const FakeSMCSensorDefinitionEntry *definition = &definitions[entry - 1];
+
+        if (definition->category == category && 0 == strcasecmp(definition->name, name))
+            return entry - 1;
+    }
+}
+
+#endif
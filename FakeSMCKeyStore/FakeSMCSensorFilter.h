@@ -0,0 +1,99 @@
+//
+//  FakeSMCSensorFilter.h
+//  HWSensors
+//
+//  Filter stages of FakeSMCSensor values. Plain C with no IOKit dependencies, so the same code
+//  runs in the host tests (see Tests/)
+//
+
+#ifndef HWSensors_FakeSMCSensorFilter_h
+#define HWSensors_FakeSMCSensorFilter_h
+
+#define kFakeSMCSensorFilterMaxMedian   9
+#define kFakeSMCSensorFilterMaxSpikes   3   // a step lasting longer than this many samples is real
+
+typedef struct {
+    float               alpha;              // EMA weight of a new sample, 0 disables
+    float               spike;              // largest believable change between samples, 0 disables
+    UInt8               median;             // median window, 0 disables
+    UInt8               count;
+    UInt8               position;
+    UInt8               spikes;
+    UInt8               primed;
+    float               output;
+    float               window[kFakeSMCSensorFilterMaxMedian];
+} FakeSMCSensorFilter;
+
+/**
+ *  Set filter stages and forget previous samples
+ *
+ *  @param alpha  EMA weight of a new sample (0..1), 0 or 1 disables
+ *  @param median Median window size up to kFakeSMCSensorFilterMaxMedian, 0 or 1 disables
+ *  @param spike  Largest believable change between samples, 0 disables
+ */
+static inline void fakeSMCSensorFilterSet(FakeSMCSensorFilter *filter, float alpha, UInt8 median, float spike)
+{
+    filter->alpha = alpha > 0 && alpha < 1 ? alpha : 0;
+    filter->median = median > 1 ? (median > kFakeSMCSensorFilterMaxMedian ? kFakeSMCSensorFilterMaxMedian : median) : 0;
+    filter->spike = spike > 0 ? spike : 0;
+
+    filter->count = 0;
+    filter->position = 0;
+    filter->spikes = 0;
+    filter->primed = 0;
+}
+
+/**
+ *  Run a new sample through the stages, in order: spike rejection, median of last samples, exponential moving average
+ *
+ *  @return Filtered value
+ */
+static inline float fakeSMCSensorFilterApply(FakeSMCSensorFilter *filter, float value)
+{
+    if (!filter->alpha && !filter->median && !filter->spike)
+        return value;
+
+    if (filter->spike && filter->primed) {
+        float delta = value - filter->output;
+
+        if ((delta < 0 ? -delta : delta) > filter->spike && filter->spikes < kFakeSMCSensorFilterMaxSpikes) {
+            filter->spikes++;
+            return filter->output;
+        }
+    }
+
+    filter->spikes = 0;
+
+    if (filter->median) {
+        float sorted[kFakeSMCSensorFilterMaxMedian];
+
+        filter->window[filter->position] = value;
+        filter->position = (filter->position + 1) % filter->median;
+
+        if (filter->count < filter->median)
+            filter->count++;
+
+        // Insertion sort, the window is tiny
+        for (int i = 0; i < filter->count; i++) {
+            float item = filter->window[i];
+            int j = i - 1;
+
+            for (; j >= 0 && sorted[j] > item; j--)
+                sorted[j + 1] = sorted[j];
+
+            sorted[j + 1] = item;
+        }
+
+        value = sorted[filter->count / 2];
+    }
+
+    if (filter->alpha && filter->primed)
+        value = filter->output + filter->alpha * (value - filter->output);
+
+    filter->output = value;
+    filter->primed = 1;
+
+    return value;
+}
+
+#endif
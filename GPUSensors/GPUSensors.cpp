@@ -108,6 +108,11 @@ void GPUSensors::onTimeoutExceeded(IOService *provider)
     managedStart(provider);
 }
 
+bool GPUSensors::shouldWaitForKeyStore()
+{
+    return false;
+}
+
 bool GPUSensors::start(IOService *provider)
 {
     HWSensorsDebugLog("Starting...");
@@ -118,14 +123,16 @@ bool GPUSensors::start(IOService *provider)
         return false;
     }
     
-    if (!provider || !super::start(provider))
-        return false;
-    
     if (!(pciDevice = OSDynamicCast(IOPCIDevice, provider))) {
         HWSensorsFatalLog("no PCI device");
         return false;
     }
 
+    return super::start(provider);
+}
+
+bool GPUSensors::startWithKeyStore(IOService *provider)
+{
     if (!onStartUp(provider))
         return false;
 
@@ -28,6 +28,8 @@ protected:
     IOPCIDevice*            pciDevice;
     
     
+    virtual bool            shouldWaitForKeyStore();
+    virtual bool            startWithKeyStore(IOService *provider);
     virtual bool            shouldWaitForAccelerator();
     virtual bool            probIsAcceleratorAlreadyLoaded();
     virtual bool            onStartUp(IOService *provider);
@@ -215,6 +215,7 @@
 // NVRAM
 #define kFakeSMCFirmwareVendor                  "firmware-vendor"
 #define kFakeSMCKeyPropertyPrefix               "fakesmc-key"
+#define kFakeSMCDetectionProperty               "fakesmc-smc-verdict"
 
 //REVIEW_REHABMAN: temporarily to disable NVRAM key writing/loading
 #define NVRAMKEYS 1
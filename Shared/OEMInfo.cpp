@@ -161,40 +161,53 @@ static UInt8 checksum8( void * start, UInt length )
     return csum;
 }
 
+// SMBIOS vendor strings known to differ from the manufacturer name used in platform profiles
+static const struct {
+    const char  *oem;
+    const char  *manufacturer;
+} OEMManufacturerNames[] = {
+    {"Apple Inc.",                          "Apple"},
+    {"ASUSTeK Computer INC.",               "ASUS"},
+    {"ASUSTeK COMPUTER INC.",               "ASUS"},
+    {"Dell Inc.",                           "Dell"},
+    {"DFI",                                 "DFI"},
+    {"DFI Inc.",                            "DFI"},
+    {"EPoX COMPUTER CO., LTD",              "EPoX"},
+    {"First International Computer, Inc.",  "FIC"},
+    {"FUJITSU",                             "FUJITSU"},
+    {"FUJITSU SIEMENS",                     "FUJITSU"},
+    {"Gigabyte Technology Co., Ltd.",       "Gigabyte"},
+    {"Hewlett-Packard",                     "HP"},
+    {"IBM",                                 "IBM"},
+    {"Intel",                               "Intel"},
+    {"Intel Corp.",                         "Intel"},
+    {"Intel Corporation",                   "Intel"},
+    {"INTEL Corporation",                   "Intel"},
+    {"Lenovo",                              "Lenovo"},
+    {"LENOVO",                              "Lenovo"},
+    {"Micro-Star International",            "MSI"},
+    {"MICRO-STAR INTERNATIONAL CO., LTD",   "MSI"},
+    {"MICRO-STAR INTERNATIONAL CO.,LTD",    "MSI"},
+    {"MSI",                                 "MSI"},
+    {NULL, NULL}
+};
+
 OSString* getManufacturerNameFromOEMName(OSString *name)
 {
     if (!name) {
         return NULL;
     }
     
-    OSString *manufacturer = NULL;
-    
-    if (name->isEqualTo("Apple Inc.")) manufacturer = OSString::withCString("Apple");
-    if (name->isEqualTo("ASUSTeK Computer INC.") ||
-        name->isEqualTo("ASUSTeK COMPUTER INC.")) manufacturer = OSString::withCString("ASUS");
-    if (name->isEqualTo("Dell Inc.")) manufacturer = OSString::withCString("Dell");
-    if (name->isEqualTo("DFI") || name->isEqualTo("DFI Inc.")) manufacturer = OSString::withCString("DFI");
-    if (name->isEqualTo("EPoX COMPUTER CO., LTD")) manufacturer = OSString::withCString("EPoX");
-    if (name->isEqualTo("First International Computer, Inc.")) manufacturer = OSString::withCString("FIC");
-    if (name->isEqualTo("FUJITSU") ||
-        name->isEqualTo("FUJITSU SIEMENS")) manufacturer = OSString::withCString("FUJITSU");
-    if (name->isEqualTo("Gigabyte Technology Co., Ltd.")) manufacturer = OSString::withCString("Gigabyte");
-    if (name->isEqualTo("Hewlett-Packard")) manufacturer = OSString::withCString("HP");
-    if (name->isEqualTo("IBM")) manufacturer = OSString::withCString("IBM");
-    if (name->isEqualTo("Intel") ||
-        name->isEqualTo("Intel Corp.") ||
-        name->isEqualTo("Intel Corporation")||
-        name->isEqualTo("INTEL Corporation")) manufacturer = OSString::withCString("Intel");
-    if (name->isEqualTo("Lenovo") || name->isEqualTo("LENOVO")) manufacturer = OSString::withCString("Lenovo");
-    if (name->isEqualTo("Micro-Star International") ||
-        name->isEqualTo("MICRO-STAR INTERNATIONAL CO., LTD") ||
-        name->isEqualTo("MICRO-STAR INTERNATIONAL CO.,LTD") ||
-        name->isEqualTo("MSI")) manufacturer = OSString::withCString("MSI");
+    for (int i = 0; OEMManufacturerNames[i].oem; i++) {
+        // Compare lengths first, most entries are ruled out without touching the strings
+        if (name->getLength() == strlen(OEMManufacturerNames[i].oem) && name->isEqualTo(OEMManufacturerNames[i].oem))
+            return OSString::withCString(OEMManufacturerNames[i].manufacturer);
+    }
     
-    if (!manufacturer && !name->isEqualTo("To be filled by O.E.M."))
-        manufacturer = OSString::withString(name);
+    if (name->isEqualTo("To be filled by O.E.M."))
+        return NULL;
     
-    return manufacturer;
+    return OSString::withString(name);
 }
 
 static void processSMBIOSStructureType2(IOService *provider, const SMBBaseBoard *baseBoard, SMBPackedStrings *strings)
@@ -30,15 +30,36 @@ cc ./smc.c  -o smcutil -framework IOKit -framework CoreFoundation -Wno-four-char
 
 #include "smc.h"
 
-// Cache the keyInfo to lower the energy impact of SMCReadKey()
-#define KEY_INFO_CACHE_SIZE 100
-struct {
-	UInt32 key;
-	SMCKeyData_keyInfo_t keyInfo;
-} g_keyInfoCache[KEY_INFO_CACHE_SIZE];
+#include <stdlib.h>
 
-int g_keyInfoCacheCount = 0;
-OSSpinLock g_keyInfoSpinLock = 0;
+// Cache the keyInfo to lower the energy impact of SMCReadKey()
+// Entries are hashed by key, one per key and connection, and never freed, lookups take no locks.
+// An entry is valid only while its epoch matches the connection's types epoch (0 means the service
+// has no epoch, e.g. AppleSMC). A stale entry is rewritten in place, so epoch changes don't grow the
+// cache, and its sequence tells readers to retry while a rewrite is in progress.
+// SMCClose releases the connection's epoch slot and marks its entries free (conn 0) for reuse by
+// later connections, which may get the same port name. Connections opened while all epoch slots
+// are taken are not cached at all, their key info could never be invalidated
+#define KEY_INFO_CACHE_BUCKETS  256
+#define KEY_INFO_CACHE_CONNS    8
+
+typedef struct SMCKeyInfoCacheEntry {
+    struct SMCKeyInfoCacheEntry *next;
+    volatile int32_t sequence;      // odd while the entry is rewritten
+    io_connect_t conn;
+    UInt32 key;
+    UInt32 epoch;
+    SMCKeyData_keyInfo_t keyInfo;
+} SMCKeyInfoCacheEntry;
+
+static SMCKeyInfoCacheEntry * volatile g_keyInfoCache[KEY_INFO_CACHE_BUCKETS];
+
+static struct {
+    volatile int32_t conn;
+    volatile int32_t epoch;
+} g_keyInfoEpochs[KEY_INFO_CACHE_CONNS];
+
+static void SMCForgetConnection(io_connect_t conn);
 
 UInt32 _strtoul(const char *str, int size, int base)
 {
@@ -66,6 +87,11 @@ void _ultostr(char *str, UInt32 val)
 }
 
 kern_return_t SMCOpen(const char *serviceName, io_connect_t *conn)
+{
+    return SMCOpenWithType(serviceName, SMC_CONNECTION_INTERACTIVE, conn);
+}
+
+kern_return_t SMCOpenWithType(const char *serviceName, UInt32 type, io_connect_t *conn)
 {
     kern_return_t result;
     mach_port_t   masterPort;
@@ -90,7 +116,7 @@ kern_return_t SMCOpen(const char *serviceName, io_connect_t *conn)
         return 1;
     }
 
-    result = IOServiceOpen(device, mach_task_self(), 0, conn);
+    result = IOServiceOpen(device, mach_task_self(), type, conn);
     IOObjectRelease(device);
     if (result != kIOReturnSuccess)
     {
@@ -103,6 +129,8 @@ kern_return_t SMCOpen(const char *serviceName, io_connect_t *conn)
 
 kern_return_t SMCClose(io_connect_t conn)
 {
+    SMCForgetConnection(conn);
+
     return IOServiceClose(conn);
 }
 
@@ -124,55 +152,263 @@ kern_return_t SMCCall(io_connect_t conn, int index, SMCKeyData_t *inputStructure
 									 );
 }
 
-// Provides key info, using a cache to dramatically improve the energy impact of smcFanControl
-kern_return_t SMCGetKeyInfo(io_connect_t conn, UInt32 key, SMCKeyData_keyInfo_t* keyInfo)
+static UInt32 SMCKeyInfoCacheBucket(io_connect_t conn, UInt32 key)
+{
+    UInt32 hash = (key ^ conn) * 2654435761U;
+
+    return hash >> 24;
+}
+
+// Returns the epoch slot of a connection, probing the service for epoch support on first use.
+// NULL when all slots are taken, key info of the connection must not be cached then
+static volatile int32_t *SMCGetTypesEpochSlot(io_connect_t conn)
+{
+    SMCKeyData_t inputStructure;
+    SMCKeyData_t outputStructure;
+    int i;
+
+    for (i = 0; i < KEY_INFO_CACHE_CONNS; i++)
+    {
+        if (g_keyInfoEpochs[i].conn == (int32_t)conn)
+            return &g_keyInfoEpochs[i].epoch;
+
+        if (g_keyInfoEpochs[i].conn == 0 && OSAtomicCompareAndSwap32Barrier(0, (int32_t)conn, &g_keyInfoEpochs[i].conn))
+        {
+            memset(&inputStructure, 0, sizeof(inputStructure));
+            memset(&outputStructure, 0, sizeof(outputStructure));
+
+            inputStructure.data8 = SMC_CMD_READ_TYPES_EPOCH;
+
+            if (SMCCall(conn, KERNEL_INDEX_SMC, &inputStructure, &outputStructure) == kIOReturnSuccess && outputStructure.result == 0)
+                g_keyInfoEpochs[i].epoch = (int32_t)outputStructure.data32;
+
+            return &g_keyInfoEpochs[i].epoch;
+        }
+    }
+
+    return NULL;
+}
+
+static void SMCSetTypesEpoch(io_connect_t conn, UInt32 epoch)
+{
+    volatile int32_t *slot = SMCGetTypesEpochSlot(conn);
+
+    if (slot)
+        *slot = (int32_t)epoch;
+}
+
+static SMCKeyInfoCacheEntry *SMCFindKeyInfo(SMCKeyInfoCacheEntry *entry, io_connect_t conn, UInt32 key)
+{
+    for (; entry; entry = entry->next)
+        if (entry->key == key && entry->conn == conn)
+            return entry;
+
+    return NULL;
+}
+
+// Takes an entry freed by SMCClose, the caller fills it in and ends the rewrite
+static SMCKeyInfoCacheEntry *SMCClaimFreeKeyInfo(SMCKeyInfoCacheEntry *entry)
+{
+    int32_t sequence;
+
+    for (; entry; entry = entry->next)
+    {
+        sequence = entry->sequence;
+
+        if (entry->conn == 0 && !(sequence & 1) && OSAtomicCompareAndSwap32Barrier(sequence, sequence + 1, &entry->sequence))
+        {
+            if (entry->conn == 0)
+                return entry;
+
+            // Reused by another thread between the check and the claim
+            OSAtomicIncrement32Barrier(&entry->sequence);
+        }
+    }
+
+    return NULL;
+}
+
+// Frees the epoch slot and the cache entries of a closed connection
+static void SMCForgetConnection(io_connect_t conn)
+{
+    SMCKeyInfoCacheEntry *entry;
+    int32_t sequence;
+    int i;
+
+    for (i = 0; i < KEY_INFO_CACHE_BUCKETS; i++)
+    {
+        for (entry = g_keyInfoCache[i]; entry; entry = entry->next)
+        {
+            if (entry->conn != conn)
+                continue;
+
+            do {
+                while ((sequence = entry->sequence) & 1)
+                    ;
+            } while (!OSAtomicCompareAndSwap32Barrier(sequence, sequence + 1, &entry->sequence));
+
+            if (entry->conn == conn)
+                entry->conn = 0;
+
+            OSAtomicIncrement32Barrier(&entry->sequence);
+        }
+    }
+
+    for (i = 0; i < KEY_INFO_CACHE_CONNS; i++)
+    {
+        if (g_keyInfoEpochs[i].conn == (int32_t)conn)
+        {
+            g_keyInfoEpochs[i].epoch = 0;
+            OSAtomicCompareAndSwap32Barrier((int32_t)conn, 0, &g_keyInfoEpochs[i].conn);
+        }
+    }
+}
+
+static void SMCCacheKeyInfo(io_connect_t conn, UInt32 key, UInt32 epoch, const SMCKeyData_keyInfo_t *keyInfo)
+{
+    SMCKeyInfoCacheEntry * volatile *bucket = &g_keyInfoCache[SMCKeyInfoCacheBucket(conn, key)];
+    SMCKeyInfoCacheEntry *entry = NULL;
+    SMCKeyInfoCacheEntry *head;
+    SMCKeyInfoCacheEntry *found;
+    int32_t sequence;
+
+    do {
+        head = *bucket;
+
+        OSMemoryBarrier();
+
+        if ((found = SMCFindKeyInfo(head, conn, key)))
+        {
+            // Another thread inserted the key first or the entry went stale, rewrite it in place.
+            // A rewrite already in progress stores a value at least as fresh, leave it be
+            sequence = found->sequence;
+
+            if (!(sequence & 1) && OSAtomicCompareAndSwap32Barrier(sequence, sequence + 1, &found->sequence))
+            {
+                found->epoch = epoch;
+                found->keyInfo = *keyInfo;
+
+                OSAtomicIncrement32Barrier(&found->sequence);
+            }
+
+            free(entry);
+
+            return;
+        }
+
+        // Reuse an entry of a closed connection before growing the bucket
+        if (!entry && (found = SMCClaimFreeKeyInfo(head)))
+        {
+            found->key = key;
+            found->epoch = epoch;
+            found->keyInfo = *keyInfo;
+
+            OSMemoryBarrier();
+
+            found->conn = conn;
+
+            OSAtomicIncrement32Barrier(&found->sequence);
+
+            return;
+        }
+
+        if (!entry)
+        {
+            if (!(entry = malloc(sizeof(SMCKeyInfoCacheEntry))))
+                return;
+
+            entry->sequence = 0;
+            entry->conn = conn;
+            entry->key = key;
+            entry->epoch = epoch;
+            entry->keyInfo = *keyInfo;
+        }
+
+        entry->next = head;
+
+        // Bucket changed since it was searched, search again so the key is never inserted twice
+    } while (!OSAtomicCompareAndSwapPtrBarrier(head, entry, (void * volatile *)bucket));
+}
+
+static kern_return_t SMCGetKeyInfoWithEpoch(io_connect_t conn, UInt32 key, SMCKeyData_keyInfo_t* keyInfo, UInt32 *epoch)
 {
 	SMCKeyData_t inputStructure;
 	SMCKeyData_t outputStructure;
-	kern_return_t result = kIOReturnSuccess;
-	int i = 0;
+	SMCKeyInfoCacheEntry *entry;
+	SMCKeyData_keyInfo_t cached;
+	kern_return_t result;
+	volatile int32_t *slot = SMCGetTypesEpochSlot(conn);
+	UInt32 current = slot ? (UInt32)*slot : 0;
+	UInt32 cachedEpoch;
+	UInt32 cachedKey;
+	io_connect_t cachedConn;
+	int32_t sequence;
+
+	OSMemoryBarrier();
+
+	if (slot && (entry = SMCFindKeyInfo(g_keyInfoCache[SMCKeyInfoCacheBucket(conn, key)], conn, key)))
+	{
+		do {
+			while ((sequence = entry->sequence) & 1)
+				;
 
-	OSSpinLockLock(&g_keyInfoSpinLock);
+			OSMemoryBarrier();
 
-	for (; i < g_keyInfoCacheCount; ++i)
-	{
-		if (key == g_keyInfoCache[i].key)
+			cachedConn = entry->conn;
+			cachedKey = entry->key;
+			cachedEpoch = entry->epoch;
+			cached = entry->keyInfo;
+
+			OSMemoryBarrier();
+		} while (entry->sequence != sequence);
+
+		// The entry may have been freed and reused since it was found
+		if (cachedConn == conn && cachedKey == key && cachedEpoch == current)
 		{
-			*keyInfo = g_keyInfoCache[i].keyInfo;
-			break;
+			*keyInfo = cached;
+			*epoch = current;
+
+			return kIOReturnSuccess;
 		}
 	}
 
-	if (i == g_keyInfoCacheCount)
-	{
-		// Not in cache, must look it up.
-		memset(&inputStructure, 0, sizeof(inputStructure));
-		memset(&outputStructure, 0, sizeof(outputStructure));
+	// Not in cache or stale, must look it up.
+	memset(&inputStructure, 0, sizeof(inputStructure));
+	memset(&outputStructure, 0, sizeof(outputStructure));
 
-		inputStructure.key = key;
-		inputStructure.data8 = SMC_CMD_READ_KEYINFO;
+	inputStructure.key = key;
+	inputStructure.data8 = SMC_CMD_READ_KEYINFO;
 
-		result = SMCCall(conn, KERNEL_INDEX_SMC, &inputStructure, &outputStructure);
-		if (result == kIOReturnSuccess)
+	result = SMCCall(conn, KERNEL_INDEX_SMC, &inputStructure, &outputStructure);
+	if (result == kIOReturnSuccess)
+	{
+		*keyInfo = outputStructure.keyInfo;
+		*epoch = slot && current ? outputStructure.data32 : 0;
+
+		if (slot)
 		{
-			*keyInfo = outputStructure.keyInfo;
-			if (g_keyInfoCacheCount < KEY_INFO_CACHE_SIZE)
-			{
-				g_keyInfoCache[g_keyInfoCacheCount].key = key;
-				g_keyInfoCache[g_keyInfoCacheCount].keyInfo = outputStructure.keyInfo;
-				++g_keyInfoCacheCount;
-			}
+			if (*epoch != current)
+				*slot = (int32_t)*epoch;
+
+			SMCCacheKeyInfo(conn, key, *epoch, keyInfo);
 		}
 	}
 
-	OSSpinLockUnlock(&g_keyInfoSpinLock);
-
 	return result;
 }
 
+// Provides key info, using a cache to dramatically improve the energy impact of smcFanControl
+kern_return_t SMCGetKeyInfo(io_connect_t conn, UInt32 key, SMCKeyData_keyInfo_t* keyInfo)
+{
+	UInt32 epoch;
+
+	return SMCGetKeyInfoWithEpoch(conn, key, keyInfo, &epoch);
+}
+
 kern_return_t SMCReadKey(io_connect_t conn, const UInt32Char_t key, SMCVal_t *val)
 {
     kern_return_t result;
+    UInt32        epoch;
     SMCKeyData_t  inputStructure;
     SMCKeyData_t  outputStructure;
 
@@ -185,7 +421,7 @@ kern_return_t SMCReadKey(io_connect_t conn, const UInt32Char_t key, SMCVal_t *va
     //strcpy(val->key, key);
     memcpy(val->key, key, sizeof(val->key));
 
-    result = SMCGetKeyInfo(conn, inputStructure.key, &outputStructure.keyInfo);
+    result = SMCGetKeyInfoWithEpoch(conn, inputStructure.key, &outputStructure.keyInfo, &epoch);
     if (result != kIOReturnSuccess)
         return result;
 
@@ -198,6 +434,18 @@ kern_return_t SMCReadKey(io_connect_t conn, const UInt32Char_t key, SMCVal_t *va
     if (result != kIOReturnSuccess)
         return result;
 
+    // A key type or size changed since the info was cached, refresh it
+    if (epoch && outputStructure.data32 != epoch)
+    {
+        SMCSetTypesEpoch(conn, outputStructure.data32);
+
+        if (SMCGetKeyInfoWithEpoch(conn, inputStructure.key, &outputStructure.keyInfo, &epoch) == kIOReturnSuccess)
+        {
+            val->dataSize = outputStructure.keyInfo.dataSize;
+            _ultostr(val->dataType, outputStructure.keyInfo.dataType);
+        }
+    }
+
     memcpy(val->bytes, outputStructure.bytes, sizeof(outputStructure.bytes));
 
     return kIOReturnSuccess;
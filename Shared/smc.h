@@ -31,6 +31,10 @@
 
 #define KERNEL_INDEX_SMC      2
 
+// Connection types of FakeSMCKeyStore, see SMCOpenWithType
+#define SMC_CONNECTION_INTERACTIVE    0
+#define SMC_CONNECTION_BACKGROUND     1   // reads may be served cached values so they never delay interactive readers
+
 #define SMC_CMD_READ_BYTES    5
 #define SMC_CMD_WRITE_BYTES   6
 #define SMC_CMD_READ_INDEX    8
@@ -38,6 +42,35 @@
 #define SMC_CMD_READ_PLIMIT   11
 #define SMC_CMD_READ_VERS     12
 
+// FakeSMCKeyStore extensions
+#define SMC_CMD_READ_THRESHOLD    0x80
+#define SMC_CMD_WRITE_THRESHOLD   0x81
+#define SMC_CMD_READ_TYPES_EPOCH  0x82  // also returned in data32 of SMC_CMD_READ_KEYINFO and SMC_CMD_READ_BYTES replies
+
+// Memory type for IOConnectMapMemory, threshold events queue (IODataQueue)
+#define SMC_THRESHOLD_EVENTS_QUEUE  0
+
+#define SMC_THRESHOLD_HIGH        0x01
+#define SMC_THRESHOLD_LOW         0x02
+#define SMC_THRESHOLD_RATE        0x04
+
+#define SMC_THRESHOLD_EVENT_NORMAL          0
+#define SMC_THRESHOLD_EVENT_HIGH            1
+#define SMC_THRESHOLD_EVENT_LOW             2
+#define SMC_THRESHOLD_EVENT_RATE            3
+
+// Port protocol trace ring, mapped with clientMemoryForType
+#define SMC_TRACE_RING_MEMORY       1
+#define SMC_TRACE_RING_RECORDS      4096    // power of two
+
+#define SMC_TRACE_WRITE             0x01    // else read
+#define SMC_TRACE_ERROR             0x02    // error code pending, e.g. key not found
+
+// Sensor history rings, mapped with clientMemoryForType
+#define SMC_HISTORY_MEMORY          2
+#define SMC_HISTORY_RINGS           64
+#define SMC_HISTORY_SAMPLES         512     // power of two
+
 typedef struct {
     UInt8                 major;
     UInt8                 minor;
@@ -62,6 +95,65 @@ typedef struct {
 
 typedef UInt8             SMCBytes_t[32]; 
 
+// Passed in SMCKeyData_t.bytes with SMC_CMD_READ_THRESHOLD/SMC_CMD_WRITE_THRESHOLD
+typedef struct {
+    UInt32                flags;      // SMC_THRESHOLD_HIGH | SMC_THRESHOLD_LOW | SMC_THRESHOLD_RATE, 0 removes the rule
+    float                 high;
+    float                 low;
+    float                 hysteresis;
+    float                 rate;       // units per second
+} SMCKeyThreshold_t;
+
+typedef struct {
+    UInt32                key;
+    UInt32                event;      // SMC_THRESHOLD_EVENT_*
+    float                 value;
+    UInt64                timestamp;  // nanoseconds since boot
+} SMCThresholdEvent_t;
+
+typedef struct {
+    UInt64                timestamp;  // mach absolute time
+    UInt32                sequence;   // position in the ring plus one, written last, 0 while being written
+    UInt32                key;        // key latched by the transaction
+    UInt16                port;
+    UInt8                 value;      // byte read or written
+    UInt8                 flags;      // SMC_TRACE_*
+    UInt8                 cmd;
+    UInt8                 status;     // status after the access
+    UInt8                 pos;        // data position after the access
+    UInt8                 reserved;
+} SMCTraceRecord_t;
+
+typedef struct {
+    volatile UInt32       head;       // records ever written, next one goes to head % capacity
+    UInt32                capacity;
+    UInt32                recordSize;
+    UInt32                reserved;
+    SMCTraceRecord_t      records[SMC_TRACE_RING_RECORDS];
+} SMCTraceRing_t;
+
+typedef struct {
+    UInt64                timestamp;  // nanoseconds
+    float                 value;
+    UInt32                sequence;   // position in the ring plus one, written last, 0 while being written
+} SMCHistorySample_t;
+
+typedef struct {
+    UInt32                key;
+    volatile UInt32       head;       // samples ever written, next one goes to head % SMC_HISTORY_SAMPLES
+    UInt32                period;     // sampling period in milliseconds, 0 when sampled on demand
+    UInt32                reserved;
+    SMCHistorySample_t    samples[SMC_HISTORY_SAMPLES];
+} SMCHistoryRing_t;
+
+typedef struct {
+    UInt32                capacity;   // rings
+    volatile UInt32       count;      // rings taken
+    UInt32                samples;    // samples per ring
+    UInt32                sampleSize;
+    SMCHistoryRing_t      rings[SMC_HISTORY_RINGS];
+} SMCHistoryBuffer_t;
+
 typedef struct {
   UInt32                  key; 
   SMCKeyData_vers_t       vers; 
@@ -87,10 +179,62 @@ UInt32 _strtoul(const char *str, int size, int base);
 void _ultostr(char *str, UInt32 val);
 
 kern_return_t SMCOpen(const char *serviceName, io_connect_t *conn);
+kern_return_t SMCOpenWithType(const char *serviceName, UInt32 type, io_connect_t *conn);
 kern_return_t SMCClose(io_connect_t conn);
 kern_return_t SMCCall(io_connect_t conn, int index, SMCKeyData_t *inputStructure, SMCKeyData_t *outputStructure);
 kern_return_t SMCReadKey(io_connect_t conn, const UInt32Char_t key, SMCVal_t *val);
 kern_return_t SMCWriteKey(io_connect_t conn, const SMCVal_t *val);
 kern_return_t SMCWriteKeyUnsafe(io_connect_t conn, const SMCVal_t *val);
 
+#define SMC_RING_COPY_RETRIES 64
+
+// Copy a trace record while the kernel keeps writing the ring. The sequence is read before and
+// after the copy, the copy is good only if both match the position. Returns 0 if the record was
+// overwritten by a later lap or kept changing under the reader
+static inline int SMCCopyTraceRecord(const SMCTraceRing_t *ring, UInt32 position, SMCTraceRecord_t *record)
+{
+    const SMCTraceRecord_t *slot = &ring->records[position & (ring->capacity - 1)];
+
+    for (int retry = 0; retry < SMC_RING_COPY_RETRIES; retry++) {
+        UInt32 begin = *(const volatile UInt32 *)&slot->sequence;
+        __sync_synchronize();
+        *record = *slot;
+        __sync_synchronize();
+        UInt32 end = *(const volatile UInt32 *)&slot->sequence;
+
+        if (begin == end && begin == position + 1)
+            return 1;
+
+        // A later lap took the slot, the record is gone
+        if (begin && (SInt32)(begin - (position + 1)) > 0)
+            return 0;
+
+        // Being written, or the writer has not reached the slot yet
+    }
+
+    return 0;
+}
+
+// Same as SMCCopyTraceRecord for a sample of a history ring with the given number of samples
+static inline int SMCCopyHistorySample(const SMCHistoryRing_t *ring, UInt32 samples, UInt32 position, SMCHistorySample_t *sample)
+{
+    const SMCHistorySample_t *slot = &ring->samples[position & (samples - 1)];
+
+    for (int retry = 0; retry < SMC_RING_COPY_RETRIES; retry++) {
+        UInt32 begin = *(const volatile UInt32 *)&slot->sequence;
+        __sync_synchronize();
+        *sample = *slot;
+        __sync_synchronize();
+        UInt32 end = *(const volatile UInt32 *)&slot->sequence;
+
+        if (begin == end && begin == position + 1)
+            return 1;
+
+        if (begin && (SInt32)(begin - (position + 1)) > 0)
+            return 0;
+    }
+
+    return 0;
+}
+
 #endif
\ No newline at end of file
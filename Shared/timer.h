@@ -31,4 +31,20 @@ inline double ptimer_read_seconds()
     return (double)secs + (double)microsecs / (double)USEC_PER_SEC;
 }
 
+// Monotonic clock, does not jump when the date is set. Use it for intervals and deadlines
+inline UInt64 ptimer_uptime()
+{
+    UInt64 uptime, nanosecs;
+
+    clock_get_uptime(&uptime);
+    absolutetime_to_nanoseconds(uptime, &nanosecs);
+
+    return nanosecs;
+}
+
+inline double ptimer_uptime_seconds()
+{
+    return (double)ptimer_uptime() / (double)NSEC_PER_SEC;
+}
+
 #endif
@@ -55,6 +55,8 @@ OSDefineMetaClassAndStructors(F718xxSensors, LPCSensors)
 
 UInt8 F718xxSensors::readByte(UInt8 reg) 
 {
+    accountHardwareAccess(kFakeSMCPortAccess, 2);
+
 	outb(address + FINTEK_ADDRESS_REGISTER_OFFSET, reg);
 	return inb(address + FINTEK_DATA_REGISTER_OFFSET);
 } 
@@ -64,12 +64,16 @@ OSDefineMetaClassAndStructors(IT87xxSensors, LPCSensors)
 
 UInt8 IT87xxSensors::readByte(UInt8 reg)
 {
+    accountHardwareAccess(kFakeSMCPortAccess, 2);
+
 	outb(address + ITE_ADDRESS_REGISTER_OFFSET, reg);
 	return inb(address + ITE_DATA_REGISTER_OFFSET);
 }
 
 void IT87xxSensors::writeByte(UInt8 reg, UInt8 value)
 {
+    accountHardwareAccess(kFakeSMCPortAccess, 2);
+
 	outb(address + ITE_ADDRESS_REGISTER_OFFSET, reg);
 	outb(address + ITE_DATA_REGISTER_OFFSET, value);
 }
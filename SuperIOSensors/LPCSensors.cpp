@@ -479,11 +479,13 @@ bool LPCSensors::init(OSDictionary *properties)
 	return true;
 }
 
-bool LPCSensors::start(IOService *provider)
+bool LPCSensors::shouldWaitForKeyStore()
 {
-	if (!super::start(provider))
-        return false;
+    return false;
+}
 
+bool LPCSensors::start(IOService *provider)
+{
     OSNumber *number = OSDynamicCast(OSNumber, provider->getProperty(kSuperIOHWMAddress));
 
     if (!number || !(address = number->unsigned16BitValue())) {
@@ -519,6 +521,11 @@ bool LPCSensors::start(IOService *provider)
         return false;
     }
 
+    return super::start(provider);
+}
+
+bool LPCSensors::startWithKeyStore(IOService *provider)
+{
     if (!initialize())
         return false;
 
@@ -601,8 +608,11 @@ void LPCSensors::stop(IOService *provider)
 {
     PMstop();
 
-    timerEventSource->cancelTimeout();
-    workloop->removeEventSource(timerEventSource);
+    // Not created if the key store never showed up
+    if (timerEventSource) {
+        timerEventSource->cancelTimeout();
+        workloop->removeEventSource(timerEventSource);
+    }
     
     if (gpuIndex >= 0)
         releaseGPUIndex(gpuIndex);
@@ -102,6 +102,8 @@ protected:
     virtual void			writeTachometerControl(UInt32 index, UInt8 percent);
     virtual void			disableTachometerControl(UInt32 index);
     
+    virtual bool            shouldWaitForKeyStore();
+    virtual bool            startWithKeyStore(IOService *provider);
     virtual bool            willReadSensorValue(FakeSMCSensor *sensor, float *outValue);
     virtual bool            didWriteSensorValue(FakeSMCSensor *sensor, float value);
     
@@ -54,6 +54,8 @@ OSDefineMetaClassAndStructors(NCT677xSensors, LPCSensors)
 
 UInt8 NCT677xSensors::readByte(UInt16 reg) 
 {
+    accountHardwareAccess(kFakeSMCPortAccess, 4);
+
     UInt8 bank = reg >> 8;
     UInt8 regi = reg & 0xFF;
     
@@ -66,6 +68,8 @@ UInt8 NCT677xSensors::readByte(UInt16 reg)
 
 void NCT677xSensors::writeByte(UInt16 reg, UInt8 value)
 {
+    accountHardwareAccess(kFakeSMCPortAccess, 4);
+
 	UInt8 bank = reg >> 8;
     UInt8 regi = reg & 0xFF;
     
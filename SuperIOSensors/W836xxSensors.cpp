@@ -55,6 +55,8 @@ OSDefineMetaClassAndStructors(W836xxSensors, LPCSensors)
 
 UInt8 W836xxSensors::readByte(UInt16 reg) 
 {
+    accountHardwareAccess(kFakeSMCPortAccess, 4);
+
     UInt8 bank = reg >> 8;
     UInt8 regi = reg & 0xFF;
     
@@ -66,6 +68,8 @@ UInt8 W836xxSensors::readByte(UInt16 reg)
 
 void W836xxSensors::writeByte(UInt16 reg, UInt8 value)
 {
+    accountHardwareAccess(kFakeSMCPortAccess, 4);
+
     UInt8 bank = reg >> 8;
     UInt8 regi = reg & 0xFF;
     
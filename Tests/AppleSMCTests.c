@@ -0,0 +1,806 @@
+//
+//  AppleSMCTests.c
+//  HWSensors
+//
+//  AppleSMCProtocol.h against a simulated key store: a client driving the ports the way the
+//  AppleSMC and Linux applesmc drivers do, a fuzzer feeding arbitrary port sequences and a
+//  throughput benchmark
+//
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "HostTest.h"
+#include "AppleSMCProtocol.h"
+
+#define STORE_KEYS      64
+#define FUZZ_STEPS      2000000
+#define BENCH_READS     1000000
+#define STATUS_POLLS    64
+#define CONTEXT_TIMEOUT 100000  // simNow units
+#define INTERLEAVED_STEPS   400000
+#define THREAD_TRANSACTIONS 20000
+
+typedef struct {
+    char                name[5];
+    char                type[5];
+    UInt8               size;
+    UInt8               value[APPLESMC_MAX_DATA_LENGTH];
+} SimKey;
+
+typedef struct {
+    SimKey              keys[STORE_KEYS];
+    UInt32              count;
+    UInt32              writes;
+    UInt8               lastWriteSize;
+    UInt32              backgroundReads;
+    UInt32              interactiveReads;
+} SimStore;
+
+static SimStore store;
+static AppleSMCPort port;
+static UInt64 simNow;                   // clock of the port, moved by the tests
+
+static void *simGetKey(void *context, const char *name)
+{
+    SimStore *sim = context;
+
+    for (UInt32 i = 0; i < sim->count; i++)
+        if (!memcmp(sim->keys[i].name, name, 4))
+            return &sim->keys[i];
+
+    return NULL;
+}
+
+static void *simGetKeyByIndex(void *context, UInt32 index)
+{
+    SimStore *sim = context;
+
+    return index < sim->count ? &sim->keys[index] : NULL;
+}
+
+static const char *simGetKeyName(void *context, void *key)
+{
+    return ((SimKey *)key)->name;
+}
+
+static const char *simGetKeyType(void *context, void *key)
+{
+    return ((SimKey *)key)->type;
+}
+
+static UInt8 simGetKeySize(void *context, void *key)
+{
+    return ((SimKey *)key)->size;
+}
+
+static UInt8 simCopyKeyValue(void *context, void *key, void *value, int background)
+{
+    SimStore *sim = context;
+    SimKey *simKey = key;
+
+    __sync_fetch_and_add(background ? &sim->backgroundReads : &sim->interactiveReads, 1);
+
+    memcpy(value, simKey->value, simKey->size);
+
+    return simKey->size;
+}
+
+static SimKey *simAddKey(SimStore *sim, const char *name, const char *type, UInt8 size, const void *value)
+{
+    SimKey *key = simGetKey(sim, name);
+
+    if (!key) {
+        if (sim->count == STORE_KEYS)
+            return NULL;
+
+        key = &sim->keys[sim->count++];
+
+        memcpy(key->name, name, 4);
+        snprintf(key->type, 5, "%s", type ? type : "");
+    }
+
+    // Like FakeSMCKeyStore::addKeyWithValue, the size stays fixed once the key exists
+    if (!key->size)
+        key->size = size > APPLESMC_MAX_DATA_LENGTH ? APPLESMC_MAX_DATA_LENGTH : size;
+
+    memcpy(key->value, value, size < key->size ? size : key->size);
+
+    return key;
+}
+
+static void simWriteKey(void *context, const char *name, UInt8 size, const void *value)
+{
+    SimStore *sim = context;
+
+    __sync_fetch_and_add(&sim->writes, 1);
+    sim->lastWriteSize = size;
+    simAddKey(sim, name, NULL, size, value);
+}
+
+static const AppleSMCKeyStoreOps simOps = {
+    simGetKey,
+    simGetKeyByIndex,
+    simGetKeyName,
+    simGetKeyType,
+    simGetKeySize,
+    simCopyKeyValue,
+    simWriteKey,
+};
+
+static void initStore(UInt64 busyInterval)
+{
+    static const UInt8 fan[2] = { 0x1f, 0x40 }, temp[2] = { 0x2a, 0x80 }, count[1] = { 2 };
+    char name[5];
+
+    memset(&store, 0, sizeof(store));
+
+    simAddKey(&store, "#KEY", "ui32", 4, "\0\0\0\0");
+    simAddKey(&store, "FNum", "ui8 ", 1, count);
+    simAddKey(&store, "F0Ac", "fpe2", 2, fan);
+    simAddKey(&store, "TC0P", "sp78", 2, temp);
+
+    for (int i = store.count; i < STORE_KEYS / 2; i++) {
+        UInt8 value[8];
+
+        snprintf(name, sizeof(name), "T%03u", (unsigned int)i % 1000);
+        memset(value, i, sizeof(value));
+        simAddKey(&store, name, "ui64", 8, value);
+    }
+
+    applesmc_port_init(&port, &simOps, &store, busyInterval, CONTEXT_TIMEOUT);
+    simNow = 1000;
+}
+
+static UInt8 portRead(void *thread, UInt16 address)
+{
+    return applesmc_port_read(&port, address, thread, simNow, NULL);
+}
+
+static void portWrite(void *thread, UInt16 address, UInt8 value)
+{
+    applesmc_port_write(&port, address, value, thread, simNow, NULL);
+}
+
+// Wait for the input buffer, advancing the clock like a polling driver would
+static int waitInputBuffer(void *thread)
+{
+    for (int poll = 0; poll < STATUS_POLLS; poll++) {
+        if (!(portRead(thread, APPLESMC_CMD_PORT) & APPLESMC_STATUS_IB_CLOSED))
+            return 1;
+
+        simNow++;
+    }
+
+    return 0;
+}
+
+static int sendByte(void *thread, UInt16 address, UInt8 value)
+{
+    if (!waitInputBuffer(thread))
+        return 0;
+
+    portWrite(thread, address, value);
+
+    // Byte accepted
+    return (portRead(thread, APPLESMC_CMD_PORT) & 0x04) != 0;
+}
+
+static int sendKey(void *thread, UInt8 cmd, const char *key)
+{
+    if (!sendByte(thread, APPLESMC_CMD_PORT, cmd))
+        return 0;
+
+    for (int i = 0; i < 4; i++)
+        if (!sendByte(thread, APPLESMC_DATA_PORT, key[i]))
+            return 0;
+
+    return 1;
+}
+
+static int receive(void *thread, UInt8 *buffer, int length)
+{
+    for (int i = 0; i < length; i++) {
+        // Data ready
+        if (!(portRead(thread, APPLESMC_CMD_PORT) & 0x01))
+            return 0;
+
+        buffer[i] = portRead(thread, APPLESMC_DATA_PORT);
+    }
+
+    return 1;
+}
+
+static int smcReadKey(void *thread, const char *key, UInt8 *value, UInt8 length)
+{
+    if (!sendKey(thread, APPLESMC_READ_CMD, key) || !waitInputBuffer(thread))
+        return 0;
+
+    portWrite(thread, APPLESMC_DATA_PORT, length);
+
+    if (portRead(thread, APPLESMC_ERROR_CODE_PORT))
+        return 0;
+
+    return receive(thread, value, length);
+}
+
+static int smcWriteKey(void *thread, const char *key, const UInt8 *value, UInt8 length)
+{
+    if (!sendKey(thread, APPLESMC_WRITE_CMD, key) || !sendByte(thread, APPLESMC_DATA_PORT, length))
+        return 0;
+
+    for (int i = 0; i < length; i++) {
+        if (!waitInputBuffer(thread))
+            return 0;
+
+        portWrite(thread, APPLESMC_DATA_PORT, value[i]);
+    }
+
+    return (portRead(thread, APPLESMC_CMD_PORT) & 0x0f) == 0;
+}
+
+static int smcKeyInfo(void *thread, const char *key, UInt8 *info)
+{
+    if (!sendKey(thread, APPLESMC_GET_KEY_TYPE_CMD, key) || portRead(thread, APPLESMC_ERROR_CODE_PORT))
+        return 0;
+
+    return receive(thread, info, 6);
+}
+
+static int smcKeyByIndex(void *thread, UInt32 index, char *key)
+{
+    if (!sendByte(thread, APPLESMC_CMD_PORT, APPLESMC_GET_KEY_BY_INDEX_CMD))
+        return 0;
+
+    for (int i = 0; i < 4; i++)
+        if (!sendByte(thread, APPLESMC_DATA_PORT, (UInt8)(index >> (24 - i * 8))))
+            return 0;
+
+    if (portRead(thread, APPLESMC_ERROR_CODE_PORT))
+        return 0;
+
+    key[4] = '\0';
+
+    return receive(thread, (UInt8 *)key, 4);
+}
+
+static void *const client = (void *)0x1000;
+
+static void testReadKey(void)
+{
+    UInt8 value[8];
+
+    initStore(0);
+
+    CHECK(smcReadKey(client, "F0Ac", value, 2));
+    CHECK(value[0] == 0x1f && value[1] == 0x40);
+
+    CHECK(smcReadKey(client, "T010", value, 8));
+    CHECK(value[0] == 10 && value[7] == 10);
+
+    // Transaction over, nothing left to read
+    CHECK((portRead(client, APPLESMC_CMD_PORT) & 0x0f) == 0);
+}
+
+static void testMissingKey(void)
+{
+    UInt8 value[2];
+
+    initStore(0);
+
+    CHECK(sendKey(client, APPLESMC_READ_CMD, "XXXX"));
+    portWrite(client, APPLESMC_DATA_PORT, 2);
+    CHECK(portRead(client, APPLESMC_ERROR_CODE_PORT) == 0x84);
+
+    // Error is reported once, the next transaction works
+    CHECK(portRead(client, APPLESMC_ERROR_CODE_PORT) == 0);
+    CHECK(smcReadKey(client, "TC0P", value, 2));
+    CHECK(value[0] == 0x2a);
+}
+
+static void testWriteKey(void)
+{
+    const UInt8 speed[2] = { 0x12, 0x34 };
+    UInt8 value[2];
+
+    initStore(0);
+
+    CHECK(smcWriteKey(client, "F0Ac", speed, 2));
+    CHECK(store.writes == 1);
+    CHECK(smcReadKey(client, "F0Ac", value, 2));
+    CHECK(value[0] == 0x12 && value[1] == 0x34);
+
+    // Unknown keys are added
+    CHECK(smcWriteKey(client, "NEW0", speed, 2));
+    CHECK(simGetKey(&store, "NEW0") != NULL);
+}
+
+static void testOversizedWrite(void)
+{
+    UInt8 value[40], check[2];
+
+    initStore(0);
+
+    for (int i = 0; i < (int)sizeof(value); i++)
+        value[i] = (UInt8)(0x40 + i);
+
+    // The whole length is taken from the port, the store gets no more than a key can hold
+    CHECK(smcWriteKey(client, "F0Ac", value, sizeof(value)));
+    CHECK(store.writes == 1);
+    CHECK(store.lastWriteSize == APPLESMC_MAX_DATA_LENGTH);
+    CHECK(smcReadKey(client, "F0Ac", check, 2));
+    CHECK(check[0] == 0x40 && check[1] == 0x41);
+}
+
+static void testKeyInfoAndIndex(void)
+{
+    UInt8 info[6];
+    char key[5];
+
+    initStore(0);
+
+    CHECK(smcKeyInfo(client, "TC0P", info));
+    CHECK(info[0] == 2 && !memcmp(&info[1], "sp78", 4) && info[5] == 0);
+
+    CHECK(smcKeyByIndex(client, 2, key));
+    CHECK(!strcmp(key, "F0Ac"));
+
+    CHECK(!smcKeyByIndex(client, STORE_KEYS * 2, key));
+}
+
+static void testZeroLength(void)
+{
+    initStore(0);
+
+    // Zero length read and write complete at once instead of leaving data pending
+    CHECK(sendKey(client, APPLESMC_READ_CMD, "TC0P"));
+    portWrite(client, APPLESMC_DATA_PORT, 0);
+    CHECK((portRead(client, APPLESMC_CMD_PORT) & 0x0f) == 0);
+
+    CHECK(sendKey(client, APPLESMC_WRITE_CMD, "TC0P"));
+    portWrite(client, APPLESMC_DATA_PORT, 0);
+    CHECK((portRead(client, APPLESMC_CMD_PORT) & 0x0f) == 0);
+    CHECK(store.writes == 0);
+}
+
+static void testStaleLength(void)
+{
+    UInt8 value[2];
+
+    initStore(0);
+
+    // Read abandoned with a long length pending, then a key info command read before its key is sent
+    CHECK(sendKey(client, APPLESMC_READ_CMD, "TC0P"));
+    portWrite(client, APPLESMC_DATA_PORT, 200);
+    CHECK(sendByte(client, APPLESMC_CMD_PORT, APPLESMC_GET_KEY_TYPE_CMD));
+
+    for (int i = 0; i < 8; i++)
+        CHECK(portRead(client, APPLESMC_DATA_PORT) == 0);
+
+    CHECK(port.contexts[0].data_pos == 0);
+    CHECK(smcReadKey(client, "TC0P", value, 2));
+}
+
+static void testReadRange(void)
+{
+    UInt8 buffer[255] = { 0 };
+    UInt32 length = 1;
+
+    initStore(0);
+
+    CHECK(sendByte(client, APPLESMC_CMD_PORT, APPLESMC_READ_RANGE_CMD));
+
+    for (int i = 0; i < 4; i++)
+        CHECK(sendByte(client, APPLESMC_DATA_PORT, (UInt8)(1 >> (24 - i * 8))));
+
+    portWrite(client, APPLESMC_DATA_PORT, 3);
+    CHECK(receive(client, buffer, 1));
+    CHECK(buffer[0] == 3);
+
+    for (int i = 0; i < buffer[0]; i++) {
+        CHECK(receive(client, &buffer[length], 5));
+        CHECK(receive(client, &buffer[length + 5], buffer[length + 4]));
+        length += 5 + buffer[length + 4];
+    }
+
+    CHECK(!memcmp(&buffer[1], "FNum", 4) && buffer[5] == 1 && buffer[6] == 2);
+    CHECK(!memcmp(&buffer[7], "F0Ac", 4) && buffer[11] == 2);
+    CHECK(!memcmp(&buffer[14], "TC0P", 4));
+    CHECK((portRead(client, APPLESMC_CMD_PORT) & 0x0f) == 0);
+
+    // Range reads are bulk enumeration, they read at background priority
+    CHECK(store.backgroundReads == 3 && store.interactiveReads == 0);
+
+    CHECK(smcReadKey(client, "TC0P", buffer, 2));
+    CHECK(store.interactiveReads == 1);
+}
+
+static void testBusyDeadline(void)
+{
+    UInt8 value[2];
+
+    initStore(10);
+
+    // Each written byte keeps the input buffer closed for the busy interval, then it opens by itself
+    portWrite(client, APPLESMC_CMD_PORT, APPLESMC_READ_CMD);
+    CHECK(portRead(client, APPLESMC_CMD_PORT) == (0x0c | APPLESMC_STATUS_IB_CLOSED));
+
+    simNow += 9;
+    CHECK(portRead(client, APPLESMC_CMD_PORT) & APPLESMC_STATUS_IB_CLOSED);
+
+    simNow += 1;
+    CHECK(portRead(client, APPLESMC_CMD_PORT) == 0x0c);
+
+    // Reads don't extend the deadline
+    portWrite(client, APPLESMC_DATA_PORT, 'T');
+    simNow += 10;
+    portRead(client, APPLESMC_DATA_PORT);
+    CHECK(!(portRead(client, APPLESMC_CMD_PORT) & APPLESMC_STATUS_IB_CLOSED));
+
+    // A client polling status completes a transaction, the clock shows it waited for every byte
+    UInt64 started = simNow;
+
+    CHECK(smcReadKey(client, "TC0P", value, 2));
+    CHECK(value[0] == 0x2a);
+    CHECK(simNow - started >= 5 * 10);
+
+    // Without the model the port is never busy
+    initStore(0);
+    portWrite(client, APPLESMC_CMD_PORT, APPLESMC_READ_CMD);
+    CHECK(portRead(client, APPLESMC_CMD_PORT) == 0x0c);
+}
+
+static const UInt8 statuses[] = { 0x00, 0x04, 0x05, 0x0c };
+
+static int validStatus(UInt8 status)
+{
+    for (int i = 0; i < sizeof(statuses); i++)
+        if ((status & ~APPLESMC_STATUS_IB_CLOSED) == statuses[i])
+            return 1;
+
+    return 0;
+}
+
+// One transaction split into single port accesses, so a scheduler can interleave clients at any point
+enum { OP_WRITE, OP_READ, OP_ACCEPTED, OP_ERROR };
+
+typedef struct {
+    UInt8               type;
+    UInt16              address;
+    UInt8               value;
+} PortOp;
+
+typedef struct {
+    void                *thread;
+    char                own[5];             // key only this client writes
+    UInt8               written[2];         // last value it wrote there
+    PortOp              ops[16];
+    int                 count;
+    int                 next;
+    int                 kind;
+    char                key[5];
+    UInt8               result[8];
+    int                 received;
+    int                 completed;
+    int                 restarted;
+    int                 wrong;
+} InterleavedClient;
+
+static void addOp(InterleavedClient *c, UInt8 type, UInt16 address, UInt8 value)
+{
+    c->ops[c->count++] = (PortOp){ type, address, value };
+}
+
+static void startTransaction(InterleavedClient *c, unsigned int *seed)
+{
+    static const char *shared[] = { "F0Ac", "TC0P", "T010", "T020" };
+
+    c->count = c->next = c->received = 0;
+    c->kind = rand_r(seed) % 4;
+
+    switch (c->kind) {
+        case 0: // read of a shared key
+        case 3: // read of a missing key, ends with the error code
+            memcpy(c->key, c->kind ? "XXXX" : shared[rand_r(seed) % 4], 5);
+            addOp(c, OP_WRITE, APPLESMC_CMD_PORT, APPLESMC_READ_CMD);
+            addOp(c, OP_ACCEPTED, APPLESMC_CMD_PORT, 0);
+            for (int i = 0; i < 4; i++)
+                addOp(c, OP_WRITE, APPLESMC_DATA_PORT, c->key[i]);
+            addOp(c, OP_WRITE, APPLESMC_DATA_PORT, 2);
+            if (c->kind == 3)
+                addOp(c, OP_ERROR, APPLESMC_ERROR_CODE_PORT, 0x84);
+            else
+                for (int i = 0; i < 2; i++)
+                    addOp(c, OP_READ, APPLESMC_DATA_PORT, 0);
+            break;
+
+        case 1: // write of the own key
+            memcpy(c->key, c->own, 5);
+            c->written[0] = (UInt8)rand_r(seed);
+            c->written[1] = (UInt8)rand_r(seed);
+            addOp(c, OP_WRITE, APPLESMC_CMD_PORT, APPLESMC_WRITE_CMD);
+            addOp(c, OP_ACCEPTED, APPLESMC_CMD_PORT, 0);
+            for (int i = 0; i < 4; i++)
+                addOp(c, OP_WRITE, APPLESMC_DATA_PORT, c->key[i]);
+            addOp(c, OP_WRITE, APPLESMC_DATA_PORT, 2);
+            addOp(c, OP_WRITE, APPLESMC_DATA_PORT, c->written[0]);
+            addOp(c, OP_WRITE, APPLESMC_DATA_PORT, c->written[1]);
+            break;
+
+        case 2: // key info of the own key
+            memcpy(c->key, c->own, 5);
+            addOp(c, OP_WRITE, APPLESMC_CMD_PORT, APPLESMC_GET_KEY_TYPE_CMD);
+            addOp(c, OP_ACCEPTED, APPLESMC_CMD_PORT, 0);
+            for (int i = 0; i < 4; i++)
+                addOp(c, OP_WRITE, APPLESMC_DATA_PORT, c->key[i]);
+            for (int i = 0; i < 6; i++)
+                addOp(c, OP_READ, APPLESMC_DATA_PORT, 0);
+            break;
+    }
+}
+
+static void finishTransaction(InterleavedClient *c)
+{
+    SimKey *key = simGetKey(&store, c->key);
+
+    switch (c->kind) {
+        case 0:
+            if (memcmp(c->result, key->value, 2))
+                c->wrong++;
+            break;
+
+        case 1:
+            if (memcmp(key->value, c->written, 2))
+                c->wrong++;
+            break;
+
+        case 2:
+            if (c->result[0] != 2 || memcmp(&c->result[1], "ui16", 4))
+                c->wrong++;
+            break;
+    }
+
+    c->completed++;
+}
+
+static void stepClient(InterleavedClient *c, unsigned int *seed)
+{
+    PortOp *op = &c->ops[c->next++];
+
+    switch (op->type) {
+        case OP_WRITE:
+            portWrite(c->thread, op->address, op->value);
+            break;
+
+        case OP_READ:
+            c->result[c->received++] = portRead(c->thread, op->address);
+            break;
+
+        case OP_ACCEPTED:
+            // Refused while every context runs a transaction, try again later like a driver would
+            if ((portRead(c->thread, APPLESMC_CMD_PORT) & 0x0c) != 0x0c) {
+                c->restarted++;
+                c->next = 0;
+                return;
+            }
+            break;
+
+        case OP_ERROR:
+            if (portRead(c->thread, op->address) != op->value)
+                c->wrong++;
+            break;
+    }
+
+    if (c->next == c->count) {
+        finishTransaction(c);
+        startTransaction(c, seed);
+    }
+}
+
+static void runInterleaved(int clients, unsigned int seed, int *outRestarted)
+{
+    InterleavedClient client[16];
+    int wrong = 0, starved = 0;
+
+    initStore(0);
+    *outRestarted = 0;
+
+    for (int i = 0; i < clients; i++) {
+        InterleavedClient *c = &client[i];
+
+        memset(c, 0, sizeof(*c));
+        c->thread = (void *)(size_t)(0x2000 + i);
+        snprintf(c->own, sizeof(c->own), "C%03d", i);
+        simAddKey(&store, c->own, "ui16", 2, "\0\0");
+        startTransaction(c, &seed);
+    }
+
+    for (int step = 0; step < INTERLEAVED_STEPS; step++) {
+        stepClient(&client[rand_r(&seed) % clients], &seed);
+        simNow++;
+    }
+
+    for (int i = 0; i < clients; i++) {
+        wrong += client[i].wrong;
+        starved += client[i].completed == 0;
+        *outRestarted += client[i].restarted;
+    }
+
+    CHECK(wrong == 0);
+    CHECK(starved == 0);
+}
+
+static void testInterleavedTransactions(void)
+{
+    int restarted;
+
+    // As many clients as contexts: every transaction is accepted and sees only its own state
+    for (unsigned int seed = 1; seed <= 4; seed++) {
+        runInterleaved(APPLESMC_CONTEXTS, seed, &restarted);
+        CHECK(restarted == 0);
+        CHECK(port.rejected == 0);
+    }
+
+    // More clients than contexts: commands are refused and retried, a transaction in flight is never taken over
+    for (unsigned int seed = 1; seed <= 4; seed++) {
+        runInterleaved(APPLESMC_CONTEXTS + 4, seed, &restarted);
+        CHECK(restarted > 0);
+
+        // Every refused command was noticed by its client, but those whose retry is still pending
+        CHECK(port.rejected >= restarted && port.rejected - restarted <= APPLESMC_CONTEXTS + 4);
+    }
+}
+
+typedef struct {
+    int                 index;
+    unsigned int        seed;
+    int                 wrong;
+} ThreadClient;
+
+static void *transactionThread(void *context)
+{
+    ThreadClient *client = context;
+    void *thread = (void *)pthread_self();
+    char own[5], key[5];
+    UInt8 value[8], info[6];
+
+    snprintf(own, sizeof(own), "C%03d", client->index);
+
+    for (int i = 0; i < THREAD_TRANSACTIONS; i++) {
+        switch (rand_r(&client->seed) % 4) {
+            case 0:
+                if (!smcReadKey(thread, "T020", value, 8) || value[0] != 20 || value[7] != 20)
+                    client->wrong++;
+                break;
+
+            case 1:
+                value[0] = (UInt8)client->index;
+                value[1] = (UInt8)i;
+
+                if (!smcWriteKey(thread, own, value, 2) || !smcReadKey(thread, own, value, 2) || value[0] != client->index || value[1] != (UInt8)i)
+                    client->wrong++;
+                break;
+
+            case 2:
+                if (!smcKeyInfo(thread, own, info) || info[0] != 2 || memcmp(&info[1], "ui16", 4))
+                    client->wrong++;
+                break;
+
+            case 3:
+                if (!smcKeyByIndex(thread, 2, key) || strcmp(key, "F0Ac"))
+                    client->wrong++;
+                break;
+        }
+    }
+
+    return NULL;
+}
+
+static void testConcurrentThreads(void)
+{
+    pthread_t threads[APPLESMC_CONTEXTS];
+    ThreadClient clients[APPLESMC_CONTEXTS];
+    char own[5];
+
+    initStore(0);
+
+    for (int i = 0; i < APPLESMC_CONTEXTS; i++) {
+        snprintf(own, sizeof(own), "C%03d", i);
+        simAddKey(&store, own, "ui16", 2, "\0\0");
+    }
+
+    for (int i = 0; i < APPLESMC_CONTEXTS; i++) {
+        clients[i] = (ThreadClient){ i, 31u * (i + 1), 0 };
+        pthread_create(&threads[i], NULL, transactionThread, &clients[i]);
+    }
+
+    for (int i = 0; i < APPLESMC_CONTEXTS; i++) {
+        pthread_join(threads[i], NULL);
+        CHECK(clients[i].wrong == 0);
+    }
+
+    CHECK(port.rejected == 0);
+}
+
+static void testFuzz(void)
+{
+    static const UInt8 commands[] = { APPLESMC_READ_CMD, APPLESMC_WRITE_CMD, APPLESMC_GET_KEY_BY_INDEX_CMD, APPLESMC_GET_KEY_TYPE_CMD, APPLESMC_READ_RANGE_CMD };
+    static const char *names[] = { "F0Ac", "TC0P", "#KEY", "FNum", "T010", "XXXX" };
+    static const UInt16 addresses[] = { APPLESMC_DATA_PORT, APPLESMC_DATA_PORT, APPLESMC_DATA_PORT, APPLESMC_CMD_PORT, APPLESMC_ERROR_CODE_PORT, APPLESMC_DATA_PORT + 1 };
+    unsigned int seed = 0x5eed;
+    int badStatus = 0;
+    UInt8 value[2];
+
+    initStore(0);
+
+    for (int step = 0; step < FUZZ_STEPS; step++) {
+        void *thread = (void *)(size_t)(0x1000 + rand_r(&seed) % 3);
+        int choice = rand_r(&seed) % 16;
+        UInt16 address = addresses[rand_r(&seed) % (sizeof(addresses) / sizeof(addresses[0]))];
+
+        // Mostly plausible traffic so the fuzzer gets deep into transactions, with arbitrary bytes mixed in
+        if (choice < 2)
+            portWrite(thread, APPLESMC_CMD_PORT, commands[rand_r(&seed) % sizeof(commands)]);
+        else if (choice < 6)
+            portWrite(thread, APPLESMC_DATA_PORT, (UInt8)names[rand_r(&seed) % 6][rand_r(&seed) % 4]);
+        else if (choice < 8)
+            portWrite(thread, APPLESMC_DATA_PORT, (UInt8)(rand_r(&seed) % 40));
+        else if (choice < 9)
+            portWrite(thread, address, (UInt8)rand_r(&seed));
+        else
+            portRead(thread, address);
+
+        for (int i = 0; i < APPLESMC_CONTEXTS; i++)
+            if (!validStatus(port.contexts[i].status))
+                badStatus++;
+    }
+
+    CHECK(badStatus == 0);
+    CHECK(store.count <= STORE_KEYS);
+
+    // Written sizes stay within the key size the store was given
+    for (UInt32 i = 0; i < store.count; i++)
+        CHECK(store.keys[i].size <= APPLESMC_MAX_DATA_LENGTH);
+
+    // Whatever the fuzzer left behind, a new transaction starts from a clean state
+    CHECK(smcReadKey(client, "TC0P", value, 2));
+}
+
+static void testThroughput(void)
+{
+    UInt8 value[2];
+    int failed = 0;
+
+    initStore(0);
+
+    UInt64 started = hostTestNanoseconds();
+
+    for (int i = 0; i < BENCH_READS; i++)
+        if (!smcReadKey(client, i & 1 ? "F0Ac" : "TC0P", value, 2))
+            failed++;
+
+    double elapsed = (double)(hostTestNanoseconds() - started) / 1e9;
+
+    printf("  %.0f key reads/s through the port protocol\n", BENCH_READS / elapsed);
+
+    CHECK(failed == 0);
+}
+
+int main(void)
+{
+    RUN(testReadKey);
+    RUN(testMissingKey);
+    RUN(testWriteKey);
+    RUN(testOversizedWrite);
+    RUN(testKeyInfoAndIndex);
+    RUN(testZeroLength);
+    RUN(testStaleLength);
+    RUN(testReadRange);
+    RUN(testBusyDeadline);
+    RUN(testInterleavedTransactions);
+    RUN(testConcurrentThreads);
+    RUN(testFuzz);
+    RUN(testThroughput);
+
+    return hostTestResult("AppleSMCTests");
+}
@@ -0,0 +1,143 @@
+//
+//  ConfigurationTests.c
+//  HWSensors
+//
+//  FakeSMCConfigurationLinks.h: profile nodes reached through links, chains at and over the limit,
+//  links back to themselves, dangling links and values that are neither nodes nor links
+//
+
+#include <stdio.h>
+
+#include "HostTest.h"
+#include "FakeSMCConfigurationLinks.h"
+
+// A profile list: every entry is a node, a link to another name, or something else
+typedef struct {
+    const char  *name;
+    int         kind;       // kFakeSMCConfiguration*
+    const char  *link;
+} Profile;
+
+typedef struct {
+    const Profile   *profiles;
+    int             count;
+    int             lookups;
+} ProfileList;
+
+static int lookupProfile(const void *root, const void *name, const void **object)
+{
+    ProfileList *list = (ProfileList *)root;
+
+    list->lookups++;
+
+    for (int i = 0; i < list->count; i++) {
+        const Profile *profile = &list->profiles[i];
+
+        if (strcmp(profile->name, name))
+            continue;
+
+        switch (profile->kind) {
+            case kFakeSMCConfigurationNode:
+                *object = profile;
+                return kFakeSMCConfigurationNode;
+
+            case kFakeSMCConfigurationLink:
+                *object = profile->link;
+                return kFakeSMCConfigurationLink;
+        }
+
+        return kFakeSMCConfigurationNone;
+    }
+
+    return kFakeSMCConfigurationNone;
+}
+
+static int resolve(ProfileList *list, const char *name, const char **outNode)
+{
+    const void *node = NULL;
+    int result = fakeSMCConfigurationResolve(list, name, lookupProfile, &node);
+
+    *outNode = result == kFakeSMCConfigurationNode ? ((const Profile *)node)->name : NULL;
+
+    return result;
+}
+
+static void testNodesAndLinks(void)
+{
+    static const Profile profiles[] = {
+        { "Default",    kFakeSMCConfigurationNode,  NULL },
+        { "Z77X-UD5H",  kFakeSMCConfigurationNode,  NULL },
+        { "Z77X-UD3H",  kFakeSMCConfigurationLink,  "Z77X-UD5H" },
+        { "Z77X-D3H",   kFakeSMCConfigurationLink,  "Z77X-UD3H" },
+        { "Broken",     kFakeSMCConfigurationLink,  "Missing" },
+        { "Number",     kFakeSMCConfigurationNone,  NULL },
+        { "To Number",  kFakeSMCConfigurationLink,  "Number" },
+    };
+    ProfileList list = { profiles, sizeof(profiles) / sizeof(profiles[0]), 0 };
+    const char *node;
+
+    CHECK(resolve(&list, "Default", &node) == kFakeSMCConfigurationNode && 0 == strcmp(node, "Default"));
+    CHECK(resolve(&list, "Z77X-UD3H", &node) == kFakeSMCConfigurationNode && 0 == strcmp(node, "Z77X-UD5H"));
+    CHECK(resolve(&list, "Z77X-D3H", &node) == kFakeSMCConfigurationNode && 0 == strcmp(node, "Z77X-UD5H"));
+
+    CHECK(resolve(&list, "Unknown", &node) == kFakeSMCConfigurationNone);
+    CHECK(resolve(&list, "Broken", &node) == kFakeSMCConfigurationNone);
+    CHECK(resolve(&list, "Number", &node) == kFakeSMCConfigurationNone);
+    CHECK(resolve(&list, "To Number", &node) == kFakeSMCConfigurationNone);
+}
+
+static void testChainLimit(void)
+{
+    static char names[kFakeSMCConfigurationMaxLinks + 2][8];
+    Profile profiles[kFakeSMCConfigurationMaxLinks + 2];
+    ProfileList list = { profiles, kFakeSMCConfigurationMaxLinks + 2, 0 };
+    const char *node;
+
+    // names[0] links to names[1] and so on, the last one is a node
+    for (int i = 0; i < kFakeSMCConfigurationMaxLinks + 2; i++)
+        snprintf(names[i], sizeof(names[i]), "P%d", i);
+
+    for (int i = 0; i < kFakeSMCConfigurationMaxLinks + 1; i++) {
+        Profile link = { names[i], kFakeSMCConfigurationLink, names[i + 1] };
+        profiles[i] = link;
+    }
+
+    Profile last = { names[kFakeSMCConfigurationMaxLinks + 1], kFakeSMCConfigurationNode, NULL };
+    profiles[kFakeSMCConfigurationMaxLinks + 1] = last;
+
+    // As many links as allowed
+    CHECK(resolve(&list, names[1], &node) == kFakeSMCConfigurationNode && node == names[kFakeSMCConfigurationMaxLinks + 1]);
+
+    // One more
+    list.lookups = 0;
+    CHECK(resolve(&list, names[0], &node) == kFakeSMCConfigurationTooManyLinks);
+    CHECK(list.lookups == kFakeSMCConfigurationMaxLinks + 1);
+}
+
+static void testCycles(void)
+{
+    static const Profile profiles[] = {
+        { "Self",       kFakeSMCConfigurationLink,  "Self" },
+        { "Ping",       kFakeSMCConfigurationLink,  "Pong" },
+        { "Pong",       kFakeSMCConfigurationLink,  "Ping" },
+        { "Into Loop",  kFakeSMCConfigurationLink,  "Ping" },
+    };
+    ProfileList list = { profiles, sizeof(profiles) / sizeof(profiles[0]), 0 };
+    const char *node;
+
+    CHECK(resolve(&list, "Self", &node) == kFakeSMCConfigurationTooManyLinks);
+    CHECK(list.lookups == kFakeSMCConfigurationMaxLinks + 1);
+
+    CHECK(resolve(&list, "Ping", &node) == kFakeSMCConfigurationTooManyLinks);
+    CHECK(resolve(&list, "Into Loop", &node) == kFakeSMCConfigurationTooManyLinks);
+    CHECK(node == NULL);
+}
+
+int main(void)
+{
+    RUN(testNodesAndLinks);
+    RUN(testChainLimit);
+    RUN(testCycles);
+
+    return hostTestResult("ConfigurationTests");
+}
@@ -0,0 +1,145 @@
+//
+//  DefinitionsTests.c
+//  HWSensors
+//
+//  FakeSMCSensorDefinitions.h: every definition found through the hash, case folding, categories,
+//  colliding names and missing names
+//
+
+#include <stdlib.h>
+
+#define DEFINE_FAKESMC_SENSOR_PARAMS
+#include "HostTest.h"
+#include "FakeSMCSensorDefinitions.h"
+
+#define LOOKUPS         1000000
+
+static FakeSMCSensorDefinitionsHash hash;
+
+static int linearLookup(const char *name, FakeSMCSensorCategory category)
+{
+    for (int i = 0; FakeSMCSensorDefinitions[i].name; i++)
+        if (FakeSMCSensorDefinitions[i].category == category && 0 == strcasecmp(FakeSMCSensorDefinitions[i].name, name))
+            return i;
+
+    return -1;
+}
+
+static void testEveryDefinition(void)
+{
+    int count = 0;
+
+    CHECK(fakeSMCSensorDefinitionsHashBuild(&hash, FakeSMCSensorDefinitions));
+
+    for (int i = 0; FakeSMCSensorDefinitions[i].name; i++, count++)
+        CHECK(fakeSMCSensorDefinitionsHashLookup(&hash, FakeSMCSensorDefinitions, FakeSMCSensorDefinitions[i].name, FakeSMCSensorDefinitions[i].category) == linearLookup(FakeSMCSensorDefinitions[i].name, FakeSMCSensorDefinitions[i].category));
+
+    CHECK(count > 0 && count < kFakeSMCSensorDefinitionsHashSize / 2);
+}
+
+static void testNamesAndCategories(void)
+{
+    int die = fakeSMCSensorDefinitionsHashLookup(&hash, FakeSMCSensorDefinitions, "CPU Die", kFakeSMCCategoryTemperature);
+
+    CHECK(die >= 0 && 0 == strcmp(FakeSMCSensorDefinitions[die].key, "TC%XD"));
+    CHECK(fakeSMCSensorDefinitionsHashLookup(&hash, FakeSMCSensorDefinitions, "cpu DIE", kFakeSMCCategoryTemperature) == die);
+
+    // Same name, other category
+    int core = fakeSMCSensorDefinitionsHashLookup(&hash, FakeSMCSensorDefinitions, "CPU Core", kFakeSMCCategoryVoltage);
+
+    CHECK(core >= 0 && 0 == strcmp(FakeSMCSensorDefinitions[core].key, "VC0C"));
+    CHECK(fakeSMCSensorDefinitionsHashLookup(&hash, FakeSMCSensorDefinitions, "CPU Die", kFakeSMCCategoryVoltage) == -1);
+
+    CHECK(fakeSMCSensorDefinitionsHashLookup(&hash, FakeSMCSensorDefinitions, "CPU Di", kFakeSMCCategoryTemperature) == -1);
+    CHECK(fakeSMCSensorDefinitionsHashLookup(&hash, FakeSMCSensorDefinitions, "", kFakeSMCCategoryTemperature) == -1);
+}
+
+static void testCollisions(void)
+{
+    static char names[3][16];
+    FakeSMCSensorDefinitionEntry definitions[3] = { { 0 } };
+    FakeSMCSensorDefinitionsHash small;
+    UInt32 target = 0;
+    int found = 0;
+
+    // Three names landing in the same slot: two are defined, the third is looked up
+    for (int n = 0; found < 3 && n < 1000000; n++) {
+        char name[16];
+
+        snprintf(name, sizeof(name), "Sensor %d", n);
+
+        UInt32 slot = fakeSMCSensorDefinitionHash(name, kFakeSMCCategoryTemperature) & (kFakeSMCSensorDefinitionsHashSize - 1);
+
+        if (!found)
+            target = slot;
+
+        if (slot == target)
+            strcpy(names[found++], name);
+    }
+
+    CHECK(found == 3);
+
+    definitions[0].name = names[0];
+    definitions[0].category = kFakeSMCCategoryTemperature;
+    definitions[1].name = names[1];
+    definitions[1].category = kFakeSMCCategoryTemperature;
+
+    CHECK(fakeSMCSensorDefinitionsHashBuild(&small, definitions));
+    CHECK(fakeSMCSensorDefinitionsHashLookup(&small, definitions, names[0], kFakeSMCCategoryTemperature) == 0);
+    CHECK(fakeSMCSensorDefinitionsHashLookup(&small, definitions, names[1], kFakeSMCCategoryTemperature) == 1);
+    CHECK(fakeSMCSensorDefinitionsHashLookup(&small, definitions, names[2], kFakeSMCCategoryTemperature) == -1);
+}
+
+static void testTableFull(void)
+{
+    FakeSMCSensorDefinitionEntry *definitions = calloc(kFakeSMCSensorDefinitionsHashSize + 1, sizeof(FakeSMCSensorDefinitionEntry));
+    FakeSMCSensorDefinitionsHash full;
+
+    for (int i = 0; i < kFakeSMCSensorDefinitionsHashSize; i++) {
+        definitions[i].name = "Same";
+        definitions[i].category = kFakeSMCCategoryPower;
+    }
+
+    // Refused instead of leaving lookups of missing names without an empty slot to stop at
+    CHECK(!fakeSMCSensorDefinitionsHashBuild(&full, definitions));
+
+    free(definitions);
+}
+
+static void testLookupSpeed(void)
+{
+    int count = 0, hashed = 0, scanned = 0;
+    UInt64 started;
+    double hashTime, scanTime;
+
+    while (FakeSMCSensorDefinitions[count].name)
+        count++;
+
+    started = hostTestNanoseconds();
+
+    for (int i = 0; i < LOOKUPS; i++)
+        hashed += fakeSMCSensorDefinitionsHashLookup(&hash, FakeSMCSensorDefinitions, FakeSMCSensorDefinitions[i % count].name, FakeSMCSensorDefinitions[i % count].category);
+
+    hashTime = (double)(hostTestNanoseconds() - started) / LOOKUPS;
+    started = hostTestNanoseconds();
+
+    for (int i = 0; i < LOOKUPS; i++)
+        scanned += linearLookup(FakeSMCSensorDefinitions[i % count].name, FakeSMCSensorDefinitions[i % count].category);
+
+    scanTime = (double)(hostTestNanoseconds() - started) / LOOKUPS;
+
+    CHECK(hashed == scanned);
+
+    printf("  %.0f ns per hashed lookup, %.0f ns per scan of %d definitions\n", hashTime, scanTime, count);
+}
+
+int main(void)
+{
+    RUN(testEveryDefinition);
+    RUN(testNamesAndCategories);
+    RUN(testCollisions);
+    RUN(testTableFull);
+    RUN(testLookupSpeed);
+
+    return hostTestResult("DefinitionsTests");
+}
@@ -0,0 +1,198 @@
+//
+//  DetectionTests.c
+//  HWSensors
+//
+//  SMCDetection.h: table checksums, stored verdicts, and the cost of the APP0001 lookup on a
+//  simulated registry against the cached verdict FakeSMC::start uses instead
+//
+
+#include <stdlib.h>
+
+#include "HostTest.h"
+#include "SMCDetection.h"
+
+#define REGISTRY_NODES  5000
+#define NODE_PROPERTIES 12
+#define ACPI_TABLES     24
+#define ROUNDS          200
+
+// A registry entry as compareName sees it: the name and compatible are looked up in the property
+// table of every entry, like IORegistryEntry::getProperty
+typedef struct {
+    const char          *key;
+    char                value[16];
+} Property;
+
+typedef struct {
+    Property            properties[NODE_PROPERTIES];
+} Node;
+
+typedef struct {
+    char                name[8];
+    UInt8               bytes[256];
+} Table;
+
+static Node registry[REGISTRY_NODES];
+static Table tables[ACPI_TABLES];
+
+static const char *propertyKeys[NODE_PROPERTIES] = {
+    "IOClass", "IOProviderClass", "IOPowerManagement", "_STA", "_ADR", "_UID",
+    "IOInterruptSpecifiers", "IOInterruptControllers", "acpi-path", "IODeviceMemory", "name", "compatible",
+};
+
+static void buildRegistry(int smcIndex)
+{
+    for (int i = 0; i < REGISTRY_NODES; i++) {
+        for (int j = 0; j < NODE_PROPERTIES; j++) {
+            registry[i].properties[j].key = propertyKeys[j];
+            snprintf(registry[i].properties[j].value, sizeof(registry[i].properties[j].value), "%s%04X", j == 10 ? "PNP" : "V", (i * 31 + j) & 0xffff);
+        }
+    }
+
+    if (smcIndex >= 0)
+        snprintf(registry[smcIndex].properties[11].value, sizeof(registry[smcIndex].properties[11].value), "APP0001");
+}
+
+static void buildTables(void)
+{
+    unsigned int seed = 7;
+
+    for (int i = 0; i < ACPI_TABLES; i++) {
+        snprintf(tables[i].name, sizeof(tables[i].name), i ? "SSDT-%d" : "DSDT", i);
+
+        for (int j = 0; j < (int)sizeof(tables[i].bytes); j++)
+            tables[i].bytes[j] = (UInt8)rand_r(&seed);
+    }
+}
+
+static const char *nodeProperty(const Node *node, const char *key)
+{
+    for (int i = 0; i < NODE_PROPERTIES; i++)
+        if (0 == strcmp(node->properties[i].key, key))
+            return node->properties[i].value;
+
+    return NULL;
+}
+
+// FakeSMC::start before the cached verdict: every ACPI device is compared by name
+static int walkRegistry(void)
+{
+    for (int i = 0; i < REGISTRY_NODES; i++) {
+        const char *name = nodeProperty(&registry[i], "name");
+        const char *compatible = nodeProperty(&registry[i], "compatible");
+
+        if ((name && 0 == strcmp(name, "APP0001")) || (compatible && 0 == strcmp(compatible, "APP0001")))
+            return 1;
+    }
+
+    return 0;
+}
+
+static UInt32 tablesChecksum(int reversed)
+{
+    UInt32 checksum = 0;
+
+    for (int i = 0; i < ACPI_TABLES; i++) {
+        const Table *table = &tables[reversed ? ACPI_TABLES - 1 - i : i];
+
+        checksum += smcDetectionTableChecksum(table->name, table->bytes, sizeof(table->bytes));
+    }
+
+    return checksum;
+}
+
+static void testChecksum(void)
+{
+    buildTables();
+
+    UInt32 checksum = tablesChecksum(0);
+
+    CHECK(checksum != 0);
+    CHECK(tablesChecksum(1) == checksum);
+
+    // A changed header changes the checksum, the table body is not hashed
+    tables[3].bytes[9] ^= 1;
+    CHECK(tablesChecksum(0) != checksum);
+    tables[3].bytes[9] ^= 1;
+
+    tables[3].bytes[kSMCDetectionTableHeaderLength + 4] ^= 1;
+    CHECK(tablesChecksum(0) == checksum);
+    tables[3].bytes[kSMCDetectionTableHeaderLength + 4] ^= 1;
+
+    // Same bytes under another name
+    snprintf(tables[5].name, sizeof(tables[5].name), "SSDT-99");
+    CHECK(tablesChecksum(0) != checksum);
+    buildTables();
+
+    // Short tables hash what is there
+    CHECK(smcDetectionTableChecksum("FACS", tables[0].bytes, 4) != smcDetectionTableChecksum("FACS", tables[0].bytes, 5));
+}
+
+static void testVerdict(void)
+{
+    SMCDetectionVerdict verdict;
+    UInt32 checksum = 0x12345678;
+
+    smcDetectionMakeVerdict(&verdict, checksum, 1);
+    CHECK(smcDetectionCachedVerdict(&verdict, sizeof(verdict), checksum) == kSMCDetectionFound);
+
+    smcDetectionMakeVerdict(&verdict, checksum, 0);
+    CHECK(smcDetectionCachedVerdict(&verdict, sizeof(verdict), checksum) == kSMCDetectionAbsent);
+
+    // Other tables, nothing stored, unknown tables, damaged or older data
+    CHECK(smcDetectionCachedVerdict(&verdict, sizeof(verdict), checksum + 1) == kSMCDetectionUnknown);
+    CHECK(smcDetectionCachedVerdict(NULL, 0, checksum) == kSMCDetectionUnknown);
+    CHECK(smcDetectionCachedVerdict(&verdict, sizeof(verdict), 0) == kSMCDetectionUnknown);
+    CHECK(smcDetectionCachedVerdict(&verdict, sizeof(verdict) - 1, checksum) == kSMCDetectionUnknown);
+
+    verdict.version = kSMCDetectionVerdictVersion + 1;
+    CHECK(smcDetectionCachedVerdict(&verdict, sizeof(verdict), checksum) == kSMCDetectionUnknown);
+}
+
+static void testBootSavings(void)
+{
+    static const int smcIndexes[2] = { -1, REGISTRY_NODES - 1 };
+
+    buildTables();
+
+    for (int i = 0; i < 2; i++) {
+        SMCDetectionVerdict verdict;
+        volatile int walked = 0, cached = 0;
+
+        buildRegistry(smcIndexes[i]);
+
+        // First boot looks the device up and stores the verdict
+        int found = walkRegistry();
+
+        CHECK(found == (smcIndexes[i] >= 0));
+        smcDetectionMakeVerdict(&verdict, tablesChecksum(0), found);
+
+        UInt64 started = hostTestNanoseconds();
+
+        for (int round = 0; round < ROUNDS; round++)
+            walked += walkRegistry();
+
+        double walkTime = (double)(hostTestNanoseconds() - started) / ROUNDS;
+
+        started = hostTestNanoseconds();
+
+        for (int round = 0; round < ROUNDS; round++)
+            cached += smcDetectionCachedVerdict(&verdict, sizeof(verdict), tablesChecksum(0)) == kSMCDetectionFound;
+
+        double cachedTime = (double)(hostTestNanoseconds() - started) / ROUNDS;
+
+        CHECK(walked == cached);
+        CHECK(cachedTime < walkTime);
+
+        printf("  %s: %.1f us per walk of %d nodes, %.2f us with a cached verdict of %d tables\n", found ? "SMC present" : "no SMC", walkTime / 1000.0, REGISTRY_NODES, cachedTime / 1000.0, ACPI_TABLES);
+    }
+}
+
+int main(void)
+{
+    RUN(testChecksum);
+    RUN(testVerdict);
+    RUN(testBootSavings);
+
+    return hostTestResult("DetectionTests");
+}
@@ -0,0 +1,124 @@
+//
+//  FilterTests.c
+//  HWSensors
+//
+//  FakeSMCSensorFilter.h: EMA, median and spike stages alone and chained
+//
+
+#include "HostTest.h"
+#include "FakeSMCSensorFilter.h"
+
+static FakeSMCSensorFilter filterWith(float alpha, UInt8 median, float spike)
+{
+    FakeSMCSensorFilter filter = { 0 };
+
+    fakeSMCSensorFilterSet(&filter, alpha, median, spike);
+
+    return filter;
+}
+
+static void testDisabled(void)
+{
+    FakeSMCSensorFilter filter = filterWith(0, 0, 0);
+
+    CHECK(fakeSMCSensorFilterApply(&filter, 10) == 10);
+    CHECK(fakeSMCSensorFilterApply(&filter, -3) == -3);
+
+    // Out of range settings disable the stage
+    filter = filterWith(1, 1, -5);
+
+    CHECK(filter.alpha == 0 && filter.median == 0 && filter.spike == 0);
+    CHECK(fakeSMCSensorFilterApply(&filter, 42) == 42);
+
+    filter = filterWith(0, 200, 0);
+
+    CHECK(filter.median == kFakeSMCSensorFilterMaxMedian);
+}
+
+static void testEma(void)
+{
+    FakeSMCSensorFilter filter = filterWith(0.5f, 0, 0);
+
+    // First sample primes the average
+    CHECK(fakeSMCSensorFilterApply(&filter, 40) == 40);
+    CHECK(fakeSMCSensorFilterApply(&filter, 60) == 50);
+    CHECK(fakeSMCSensorFilterApply(&filter, 60) == 55);
+    CHECK(fakeSMCSensorFilterApply(&filter, 35) == 45);
+}
+
+static void testMedian(void)
+{
+    FakeSMCSensorFilter filter = filterWith(0, 3, 0);
+
+    CHECK(fakeSMCSensorFilterApply(&filter, 5) == 5);
+    CHECK(fakeSMCSensorFilterApply(&filter, 1) == 5);    // upper of two
+    CHECK(fakeSMCSensorFilterApply(&filter, 3) == 3);
+
+    // Single outliers never get through a window of three
+    CHECK(fakeSMCSensorFilterApply(&filter, 100) == 3);
+    CHECK(fakeSMCSensorFilterApply(&filter, 4) == 4);
+    CHECK(fakeSMCSensorFilterApply(&filter, -50) == 4);
+    CHECK(fakeSMCSensorFilterApply(&filter, 6) == 4);
+    CHECK(fakeSMCSensorFilterApply(&filter, 7) == 6);
+}
+
+static void testSpike(void)
+{
+    FakeSMCSensorFilter filter = filterWith(0, 0, 10);
+
+    CHECK(fakeSMCSensorFilterApply(&filter, 20) == 20);
+    CHECK(fakeSMCSensorFilterApply(&filter, 28) == 28);
+
+    // Jumps are held back for kFakeSMCSensorFilterMaxSpikes samples, a step lasting longer is real
+    for (int i = 0; i < kFakeSMCSensorFilterMaxSpikes; i++)
+        CHECK(fakeSMCSensorFilterApply(&filter, 90) == 28);
+
+    CHECK(fakeSMCSensorFilterApply(&filter, 90) == 90);
+
+    // A single spike, then back to normal
+    CHECK(fakeSMCSensorFilterApply(&filter, 0) == 90);
+    CHECK(fakeSMCSensorFilterApply(&filter, 85) == 85);
+    CHECK(filter.spikes == 0);
+}
+
+static void testChained(void)
+{
+    FakeSMCSensorFilter filter = filterWith(0.5f, 3, 10);
+
+    CHECK(fakeSMCSensorFilterApply(&filter, 50) == 50);
+
+    // Spike rejected before it reaches the median window
+    CHECK(fakeSMCSensorFilterApply(&filter, 500) == 50);
+    CHECK(filter.count == 1);
+
+    // Median of { 50, 54 } is 54, averaged with 50
+    CHECK(fakeSMCSensorFilterApply(&filter, 54) == 52);
+
+    // Median of { 50, 54, 56 } is 54, averaged with 52
+    CHECK(fakeSMCSensorFilterApply(&filter, 56) == 53);
+}
+
+static void testSetForgetsSamples(void)
+{
+    FakeSMCSensorFilter filter = filterWith(0.5f, 3, 0);
+
+    fakeSMCSensorFilterApply(&filter, 10);
+    fakeSMCSensorFilterApply(&filter, 20);
+
+    fakeSMCSensorFilterSet(&filter, 0.5f, 3, 0);
+
+    CHECK(!filter.primed && filter.count == 0);
+    CHECK(fakeSMCSensorFilterApply(&filter, 70) == 70);
+}
+
+int main(void)
+{
+    RUN(testDisabled);
+    RUN(testEma);
+    RUN(testMedian);
+    RUN(testSpike);
+    RUN(testChained);
+    RUN(testSetForgetsSamples);
+
+    return hostTestResult("FilterTests");
+}
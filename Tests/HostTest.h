@@ -0,0 +1,46 @@
+//
+//  HostTest.h
+//  HWSensors
+//
+//  Minimal check macros and helpers shared by the host tests
+//
+
+#ifndef HWSensors_HostTest_h
+#define HWSensors_HostTest_h
+
+#include <stdio.h>
+#include <time.h>
+
+static int hostTestChecks;
+static int hostTestFailures;
+
+#define CHECK(condition) do { \
+    hostTestChecks++; \
+    if (!(condition)) { \
+        fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #condition); \
+        hostTestFailures++; \
+    } \
+} while (0)
+
+#define RUN(test) do { \
+    int failures = hostTestFailures; \
+    test(); \
+    printf("%-40s %s\n", #test, failures == hostTestFailures ? "ok" : "FAILED"); \
+} while (0)
+
+static inline int hostTestResult(const char *suite)
+{
+    printf("%s: %d checks, %d failed\n", suite, hostTestChecks, hostTestFailures);
+    return hostTestFailures ? 1 : 0;
+}
+
+static inline UInt64 hostTestNanoseconds(void)
+{
+    struct timespec now;
+
+    clock_gettime(CLOCK_MONOTONIC, &now);
+
+    return (UInt64)now.tv_sec * 1000000000ull + (UInt64)now.tv_nsec;
+}
+
+#endif
@@ -0,0 +1,28 @@
+//
+//  HostTypes.h
+//  HWSensors
+//
+//  Kernel and IOKit types used by the portable headers, so they build for the host tests
+//
+
+#ifndef HWSensors_HostTypes_h
+#define HWSensors_HostTypes_h
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+
+typedef uint8_t     UInt8;
+typedef int8_t      SInt8;
+typedef uint16_t    UInt16;
+typedef int16_t     SInt16;
+typedef uint32_t    UInt32;
+typedef int32_t     SInt32;
+typedef uint64_t    UInt64;
+typedef int64_t     SInt64;
+
+typedef int             kern_return_t;
+typedef unsigned int    io_connect_t;
+
+#endif
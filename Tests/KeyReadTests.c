@@ -0,0 +1,597 @@
+//
+//  KeyReadTests.c
+//  HWSensors
+//
+//  FakeSMCKeyRefresh.h under concurrent clients. TestKey mirrors the locking of FakeSMCKey::copyValue,
+//  refreshValue and setValueFromBuffer: the key lock is dropped while the handler runs
+//
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "HostTest.h"
+#include "FakeSMCKeyRefresh.h"
+
+#define KEYS            64
+#define CLIENTS         8
+#define ROUNDS          4
+#define HANDLER_DELAY   1000    // microseconds, a slow hardware read
+#define SCAN_KEYS       4096    // keys of the latency test, more than the bus refreshes in a key lifetime
+#define SCANNERS        8
+#define LATENCY_READS   200
+
+typedef struct {
+    pthread_mutex_t     lock;
+    pthread_cond_t      refreshed;
+    FakeSMCKeyRefresh   refresh;
+    int                 refreshing;
+    UInt8               value[4];
+    int                 index;
+    volatile int        handlerCalls;
+} TestKey;
+
+static TestKey keys[SCAN_KEYS];
+static FakeSMCKeyReadBudget budget;
+static FakeSMCKeyHandlerThreads handlerThreads;
+static volatile UInt64 keyClock;           // key lifetime is judged against this, rounds move it forward
+static volatile int counter;
+static int handlerReadsKeys;
+static pthread_mutex_t globalLock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int tornValues;
+static int sharedBus;                       // handlers queue on one lock, like sensors behind one SMBus or LPC port
+static int realClock;                       // judge lifetime and budget by real time instead of keyClock
+static pthread_mutex_t busLock = PTHREAD_MUTEX_INITIALIZER;
+static volatile int stopScanners;
+static volatile int holdHandler;            // handlers wait in the read until cleared
+
+static void readKey(TestKey *key, UInt8 *out, int background);
+
+static UInt64 keyTime(void)
+{
+    return realClock ? hostTestNanoseconds() : keyClock;
+}
+
+static void initKeys(void)
+{
+    for (int i = 0; i < SCAN_KEYS; i++) {
+        TestKey *key = &keys[i];
+
+        memset(key, 0, sizeof(*key));
+        pthread_mutex_init(&key->lock, NULL);
+        pthread_cond_init(&key->refreshed, NULL);
+        key->index = i;
+    }
+
+    memset(&budget, 0, sizeof(budget));
+    memset(&handlerThreads, 0, sizeof(handlerThreads));
+    keyClock = 1000000000ull;
+    handlerReadsKeys = 0;
+    tornValues = 0;
+}
+
+static int handlerRead(TestKey *key, UInt8 *buffer)
+{
+    __sync_fetch_and_add(&key->handlerCalls, 1);
+
+    if (sharedBus)
+        pthread_mutex_lock(&busLock);
+
+    usleep(HANDLER_DELAY);
+
+    while (holdHandler)
+        usleep(10);
+
+    if (sharedBus)
+        pthread_mutex_unlock(&busLock);
+
+    // Plugins read other keys and their own from handlers
+    if (handlerReadsKeys) {
+        UInt8 other[4];
+
+        readKey(&keys[(key->index + 1) % KEYS], other, 0);
+        readKey(key, other, 0);
+    }
+
+    UInt8 value = (UInt8)__sync_add_and_fetch(&counter, 1) | 1;
+
+    memset(buffer, value, 4);
+
+    return 1;
+}
+
+static void checkValue(const UInt8 *value)
+{
+    if (value[0] != value[1] || value[0] != value[2] || value[0] != value[3])
+        __sync_fetch_and_add(&tornValues, 1);
+}
+
+// FakeSMCKey::copyValue and refreshValue
+static void readKey(TestKey *key, UInt8 *out, int background)
+{
+    void *thread = (void *)pthread_self();
+    UInt32 generation = 0;
+
+    if (!background)
+        fakeSMCKeyReadBudgetEnter(&budget);
+
+    pthread_mutex_lock(&key->lock);
+
+    for (;;) {
+        int nested = fakeSMCKeyIsHandlerThread(&handlerThreads, thread);
+        int action = fakeSMCKeyRefreshBegin(&key->refresh, &budget, keyTime(), background, nested, &generation);
+
+        if (action == kFakeSMCKeyRefreshCallHandler) {
+            int slot = nested ? -1 : fakeSMCKeyHandlerThreadEnter(&handlerThreads, thread);
+            UInt8 buffer[4];
+
+            CHECK(nested || slot >= 0);
+
+            key->refreshing = 1;
+
+            pthread_mutex_unlock(&key->lock);
+
+            int succeeded = handlerRead(key, buffer);
+
+            if (slot >= 0)
+                fakeSMCKeyHandlerThreadLeave(&handlerThreads, slot);
+
+            pthread_mutex_lock(&key->lock);
+
+            key->refreshing = 0;
+
+            if (fakeSMCKeyRefreshEnd(&key->refresh, generation, keyTime(), succeeded))
+                memcpy(key->value, buffer, 4);
+
+            pthread_cond_broadcast(&key->refreshed);
+            break;
+        }
+
+        if (action != kFakeSMCKeyRefreshWait)
+            break;
+
+        pthread_cond_wait(&key->refreshed, &key->lock);
+    }
+
+    memcpy(out, key->value, 4);
+
+    pthread_mutex_unlock(&key->lock);
+
+    if (!background)
+        fakeSMCKeyReadBudgetLeave(&budget);
+
+    checkValue(out);
+}
+
+// FakeSMCKey::setValueFromBuffer
+static void writeKey(TestKey *key, UInt8 value)
+{
+    pthread_mutex_lock(&key->lock);
+
+    memset(key->value, value, 4);
+    fakeSMCKeyRefreshInvalidate(&key->refresh, 0);
+
+    pthread_mutex_unlock(&key->lock);
+}
+
+// The user client before per-key locks: one lock around every read, handler called under it
+static void readKeyGlobal(TestKey *key, UInt8 *out)
+{
+    UInt32 generation = 0;
+
+    pthread_mutex_lock(&globalLock);
+
+    if (fakeSMCKeyRefreshBegin(&key->refresh, &budget, keyClock, 0, 0, &generation) == kFakeSMCKeyRefreshCallHandler) {
+        UInt8 buffer[4];
+
+        int succeeded = handlerRead(key, buffer);
+
+        if (fakeSMCKeyRefreshEnd(&key->refresh, generation, keyClock, succeeded))
+            memcpy(key->value, buffer, 4);
+    }
+
+    memcpy(out, key->value, 4);
+
+    pthread_mutex_unlock(&globalLock);
+
+    checkValue(out);
+}
+
+typedef struct {
+    int                 global;
+    unsigned int        seed;
+    pthread_barrier_t   *start;
+    pthread_barrier_t   *done;
+    volatile UInt64     reads;
+} Client;
+
+static void *clientThread(void *context)
+{
+    Client *client = context;
+    int order[KEYS];
+
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int i = 0; i < KEYS; i++)
+            order[i] = i;
+
+        // Every client walks the keys in its own order, like independent monitoring apps
+        for (int i = KEYS - 1; i > 0; i--) {
+            int j = rand_r(&client->seed) % (i + 1), t = order[i];
+            order[i] = order[j];
+            order[j] = t;
+        }
+
+        pthread_barrier_wait(client->start);
+
+        for (int pass = 0; pass < 4; pass++) {
+            for (int i = 0; i < KEYS; i++) {
+                UInt8 value[4];
+
+                if (client->global)
+                    readKeyGlobal(&keys[order[i]], value);
+                else
+                    readKey(&keys[order[i]], value, 0);
+
+                client->reads++;
+            }
+        }
+
+        pthread_barrier_wait(client->done);
+    }
+
+    return NULL;
+}
+
+static double runClients(int global, UInt64 *outReads)
+{
+    pthread_barrier_t start, done;
+    pthread_t threads[CLIENTS];
+    Client clients[CLIENTS];
+    double elapsed = 0;
+
+    pthread_barrier_init(&start, NULL, CLIENTS + 1);
+    pthread_barrier_init(&done, NULL, CLIENTS + 1);
+
+    for (int i = 0; i < CLIENTS; i++) {
+        clients[i] = (Client){ global, 17u * (i + 1), &start, &done, 0 };
+        pthread_create(&threads[i], NULL, clientThread, &clients[i]);
+    }
+
+    for (int round = 0; round < ROUNDS; round++) {
+        // Every value is past its lifetime at the start of a round
+        keyClock += 1000000000ull;
+
+        UInt64 started = hostTestNanoseconds();
+
+        pthread_barrier_wait(&start);
+        pthread_barrier_wait(&done);
+
+        elapsed += (double)(hostTestNanoseconds() - started) / 1e9;
+    }
+
+    *outReads = 0;
+
+    for (int i = 0; i < CLIENTS; i++) {
+        pthread_join(threads[i], NULL);
+        *outReads += clients[i].reads;
+    }
+
+    pthread_barrier_destroy(&start);
+    pthread_barrier_destroy(&done);
+
+    return elapsed;
+}
+
+static void testMultiClientThroughput(void)
+{
+    UInt64 globalReads, keyReads;
+
+    initKeys();
+    double globalTime = runClients(1, &globalReads);
+
+    initKeys();
+    double keyTime = runClients(0, &keyReads);
+
+    printf("  %d clients, %d keys, %d us handler: global lock %.0f reads/s, per-key lock %.0f reads/s\n",
+           CLIENTS, KEYS, HANDLER_DELAY, globalReads / globalTime, keyReads / keyTime);
+
+    CHECK(globalReads == keyReads);
+    CHECK(tornValues == 0);
+
+    // Handler reads of different keys overlap instead of queueing behind one lock
+    CHECK(keyTime * 2 < globalTime);
+
+    // Readers of a key being refreshed don't start another handler read
+    for (int i = 0; i < KEYS; i++)
+        CHECK(keys[i].handlerCalls == ROUNDS);
+}
+
+static void *watchdog(void *context)
+{
+    sleep(30);
+    fprintf(stderr, "deadlock: handler reading keys never finished\n");
+    exit(2);
+}
+
+static void testHandlerReadsKeys(void)
+{
+    pthread_t timer;
+    UInt64 reads;
+
+    initKeys();
+    handlerReadsKeys = 1;
+
+    pthread_create(&timer, NULL, watchdog, NULL);
+    runClients(0, &reads);
+    pthread_cancel(timer);
+    pthread_join(timer, NULL);
+
+    CHECK(tornValues == 0);
+
+    for (int i = 0; i < KEYS; i++)
+        CHECK(keys[i].handlerCalls == ROUNDS);
+}
+
+static void *firstReader(void *context)
+{
+    UInt8 *value = context;
+
+    readKey(&keys[0], value, 1);
+
+    return NULL;
+}
+
+static void testFirstReadWaits(void)
+{
+    pthread_t threads[CLIENTS];
+    UInt8 values[CLIENTS][4];
+
+    initKeys();
+
+    // Never read key: nobody is served the zero filled value, everyone waits for the one handler read
+    for (int i = 0; i < CLIENTS; i++)
+        pthread_create(&threads[i], NULL, firstReader, values[i]);
+
+    for (int i = 0; i < CLIENTS; i++) {
+        pthread_join(threads[i], NULL);
+        CHECK(values[i][0] != 0);
+    }
+
+    CHECK(keys[0].handlerCalls == 1);
+}
+
+static void *slowRefresh(void *context)
+{
+    UInt8 value[4];
+
+    readKey(&keys[1], value, 0);
+
+    return NULL;
+}
+
+static void testWriteDuringRefresh(void)
+{
+    pthread_t thread;
+    UInt8 value[4];
+    UInt32 generation;
+
+    initKeys();
+
+    readKey(&keys[1], value, 0);
+    keyClock += 1000000000ull;
+
+    // Keep the handler read in flight until the write is done, however the threads are scheduled
+    int calls = keys[1].handlerCalls;
+
+    holdHandler = 1;
+
+    pthread_create(&thread, NULL, slowRefresh, NULL);
+
+    while (keys[1].handlerCalls == calls)
+        usleep(10);
+
+    // Written while the handler read is in flight, the read result is dropped
+    writeKey(&keys[1], 0xAA);
+
+    holdHandler = 0;
+
+    pthread_join(thread, NULL);
+
+    CHECK(keys[1].value[0] == 0xAA);
+
+    // Not taken for a handler read either, the next read asks the handler again
+    CHECK(fakeSMCKeyRefreshBegin(&keys[1].refresh, &budget, keyClock, 0, 0, &generation) == kFakeSMCKeyRefreshCallHandler);
+}
+
+// FakeSMCKey::setValueFromBuffer with a handler: the value is reallocated to the written size and
+// copied to the stack for the handler, which is called once the key lock is dropped
+typedef struct {
+    pthread_mutex_t     lock;
+    FakeSMCKeyRefresh   refresh;
+    UInt8               size;
+    UInt8               *value;
+    UInt8               handlerSize;
+    UInt8               handlerValue[kFakeSMCKeyMaxSize];
+} HandledKey;
+
+static void handlerWrite(HandledKey *key, UInt8 size, const UInt8 *value)
+{
+    key->handlerSize = size;
+    memcpy(key->handlerValue, value, size);
+}
+
+static int writeHandledKey(HandledKey *key, const void *buffer, UInt8 size)
+{
+    if (!buffer || size == 0)
+        return 0;
+
+    size = fakeSMCKeyClampSize(size);
+
+    pthread_mutex_lock(&key->lock);
+
+    if (size != key->size) {
+        free(key->value);
+        key->size = size;
+
+        if (!(key->value = malloc(size))) {
+            pthread_mutex_unlock(&key->lock);
+            return 0;
+        }
+    }
+
+    memcpy(key->value, buffer, size);
+    fakeSMCKeyRefreshInvalidate(&key->refresh, 0);
+
+    UInt8 currentSize = key->size;
+    UInt8 copy[kFakeSMCKeyMaxSize];
+
+    memcpy(copy, key->value, currentSize);
+
+    pthread_mutex_unlock(&key->lock);
+
+    handlerWrite(key, currentSize, copy);
+
+    return 1;
+}
+
+static void testOversizedWrite(void)
+{
+    HandledKey key;
+    UInt8 value[255];
+
+    memset(&key, 0, sizeof(key));
+    pthread_mutex_init(&key.lock, NULL);
+
+    for (int i = 0; i < (int)sizeof(value); i++)
+        value[i] = (UInt8)i;
+
+    // A port write or a user client can ask for up to 255 bytes, the key and its handler see no more than fits
+    CHECK(writeHandledKey(&key, value, 2));
+    CHECK(key.handlerSize == 2);
+
+    CHECK(writeHandledKey(&key, value, 33));
+    CHECK(key.size == kFakeSMCKeyMaxSize);
+    CHECK(key.handlerSize == kFakeSMCKeyMaxSize);
+    CHECK(!memcmp(key.handlerValue, value, kFakeSMCKeyMaxSize));
+
+    CHECK(writeHandledKey(&key, value, sizeof(value)));
+    CHECK(key.handlerSize == kFakeSMCKeyMaxSize);
+    CHECK(!memcmp(key.value, value, kFakeSMCKeyMaxSize));
+
+    free(key.value);
+    pthread_mutex_destroy(&key.lock);
+}
+
+static void spendBudget(UInt64 time)
+{
+    budget.window = (UInt32)(time / (1000000000ull / 4));
+    budget.refreshes = kFakeSMCKeyBackgroundRefreshesPerSecond;
+}
+
+static void testNeverReadIgnoresBudget(void)
+{
+    UInt32 generation;
+
+    initKeys();
+    spendBudget(keyClock);
+
+    UInt64 expired = keyClock + kFakeSMCKeyValueLifetime;
+
+    // No cached value to serve, a background read of a never read key asks the handler anyway
+    CHECK(fakeSMCKeyRefreshBegin(&keys[0].refresh, &budget, keyClock, 1, 0, &generation) == kFakeSMCKeyRefreshCallHandler);
+    CHECK(fakeSMCKeyRefreshEnd(&keys[0].refresh, generation, keyClock, 1));
+
+    // Once read it is served cached while the budget is spent, interactive reads still refresh
+    spendBudget(expired);
+
+    CHECK(fakeSMCKeyRefreshBegin(&keys[0].refresh, &budget, expired, 1, 0, &generation) == kFakeSMCKeyRefreshUseCached);
+    CHECK(fakeSMCKeyRefreshBegin(&keys[0].refresh, &budget, expired, 0, 0, &generation) == kFakeSMCKeyRefreshCallHandler);
+}
+
+static void *scannerThread(void *context)
+{
+    int background = *(int *)context;
+    unsigned int seed = (unsigned int)(size_t)pthread_self();
+    UInt8 value[4];
+
+    // Bulk enumeration, e.g. smcutil -l in a loop, over every key but the one the interactive reader polls
+    for (int i = 1 + rand_r(&seed) % (SCAN_KEYS - 1); !stopScanners; i = i % (SCAN_KEYS - 1) + 1)
+        readKey(&keys[i], value, background);
+
+    return NULL;
+}
+
+// Mean microseconds of an interactive read that has to ask the handler, while scanners read with the given priority
+static double interactiveLatency(int background)
+{
+    pthread_t scanners[SCANNERS];
+    UInt8 value[4];
+    UInt64 total = 0;
+
+    initKeys();
+    sharedBus = 1;
+    realClock = 1;
+    stopScanners = 0;
+
+    // Read once long ago: every value is expired, none waits for a first read
+    for (int i = 0; i < SCAN_KEYS; i++)
+        keys[i].refresh.lastRefresh = 1;
+
+    for (int i = 0; i < SCANNERS; i++)
+        pthread_create(&scanners[i], NULL, scannerThread, &background);
+
+    usleep(50000);
+
+    for (int i = 0; i < LATENCY_READS; i++) {
+        // Like a read through the SMC port of a value the hardware must be asked for
+        pthread_mutex_lock(&keys[0].lock);
+        fakeSMCKeyRefreshInvalidate(&keys[0].refresh, 1);
+        pthread_mutex_unlock(&keys[0].lock);
+
+        UInt64 started = hostTestNanoseconds();
+
+        readKey(&keys[0], value, 0);
+
+        total += hostTestNanoseconds() - started;
+
+        usleep(2000);
+    }
+
+    stopScanners = 1;
+
+    for (int i = 0; i < SCANNERS; i++)
+        pthread_join(scanners[i], NULL);
+
+    sharedBus = 0;
+    realClock = 0;
+
+    return (double)total / LATENCY_READS / 1000.0;
+}
+
+static void testLatencyIsolation(void)
+{
+    double interactive = interactiveLatency(0);
+    double background = interactiveLatency(1);
+
+    printf("  %d scanners on a shared %d us bus: interactive read %.0f us among interactive scanners, %.0f us among background scanners\n",
+           SCANNERS, HANDLER_DELAY, interactive, background);
+
+    CHECK(tornValues == 0);
+
+    // Background scanners stay within their budget and yield to the interactive read, it waits
+    // for one bus access at most instead of the queue of scanner refreshes
+    CHECK(background * 2 < interactive);
+}
+
+int main(void)
+{
+    RUN(testMultiClientThroughput);
+    RUN(testHandlerReadsKeys);
+    RUN(testFirstReadWaits);
+    RUN(testWriteDuringRefresh);
+    RUN(testOversizedWrite);
+    RUN(testNeverReadIgnoresBudget);
+    RUN(testLatencyIsolation);
+
+    return hostTestResult("KeyReadTests");
+}
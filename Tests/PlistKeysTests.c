@@ -0,0 +1,170 @@
+//
+//  PlistKeysTests.c
+//  HWSensors
+//
+//  Preconfigured Keys of FakeSMC-Info.plist: each entry is the type string and value data
+//  FakeSMCKeyStore::addKeysFromDictionary expects, with a four character name, a type of at most
+//  four characters and a value size the type allows
+//
+
+#include <stdlib.h>
+
+#include "HostTest.h"
+#include "smc.h"
+#include "FakeSMCDefinitions.h"
+
+#define PLIST           "../FakeSMC/FakeSMC-Info.plist"
+#define MAX_KEYS        256
+
+static const struct {
+    const char  *type;
+    int         size;
+} fixedSizes[] = {
+    { TYPE_UI8,     TYPE_UI8_SIZE },
+    { TYPE_UI16,    TYPE_UI16_SIZE },
+    { TYPE_UI32,    TYPE_UI32_SIZE },
+    { "si8",        TYPE_SI8_SIZE },
+    { TYPE_SI16,    TYPE_SI16_SIZE },
+    { "si32",       TYPE_SI32_SIZE },
+    { TYPE_FLAG,    TYPE_FLAG_SIZE },
+};
+
+static const char *plistPath = PLIST;
+static char keyNames[MAX_KEYS][8];
+static int keyCount;
+
+static const char *skipSpace(const char *p)
+{
+    while (*p == ' ' || *p == '\t' || *p == '\n' || *p == '\r')
+        p++;
+
+    return p;
+}
+
+// Skip whitespace and the tag, 0 if something else comes first
+static const char *expect(const char *p, const char *tag)
+{
+    p = skipSpace(p);
+
+    return strncmp(p, tag, strlen(tag)) ? NULL : p + strlen(tag);
+}
+
+// Copy text up to the closing tag, 0 if it doesn't fit
+static const char *text(const char *p, const char *close, char *out, size_t size)
+{
+    const char *end = strstr(p, close);
+
+    if (!end || (size_t)(end - p) >= size)
+        return NULL;
+
+    memcpy(out, p, end - p);
+    out[end - p] = 0;
+
+    return end + strlen(close);
+}
+
+static int base64Length(const char *data)
+{
+    int chars = 0, padding = 0;
+
+    for (; *data; data++) {
+        if (*data == '=')
+            padding++;
+        else if ((*data >= 'A' && *data <= 'Z') || (*data >= 'a' && *data <= 'z') || (*data >= '0' && *data <= '9') || *data == '+' || *data == '/')
+            chars++;
+        else if (*data != ' ' && *data != '\t' && *data != '\n' && *data != '\r')
+            return -1;
+    }
+
+    if ((chars + padding) % 4)
+        return -1;
+
+    return (chars + padding) / 4 * 3 - padding;
+}
+
+static void checkKey(const char *name, const char *type, int size)
+{
+    int ok = 1;
+
+    if (strlen(name) != 4 || strlen(type) < 1 || strlen(type) > 4)
+        ok = 0;
+
+    if (size < 1 || size > (int)sizeof(SMCBytes_t))
+        ok = 0;
+
+    for (size_t i = 0; i < sizeof(fixedSizes) / sizeof(fixedSizes[0]); i++)
+        if (0 == strcmp(type, fixedSizes[i].type) && size != fixedSizes[i].size)
+            ok = 0;
+
+    // Fixed point types are two bytes whatever the split
+    if ((0 == strncmp(type, "fp", 2) || 0 == strncmp(type, "sp", 2)) && size != TYPE_FPXX_SIZE)
+        ok = 0;
+
+    for (int i = 0; i < keyCount; i++)
+        if (0 == strcmp(keyNames[i], name))
+            ok = 0;
+
+    if (!ok)
+        fprintf(stderr, "  key '%s' type '%s' size %d\n", name, type, size);
+
+    CHECK(ok);
+
+    if (keyCount < MAX_KEYS)
+        strcpy(keyNames[keyCount++], name);
+}
+
+static void testPreconfiguredKeys(void)
+{
+    FILE *file = fopen(plistPath, "rb");
+    char *plist;
+    long length;
+
+    CHECK(file != NULL);
+
+    if (!file)
+        return;
+
+    fseek(file, 0, SEEK_END);
+    length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+
+    plist = calloc(1, length + 1);
+    CHECK(fread(plist, 1, length, file) == (size_t)length);
+    fclose(file);
+
+    const char *p = strstr(plist, "<key>Keys</key>");
+
+    CHECK(p && (p = expect(p + strlen("<key>Keys</key>"), "<dict>")));
+
+    while (p && !expect(p, "</dict>")) {
+        char name[8], type[8], data[128];
+
+        if (!(p = expect(p, "<key>")) || !(p = text(p, "</key>", name, sizeof(name))) ||
+            !(p = expect(p, "<array>")) ||
+            !(p = expect(p, "<string>")) || !(p = text(p, "</string>", type, sizeof(type))) ||
+            !(p = expect(p, "<data>")) || !(p = text(p, "</data>", data, sizeof(data))) ||
+            !(p = expect(p, "</array>"))) {
+            fprintf(stderr, "  entry %d is not a key name, a type string and value data\n", keyCount + 1);
+            CHECK(0);
+            break;
+        }
+
+        checkKey(name, type, base64Length(data));
+    }
+
+    CHECK(keyCount > 0);
+
+    printf("  %d preconfigured keys\n", keyCount);
+
+    free(plist);
+}
+
+int main(int argc, char **argv)
+{
+    if (argc > 1)
+        plistPath = argv[1];
+
+    RUN(testPreconfiguredKeys);
+
+    return hostTestResult("PlistKeysTests");
+}
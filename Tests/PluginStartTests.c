@@ -0,0 +1,265 @@
+//
+//  PluginStartTests.c
+//  HWSensors
+//
+//  Start ordering of FakeSMCKeyStore and its plugins on a bounded pool of configuration threads,
+//  the threads IOKit runs start on. A plugin waiting in start (shouldWaitForKeyStore) holds its
+//  thread until the key store is published or the wait times out, one returning early finishes in
+//  startWithKeyStore on a thread call. Reports the critical path: the time the last plugin has its
+//  sensors registered
+//
+
+#include "HostTest.h"
+#include "FakeSMCDefinitions.h"
+
+#define MAX_JOBS        16
+#define MAX_THREADS     16
+#define WAIT_TIMEOUT    (UInt32)(kFakeSMCDefaultWaitTimeout / 1000000ull)  // milliseconds
+#define HORIZON         (WAIT_TIMEOUT * (MAX_JOBS + 1))   // every plugin may time out in turn
+
+enum {
+    kJobPending = 0,    // not matched yet or no configuration thread free
+    kJobStarting,       // in start before the key store is needed
+    kJobWaiting,        // in start, blocked on the key store
+    kJobFinishing,      // in start with the key store, on the configuration thread
+    kJobCallout,        // returned from start, startWithKeyStore runs on a thread call
+    kJobDone,
+    kJobFailed,         // gave up waiting for the key store
+};
+
+typedef struct {
+    const char          *name;
+    UInt32              ready;              // ms, provider published and the plugin matched
+    UInt32              startCost;          // ms in start before the key store is needed
+    UInt32              storeCost;          // ms of work with the key store: sensors, profiles
+    int                 waits;              // blocks in start for the key store
+    int                 isStore;            // FakeSMCKeyStore itself, published when its start ends
+} Job;
+
+typedef struct {
+    int                 state;
+    UInt32              remaining;
+    UInt32              since;
+    UInt32              done;
+} JobState;
+
+typedef struct {
+    UInt32              criticalPath;       // ms until the last plugin is done, failed ones excluded
+    UInt32              published;          // ms the key store was published, 0 if never
+    UInt32              blocked;            // configuration thread ms spent waiting for the key store
+    int                 failed;
+    int                 ordered;            // no plugin used the key store before it was published
+} StartResult;
+
+static StartResult simulate(const Job *jobs, int count, int threads)
+{
+    JobState state[MAX_JOBS] = { { 0 } };
+    StartResult result = { 0, 0, 0, 0, 1 };
+    int busy = 0;
+    UInt32 published = 0;
+    int havePublished = 0;             // published before this millisecond
+
+    for (UInt32 t = 0; t < HORIZON; t++) {
+        // Configuration threads take matched plugins in match order
+        for (int i = 0; i < count && busy < threads; i++) {
+            if (state[i].state == kJobPending && jobs[i].ready <= t) {
+                state[i].state = kJobStarting;
+                state[i].remaining = jobs[i].startCost;
+                busy++;
+            }
+        }
+
+        int pending = 0;
+
+        // Waiters and notifications see the publish from the next millisecond on
+        if (published && !havePublished && t > published)
+            havePublished = 1;
+
+        for (int i = 0; i < count; i++) {
+            JobState *job = &state[i];
+
+            switch (job->state) {
+                case kJobStarting:
+                    if (job->remaining) {
+                        job->remaining--;
+                        break;
+                    }
+
+                    if (jobs[i].isStore) {
+                        published = t;
+                        job->state = kJobDone;
+                        job->done = t;
+                        busy--;
+                    }
+                    else if (jobs[i].waits) {
+                        job->state = kJobWaiting;
+                        job->since = t;
+                    }
+                    else {
+                        job->state = kJobCallout;
+                        job->remaining = jobs[i].storeCost;
+                        busy--;
+                    }
+                    break;
+
+                case kJobWaiting:
+                    if (!havePublished) {
+                        if (t - job->since >= WAIT_TIMEOUT) {
+                            job->state = kJobFailed;
+                            busy--;
+                        }
+                        else {
+                            result.blocked++;
+                        }
+                        break;
+                    }
+
+                    // Woken by the publish, goes on with the key store right away
+                    job->state = kJobFinishing;
+                    job->remaining = jobs[i].storeCost;
+
+                    // fall through
+                case kJobFinishing:
+                case kJobCallout:
+                    // Thread calls don't take configuration threads, they wait for the publish notification
+                    if (job->state == kJobCallout && !havePublished)
+                        break;
+
+                    if (job->remaining) {
+                        job->remaining--;
+                        break;
+                    }
+
+                    if (!havePublished || t < published)
+                        result.ordered = 0;
+
+                    if (job->state == kJobFinishing)
+                        busy--;
+
+                    job->state = kJobDone;
+                    job->done = t;
+                    break;
+            }
+
+            if (job->state != kJobDone && job->state != kJobFailed)
+                pending++;
+        }
+
+        if (!pending)
+            break;
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (state[i].state == kJobDone && state[i].done > result.criticalPath)
+            result.criticalPath = state[i].done;
+
+        if (state[i].state == kJobFailed)
+            result.failed++;
+    }
+
+    result.published = havePublished ? published : 0;
+
+    return result;
+}
+
+// Plugins of a typical install, times in ms. PTIDSensors sleeps a second before probing ACPI,
+// LPCSensors probes the Super I/O chip with short sleeps, CPUSensors reads MSRs on every core
+static const Job bootJobs[] = {
+    { "CPUSensors",         20,     2,      60,     1,  0 },
+    { "ACPISensors",        40,     1,      20,     1,  0 },
+    { "PTIDSensors",        40,     1,      1000,   1,  0 },
+    { "ACPIProbe",          40,     1,      10,     1,  0 },
+    { "LPCSensors",         60,     2,      90,     1,  0 },
+    { "GPUSensors",         120,    5,      40,     1,  0 },
+    { "FakeSMCKeyStore",    150,    20,     0,      0,  1 },
+    { "FakeSMC",            150,    1,      10,     1,  0 },
+};
+
+#define BOOT_JOBS   (int)(sizeof(bootJobs) / sizeof(bootJobs[0]))
+
+// FakeSMC itself keeps waiting in start, it loads the key store before registering the SMC device
+static void setWaiting(Job *jobs, int count, int waiting)
+{
+    for (int i = 0; i < count; i++)
+        if (!jobs[i].isStore && 0 != strcmp(jobs[i].name, "FakeSMC"))
+            jobs[i].waits = waiting;
+}
+
+static void testOrdering(void)
+{
+    Job jobs[BOOT_JOBS];
+
+    memcpy(jobs, bootJobs, sizeof(jobs));
+
+    for (int waiting = 0; waiting < 2; waiting++) {
+        setWaiting(jobs, BOOT_JOBS, waiting);
+
+        StartResult result = simulate(jobs, BOOT_JOBS, MAX_THREADS);
+
+        CHECK(result.published == 170);
+        CHECK(result.ordered);
+        CHECK(!result.failed);
+    }
+}
+
+static void testPlentyOfThreads(void)
+{
+    Job jobs[BOOT_JOBS];
+
+    memcpy(jobs, bootJobs, sizeof(jobs));
+
+    // With a thread for everyone waiting only ties up threads, the path is the same
+    setWaiting(jobs, BOOT_JOBS, 1);
+    StartResult waiting = simulate(jobs, BOOT_JOBS, MAX_THREADS);
+
+    setWaiting(jobs, BOOT_JOBS, 0);
+    StartResult early = simulate(jobs, BOOT_JOBS, MAX_THREADS);
+
+    CHECK(early.criticalPath == waiting.criticalPath);
+    CHECK(early.blocked < waiting.blocked);
+
+    // The longest plugin after the publish sets the path, PTIDSensors
+    CHECK(early.criticalPath == early.published + 1 + 1000);
+}
+
+static void testScarceThreads(void)
+{
+    Job jobs[BOOT_JOBS];
+    int threads;
+
+    memcpy(jobs, bootJobs, sizeof(jobs));
+
+    printf("  %-8s %-20s %-20s\n", "threads", "waiting in start", "startWithKeyStore");
+
+    for (threads = 1; threads <= 8; threads++) {
+        setWaiting(jobs, BOOT_JOBS, 1);
+        StartResult waiting = simulate(jobs, BOOT_JOBS, threads);
+
+        setWaiting(jobs, BOOT_JOBS, 0);
+        StartResult early = simulate(jobs, BOOT_JOBS, threads);
+
+        // Plugins returning early never keep the key store from a thread
+        CHECK(!early.failed);
+        CHECK(early.ordered && waiting.ordered);
+        CHECK(early.criticalPath <= waiting.criticalPath);
+        CHECK(early.blocked <= waiting.blocked);
+
+        printf("  %-8d %5u ms %2d failed   %5u ms %2d failed\n", threads, (unsigned int)waiting.criticalPath, waiting.failed, (unsigned int)early.criticalPath, early.failed);
+    }
+
+    // Six plugins waiting on four threads: the key store starts only once they time out
+    setWaiting(jobs, BOOT_JOBS, 1);
+    StartResult starved = simulate(jobs, BOOT_JOBS, 4);
+
+    CHECK(starved.failed > 0);
+    CHECK(starved.published >= WAIT_TIMEOUT);
+}
+
+int main(void)
+{
+    RUN(testOrdering);
+    RUN(testPlentyOfThreads);
+    RUN(testScarceThreads);
+
+    return hostTestResult("PluginStartTests");
+}
@@ -0,0 +1,196 @@
+//
+//  RingTests.c
+//  HWSensors
+//
+//  smc.h ring readers: trace records and history samples copied while a writer laps a small
+//  ring are never torn
+//
+
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "HostTest.h"
+#include "smc.h"
+
+#define SMALL_RING      16
+#define WRITES          2000000
+
+static volatile int writerDone;
+
+// Same steps as FakeSMCDevice::traceAccess, every field derived from the position
+static void traceWrite(SMCTraceRing_t *ring, UInt32 value)
+{
+    UInt32 position = __sync_fetch_and_add(&ring->head, 1);
+    SMCTraceRecord_t *record = &ring->records[position & (ring->capacity - 1)];
+
+    record->sequence = 0;
+    __sync_synchronize();
+
+    record->timestamp = (UInt64)value * 3;
+    record->key = value ^ 0x5a5a5a5a;
+    record->port = (UInt16)value;
+    record->value = (UInt8)value;
+    record->flags = (UInt8)(value >> 8);
+    record->cmd = (UInt8)(value >> 16);
+    record->status = (UInt8)(value >> 24);
+    record->pos = (UInt8)~value;
+
+    __sync_synchronize();
+    record->sequence = position + 1;
+}
+
+static int traceRecordIsWhole(const SMCTraceRecord_t *record, UInt32 value)
+{
+    return record->timestamp == (UInt64)value * 3 &&
+           record->key == (value ^ 0x5a5a5a5a) &&
+           record->port == (UInt16)value &&
+           record->value == (UInt8)value &&
+           record->flags == (UInt8)(value >> 8) &&
+           record->cmd == (UInt8)(value >> 16) &&
+           record->status == (UInt8)(value >> 24) &&
+           record->pos == (UInt8)~value;
+}
+
+static void *traceWriter(void *argument)
+{
+    SMCTraceRing_t *ring = argument;
+
+    for (UInt32 value = 0; value < WRITES; value++)
+        traceWrite(ring, value);
+
+    writerDone = 1;
+
+    return NULL;
+}
+
+// Same steps as FakeSMCSensor::recordHistory
+static void historyWrite(SMCHistoryRing_t *ring, UInt32 samples, UInt32 value)
+{
+    UInt32 position = __sync_fetch_and_add(&ring->head, 1);
+    SMCHistorySample_t *sample = &ring->samples[position & (samples - 1)];
+
+    sample->sequence = 0;
+    __sync_synchronize();
+
+    sample->timestamp = (UInt64)value * 3;
+    sample->value = (float)(value & 0xffff);
+
+    __sync_synchronize();
+    sample->sequence = position + 1;
+}
+
+static void *historyWriter(void *argument)
+{
+    SMCHistoryRing_t *ring = argument;
+
+    for (UInt32 value = 0; value < WRITES; value++)
+        historyWrite(ring, SMALL_RING, value);
+
+    writerDone = 1;
+
+    return NULL;
+}
+
+static void testTraceRecordStates(void)
+{
+    SMCTraceRing_t *ring = calloc(1, sizeof(SMCTraceRing_t));
+    SMCTraceRecord_t record;
+
+    ring->capacity = SMALL_RING;
+
+    traceWrite(ring, 0);
+    CHECK(SMCCopyTraceRecord(ring, 0, &record) && traceRecordIsWhole(&record, 0));
+
+    // Still being written: retried, then given up
+    ring->records[0].sequence = 0;
+    CHECK(!SMCCopyTraceRecord(ring, 0, &record));
+
+    // Overwritten by the next lap
+    ring->head = SMALL_RING;
+    traceWrite(ring, SMALL_RING);
+    CHECK(!SMCCopyTraceRecord(ring, 0, &record));
+    CHECK(SMCCopyTraceRecord(ring, SMALL_RING, &record) && traceRecordIsWhole(&record, SMALL_RING));
+
+    free(ring);
+}
+
+static void testTraceReaderNeverTorn(void)
+{
+    SMCTraceRing_t *ring = calloc(1, sizeof(SMCTraceRing_t));
+    UInt32 copied = 0, torn = 0;
+    pthread_t writer;
+
+    ring->capacity = SMALL_RING;
+    writerDone = 0;
+
+    pthread_create(&writer, NULL, traceWriter, ring);
+
+    while (!writerDone) {
+        UInt32 head = ring->head;
+        UInt32 position = head > ring->capacity ? head - ring->capacity : 0;
+
+        for (; position < head; position++) {
+            SMCTraceRecord_t record;
+
+            if (!SMCCopyTraceRecord(ring, position, &record))
+                continue;
+
+            copied++;
+
+            // Positions and values are the same in this test
+            if (record.sequence != position + 1 || !traceRecordIsWhole(&record, position))
+                torn++;
+        }
+    }
+
+    pthread_join(writer, NULL);
+
+    CHECK(copied > 0);
+    CHECK(torn == 0);
+
+    free(ring);
+}
+
+static void testHistoryReaderNeverTorn(void)
+{
+    SMCHistoryRing_t *ring = calloc(1, sizeof(SMCHistoryRing_t));
+    UInt32 copied = 0, torn = 0;
+    pthread_t writer;
+
+    writerDone = 0;
+
+    pthread_create(&writer, NULL, historyWriter, ring);
+
+    while (!writerDone) {
+        UInt32 head = ring->head;
+        UInt32 position = head > SMALL_RING ? head - SMALL_RING : 0;
+
+        for (; position < head; position++) {
+            SMCHistorySample_t sample;
+
+            if (!SMCCopyHistorySample(ring, SMALL_RING, position, &sample))
+                continue;
+
+            copied++;
+
+            if (sample.timestamp != (UInt64)position * 3 || sample.value != (float)(position & 0xffff))
+                torn++;
+        }
+    }
+
+    pthread_join(writer, NULL);
+
+    CHECK(copied > 0);
+    CHECK(torn == 0);
+
+    free(ring);
+}
+
+int main(void)
+{
+    RUN(testTraceRecordStates);
+    RUN(testTraceReaderNeverTorn);
+    RUN(testHistoryReaderNeverTorn);
+
+    return hostTestResult("RingTests");
+}
@@ -0,0 +1,424 @@
+//
+//  SensorBatchTests.c
+//  HWSensors
+//
+//  FakeSMCSensorBatch.h: hardware accesses per refresh of a simulated plugin read by many threads,
+//  with and without a batch read, batch reads reading keys of their own plugin, and readers of a
+//  slow sensor sampled in the background
+//
+
+#include <pthread.h>
+#include <unistd.h>
+
+#include "HostTest.h"
+#include "FakeSMCSensorBatch.h"
+
+#define MS(x)           ((UInt64)(x) * 1000000ull)
+
+#define SENSORS         16
+#define READERS         8
+#define ROUNDS          2000
+#define ROUND_TIME      MS(10)      // simulated time each reader adds after reading all sensors
+
+// Simulated chip: a bank select, then one register read per sensor
+#define SELECT_COST     1
+#define REGISTER_COST   1
+
+// Simulated slow sensor: an ACPI method taking milliseconds, sampled every demoted period
+#define SLOW_READ_US    20000
+#define SLOW_SAMPLES    10
+#define SLOW_PERIOD     5000        // kFakeSMCSensorDemotedPeriod
+
+typedef struct {
+    volatile float      value;
+    volatile UInt64     time;       // batchTime
+} SimSensor;
+
+typedef struct {
+    SimSensor           sensors[SENSORS];
+    FakeSMCSensorBatch  batch;
+    pthread_mutex_t     lock;       // batchLock
+    pthread_cond_t      wakeup;
+    int                 supported;  // implements willReadSensorValues
+    int                 nested;     // batch read reads sensor 0 through the plugin
+    volatile UInt64     accesses;
+    volatile UInt64     sweeps;
+    volatile UInt64     singleReads;
+    volatile UInt64     nestedReads;
+} SimPlugin;
+
+static volatile UInt64 simClock;
+
+static void simInit(SimPlugin *plugin, int supported, int nested)
+{
+    SimPlugin none = { { { 0 } } };
+
+    *plugin = none;
+    plugin->supported = supported;
+    plugin->nested = nested;
+
+    pthread_mutex_init(&plugin->lock, NULL);
+    pthread_cond_init(&plugin->wakeup, NULL);
+
+    simClock = MS(1000);
+}
+
+static int simIsFresh(SimPlugin *plugin, int index, float *outValue)
+{
+    SimSensor *sensor = &plugin->sensors[index];
+
+    if (!fakeSMCSensorValueIsFresh(sensor->time, 0, simClock))
+        return 0;
+
+    if (outValue)
+        *outValue = sensor->value;
+
+    return 1;
+}
+
+static int simReadSensor(SimPlugin *plugin, int index, float *outValue);
+
+// willReadSensorValues
+static int simReadSensors(SimPlugin *plugin)
+{
+    if (!plugin->supported)
+        return 0;
+
+    __sync_fetch_and_add(&plugin->sweeps, 1);
+    __sync_fetch_and_add(&plugin->accesses, SELECT_COST);
+
+    for (int index = 0; index < SENSORS; index++) {
+        if (simIsFresh(plugin, index, NULL))
+            continue;
+
+        __sync_fetch_and_add(&plugin->accesses, REGISTER_COST);
+
+        plugin->sensors[index].value = (float)index;
+        plugin->sensors[index].time = simClock;
+    }
+
+    if (plugin->nested) {
+        float value;
+
+        plugin->sensors[0].time = 0;
+
+        if (simReadSensor(plugin, 0, &value))
+            __sync_fetch_and_add(&plugin->nestedReads, 1);
+    }
+
+    return 1;
+}
+
+// FakeSMCPlugin::readSensorValue with beginBatchRead and endBatchRead
+static int simReadSensor(SimPlugin *plugin, int index, float *outValue)
+{
+    int action;
+
+    if (simIsFresh(plugin, index, outValue))
+        return 1;
+
+    pthread_mutex_lock(&plugin->lock);
+
+    while (kFakeSMCSensorBatchWait == (action = fakeSMCSensorBatchBegin(&plugin->batch, (void *)pthread_self(), simIsFresh(plugin, index, outValue))))
+        pthread_cond_wait(&plugin->wakeup, &plugin->lock);
+
+    pthread_mutex_unlock(&plugin->lock);
+
+    switch (action) {
+        case kFakeSMCSensorBatchUseValue:
+            return 1;
+
+        case kFakeSMCSensorBatchRead: {
+            int supported = simReadSensors(plugin);
+
+            pthread_mutex_lock(&plugin->lock);
+            fakeSMCSensorBatchEnd(&plugin->batch, supported);
+            pthread_cond_broadcast(&plugin->wakeup);
+            pthread_mutex_unlock(&plugin->lock);
+
+            if (simIsFresh(plugin, index, outValue))
+                return 1;
+
+            break;
+        }
+    }
+
+    // willReadSensorValue, FakeSMCKey keeps the value as long as a batch value
+    __sync_fetch_and_add(&plugin->singleReads, 1);
+    __sync_fetch_and_add(&plugin->accesses, SELECT_COST + REGISTER_COST);
+
+    plugin->sensors[index].value = (float)index;
+    plugin->sensors[index].time = simClock;
+
+    *outValue = (float)index;
+
+    return 1;
+}
+
+static void *simReader(void *argument)
+{
+    SimPlugin *plugin = argument;
+
+    for (int round = 0; round < ROUNDS; round++) {
+        for (int index = 0; index < SENSORS; index++) {
+            float value = -1;
+
+            if (!simReadSensor(plugin, index, &value) || value != (float)index)
+                __sync_fetch_and_add(&plugin->accesses, 1000000);
+        }
+
+        __sync_fetch_and_add(&simClock, ROUND_TIME);
+    }
+
+    return NULL;
+}
+
+// Hardware accesses per value lifetime of simulated time
+static double simRun(SimPlugin *plugin)
+{
+    pthread_t readers[READERS];
+    UInt64 started = simClock;
+
+    for (int i = 0; i < READERS; i++)
+        pthread_create(&readers[i], NULL, simReader, plugin);
+
+    for (int i = 0; i < READERS; i++)
+        pthread_join(readers[i], NULL);
+
+    return (double)plugin->accesses * kFakeSMCSensorBatchValueLifetime / (double)(simClock - started);
+}
+
+static void testFreshness(void)
+{
+    CHECK(!fakeSMCSensorValueIsFresh(0, 0, MS(100)));
+    CHECK(fakeSMCSensorValueIsFresh(MS(100), 0, MS(599)));
+    CHECK(!fakeSMCSensorValueIsFresh(MS(100), 0, MS(600)));
+
+    // Sampled every second: fresh until the sample after next is overdue
+    CHECK(fakeSMCSensorValueIsFresh(MS(100), 1000, MS(2099)));
+    CHECK(!fakeSMCSensorValueIsFresh(MS(100), 1000, MS(2100)));
+}
+
+static void testBatchStates(void)
+{
+    FakeSMCSensorBatch batch = { 0 };
+    int first, second;
+
+    CHECK(fakeSMCSensorBatchBegin(&batch, &first, 1) == kFakeSMCSensorBatchUseValue);
+    CHECK(fakeSMCSensorBatchBegin(&batch, &first, 0) == kFakeSMCSensorBatchRead);
+    CHECK(fakeSMCSensorBatchBegin(&batch, &second, 0) == kFakeSMCSensorBatchWait);
+    CHECK(fakeSMCSensorBatchBegin(&batch, &second, 1) == kFakeSMCSensorBatchUseValue);
+
+    // Reading a key of its own plugin from the batch
+    CHECK(fakeSMCSensorBatchBegin(&batch, &first, 0) == kFakeSMCSensorBatchReadOne);
+
+    fakeSMCSensorBatchEnd(&batch, 1);
+    CHECK(fakeSMCSensorBatchBegin(&batch, &second, 0) == kFakeSMCSensorBatchRead);
+
+    fakeSMCSensorBatchEnd(&batch, 0);
+    CHECK(fakeSMCSensorBatchBegin(&batch, &first, 0) == kFakeSMCSensorBatchReadOne);
+    CHECK(batch.thread == 0);
+}
+
+static void testAccessesPerRefresh(void)
+{
+    SimPlugin batched, single;
+    double batchedAccesses, singleAccesses;
+    UInt64 windows;
+
+    simInit(&batched, 1, 0);
+    batchedAccesses = simRun(&batched);
+    windows = (UInt64)READERS * ROUNDS * ROUND_TIME / kFakeSMCSensorBatchValueLifetime;
+
+    // Sweeps start only once a value is stale, so no more than one per value lifetime
+    CHECK(batched.singleReads == 0);
+    CHECK(batched.sweeps <= windows + 1);
+    CHECK(batched.accesses <= batched.sweeps * (SELECT_COST + SENSORS * REGISTER_COST));
+
+    simInit(&single, 0, 0);
+    singleAccesses = simRun(&single);
+
+    // The first read finds out the plugin has no batch read, every sensor is read alone from then on
+    CHECK(single.sweeps == 0);
+    CHECK(singleAccesses > batchedAccesses);
+
+    printf("  %.1f hardware accesses per refresh batched, %.1f one by one\n", batchedAccesses, singleAccesses);
+}
+
+static void testNestedRead(void)
+{
+    SimPlugin plugin;
+
+    simInit(&plugin, 1, 1);
+    simRun(&plugin);
+
+    // Served one by one on the thread running the batch instead of waiting on itself
+    CHECK(plugin.sweeps > 0);
+    CHECK(plugin.nestedReads == plugin.sweeps);
+    CHECK(plugin.singleReads == plugin.sweeps);
+}
+
+typedef struct {
+    pthread_mutex_t     lock;       // FakeSMCSensor valueLock
+    float               value;
+    UInt64              time;       // batchTime
+    int                 demoted;
+    volatile int        sampling;
+    volatile UInt64     slowReads;  // on the reader threads
+    volatile UInt64     reads;
+    volatile UInt64     failed;
+    volatile UInt64     latency;    // total of the reader threads, nanoseconds
+    volatile UInt64     maxLatency;
+} SlowSensor;
+
+static float slowRead(void)
+{
+    usleep(SLOW_READ_US);
+
+    return 42.0f;
+}
+
+// FakeSMCPlugin::readSensorValue past the fresh value check, the batch read is left out
+static int slowReadSensor(SlowSensor *sensor, UInt64 time, float *outValue)
+{
+    int action;
+
+    pthread_mutex_lock(&sensor->lock);
+
+    if (fakeSMCSensorValueIsFresh(sensor->time, SLOW_PERIOD, time)) {
+        *outValue = sensor->value;
+        pthread_mutex_unlock(&sensor->lock);
+        return 1;
+    }
+
+    if (kFakeSMCSensorStaleServe == (action = fakeSMCSensorStaleAction(sensor->demoted, sensor->time)))
+        *outValue = sensor->value;
+
+    pthread_mutex_unlock(&sensor->lock);
+
+    switch (action) {
+        case kFakeSMCSensorStaleServe:
+            return 1;
+
+        case kFakeSMCSensorStaleFail:
+            return 0;
+    }
+
+    __sync_fetch_and_add(&sensor->slowReads, 1);
+
+    *outValue = slowRead();
+
+    return 1;
+}
+
+// Demotion timer
+static void *slowSampler(void *argument)
+{
+    SlowSensor *sensor = argument;
+
+    for (int sample = 0; sample < SLOW_SAMPLES; sample++) {
+        float value = slowRead();
+
+        pthread_mutex_lock(&sensor->lock);
+        sensor->value = value;
+        sensor->time = simClock;
+        pthread_mutex_unlock(&sensor->lock);
+    }
+
+    sensor->sampling = 0;
+
+    return NULL;
+}
+
+static void *slowReader(void *argument)
+{
+    SlowSensor *sensor = argument;
+
+    while (sensor->sampling) {
+        float value;
+        UInt64 started = hostTestNanoseconds();
+
+        if (!slowReadSensor(sensor, __sync_add_and_fetch(&simClock, MS(100)), &value))
+            __sync_fetch_and_add(&sensor->failed, 1);
+
+        UInt64 latency = hostTestNanoseconds() - started;
+
+        __sync_fetch_and_add(&sensor->reads, 1);
+        __sync_fetch_and_add(&sensor->latency, latency);
+
+        UInt64 max = sensor->maxLatency;
+
+        while (latency > max && !__sync_bool_compare_and_swap(&sensor->maxLatency, max, latency))
+            max = sensor->maxLatency;
+
+        usleep(100);
+    }
+
+    return NULL;
+}
+
+static void testStaleAction(void)
+{
+    CHECK(fakeSMCSensorStaleAction(0, 0) == kFakeSMCSensorStaleRead);
+    CHECK(fakeSMCSensorStaleAction(0, MS(100)) == kFakeSMCSensorStaleRead);
+    CHECK(fakeSMCSensorStaleAction(1, 0) == kFakeSMCSensorStaleFail);
+    CHECK(fakeSMCSensorStaleAction(1, MS(100)) == kFakeSMCSensorStaleServe);
+}
+
+static void testSlowSensor(void)
+{
+    SlowSensor sensor = { PTHREAD_MUTEX_INITIALIZER };
+    pthread_t sampler, readers[READERS];
+    float value;
+
+    simClock = MS(1000);
+
+    // Demoted before its first sample: fails without touching the hardware
+    sensor.demoted = 1;
+
+    UInt64 started = hostTestNanoseconds();
+
+    CHECK(!slowReadSensor(&sensor, simClock, &value));
+    CHECK(sensor.slowReads == 0);
+    CHECK(hostTestNanoseconds() - started < (UInt64)SLOW_READ_US * 1000 / 2);
+
+    // Readers keep the simulated clock running, so the samples go stale between two of them
+    sensor.sampling = 1;
+
+    pthread_create(&sampler, NULL, slowSampler, &sensor);
+
+    for (int i = 0; i < READERS; i++)
+        pthread_create(&readers[i], NULL, slowReader, &sensor);
+
+    pthread_join(sampler, NULL);
+
+    for (int i = 0; i < READERS; i++)
+        pthread_join(readers[i], NULL);
+
+    // Served the last sample however old, never read on the reader threads
+    CHECK(sensor.reads > 0);
+    CHECK(sensor.slowReads == 0);
+    CHECK(!fakeSMCSensorValueIsFresh(sensor.time, SLOW_PERIOD, simClock + MS(2 * SLOW_PERIOD)));
+    CHECK(slowReadSensor(&sensor, simClock + MS(2 * SLOW_PERIOD), &value) && value == 42.0f);
+    CHECK(sensor.latency / sensor.reads < (UInt64)SLOW_READ_US * 1000 / 10);
+
+    printf("  %llu reads of a sensor taking %d ms, %.1f us average, %.1f us at most, %llu before the first sample\n", (unsigned long long)sensor.reads, SLOW_READ_US / 1000, (double)sensor.latency / sensor.reads / 1000.0, (double)sensor.maxLatency / 1000.0, (unsigned long long)sensor.failed);
+
+    // Read on demand a stale value goes to the hardware
+    sensor.demoted = 0;
+
+    CHECK(slowReadSensor(&sensor, simClock + MS(2 * SLOW_PERIOD), &value) && value == 42.0f);
+    CHECK(sensor.slowReads == 1);
+}
+
+int main(void)
+{
+    RUN(testFreshness);
+    RUN(testBatchStates);
+    RUN(testAccessesPerRefresh);
+    RUN(testNestedRead);
+    RUN(testStaleAction);
+    RUN(testSlowSensor);
+
+    return hostTestResult("SensorBatchTests");
+}
@@ -0,0 +1,218 @@
+//
+//  SyntheticTests.c
+//  HWSensors
+//
+//  SyntheticScenario.h: value patterns, read latency and failure rates of the SyntheticSensors load
+//  profiles, and per read random states of sensors read from many threads at once
+//
+
+#include <math.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "HostTest.h"
+#include "SyntheticScenario.h"
+
+#define DRAWS           100000
+#define THREADS         8
+#define THREAD_READS    100000
+
+static void testRandom(void)
+{
+    uint32_t state = syntheticScenarioSeed(0), first = state;
+    int ones = 0;
+
+    CHECK(state != 0);
+
+    // xorshift32 never reaches 0 and doesn't come back to its seed any time soon
+    for (int i = 0; i < DRAWS; i++) {
+        uint32_t x = syntheticScenarioRandom(&state);
+
+        CHECK(x != 0 && x != first);
+
+        ones += x & 1;
+    }
+
+    CHECK(abs(ones - DRAWS / 2) < DRAWS / 50);
+}
+
+static void testSine(void)
+{
+    double worst = 0;
+
+    for (int i = 0; i < 1000; i++) {
+        float turn = i / 1000.0f;
+        double error = fabs(syntheticScenarioSine(turn) - sin(turn * 2 * M_PI));
+
+        if (error > worst)
+            worst = error;
+    }
+
+    CHECK(worst < 0.002);
+
+    printf("  %.4f worst sine error\n", worst);
+}
+
+static void testPatterns(void)
+{
+    SyntheticScenario scenario = { kSyntheticPatternConstant, 40, 10, 1000 };
+    uint32_t state = syntheticScenarioSeed(0);
+
+    CHECK(syntheticScenarioValue(&scenario, &state, 0, 0) == 40);
+    CHECK(syntheticScenarioValue(&scenario, &state, 5, 12345) == 40);
+
+    scenario.pattern = kSyntheticPatternRamp;
+
+    CHECK(syntheticScenarioValue(&scenario, &state, 0, 0) == 40);
+    CHECK(syntheticScenarioValue(&scenario, &state, 0, 500) == 45);
+    CHECK(syntheticScenarioValue(&scenario, &state, 0, 1000) == 40);
+
+    // Sensors are shifted by a sixteenth of the period per index
+    CHECK(syntheticScenarioValue(&scenario, &state, 8, 0) == 45);
+
+    scenario.pattern = kSyntheticPatternSine;
+
+    CHECK(fabsf(syntheticScenarioValue(&scenario, &state, 0, 250) - 50) < 0.01f);
+    CHECK(fabsf(syntheticScenarioValue(&scenario, &state, 0, 750) - 30) < 0.01f);
+
+    scenario.pattern = kSyntheticPatternRandom;
+
+    for (int i = 0; i < DRAWS; i++) {
+        float value = syntheticScenarioValue(&scenario, &state, 0, 0);
+
+        CHECK(value >= 30 && value <= 50);
+    }
+
+    // No period, no movement
+    scenario.pattern = kSyntheticPatternRamp;
+    scenario.period = 0;
+
+    CHECK(syntheticScenarioValue(&scenario, &state, 3, 777) == 40);
+}
+
+static void testLatency(void)
+{
+    SyntheticScenario scenario = { kSyntheticPatternConstant, 0, 0, 0, 100, 200, 50, 5000 };
+    uint32_t state = syntheticScenarioSeed(0);
+    int slow = 0;
+
+    for (int i = 0; i < DRAWS; i++) {
+        uint32_t latency = syntheticScenarioLatency(&scenario, &state);
+
+        if (latency == scenario.slowReadLatency)
+            slow++;
+        else
+            CHECK(latency >= scenario.latencyMin && latency <= scenario.latencyMax);
+    }
+
+    // 50 per mille
+    CHECK(abs(slow - DRAWS / 20) < DRAWS / 200);
+
+    scenario.slowReadRate = 0;
+    scenario.latencyMax = 0;
+
+    CHECK(syntheticScenarioLatency(&scenario, &state) == scenario.latencyMin);
+}
+
+static void testFailures(void)
+{
+    SyntheticScenario scenario = { 0 };
+    uint32_t state = syntheticScenarioSeed(0);
+    int failures = 0;
+
+    CHECK(!syntheticScenarioShouldFail(&scenario, &state));
+
+    scenario.failureRate = 100;
+
+    for (int i = 0; i < DRAWS; i++)
+        failures += syntheticScenarioShouldFail(&scenario, &state);
+
+    CHECK(abs(failures - DRAWS / 10) < DRAWS / 100);
+
+    scenario.failureRate = 1000;
+
+    CHECK(syntheticScenarioShouldFail(&scenario, &state));
+}
+
+static void testReadStates(void)
+{
+    uint32_t previous = 0;
+    int repeats = 0;
+
+    // Never 0, and neighbouring reads and sensors don't share states
+    for (uint32_t index = 0; index < 64; index++) {
+        for (uint32_t read = 0; read < 1000; read++) {
+            uint32_t state = syntheticScenarioReadState(index, read);
+
+            CHECK(state != 0);
+
+            repeats += state == previous;
+            previous = state;
+        }
+
+        CHECK(syntheticScenarioReadState(index, 0) != syntheticScenarioReadState(index + 1, 0));
+    }
+
+    CHECK(repeats == 0);
+    CHECK(syntheticScenarioReadState(7, 42) == syntheticScenarioReadState(7, 42));
+}
+
+// Reads of one sensor from many threads, numbered the way SyntheticSensors does
+static volatile int32_t sensorReads;
+static uint32_t states[THREADS * THREAD_READS];
+
+static void *readSensor(void *argument)
+{
+    for (int i = 0; i < THREAD_READS; i++) {
+        uint32_t read = (uint32_t)__sync_fetch_and_add(&sensorReads, 1);
+
+        states[read] = syntheticScenarioReadState(3, read);
+    }
+
+    return NULL;
+}
+
+static int compareStates(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a, y = *(const uint32_t *)b;
+
+    return x < y ? -1 : x > y;
+}
+
+static void testConcurrentReads(void)
+{
+    pthread_t threads[THREADS];
+    int duplicates = 0;
+
+    for (int i = 0; i < THREADS; i++)
+        pthread_create(&threads[i], NULL, readSensor, NULL);
+
+    for (int i = 0; i < THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    CHECK(sensorReads == THREADS * THREAD_READS);
+
+    // Every read got a number of its own, so a state of its own
+    for (int i = 0; i < THREADS * THREAD_READS; i++)
+        CHECK(states[i] == syntheticScenarioReadState(3, i));
+
+    qsort(states, THREADS * THREAD_READS, sizeof(states[0]), compareStates);
+
+    for (int i = 1; i < THREADS * THREAD_READS; i++)
+        duplicates += states[i] == states[i - 1];
+
+    CHECK(duplicates == 0);
+}
+
+int main(void)
+{
+    RUN(testRandom);
+    RUN(testSine);
+    RUN(testPatterns);
+    RUN(testLatency);
+    RUN(testFailures);
+    RUN(testReadStates);
+    RUN(testConcurrentReads);
+
+    return hostTestResult("SyntheticTests");
+}
@@ -0,0 +1,160 @@
+//
+//  ThresholdTests.c
+//  HWSensors
+//
+//  FakeSMCKeyThreshold.h: hysteresis, rate events and adding, replacing and removing rules
+//
+
+#include "HostTest.h"
+#include "FakeSMCKeyThreshold.h"
+
+#define MS(x)   ((UInt64)(x) * 1000000ull)
+
+static SMCKeyThreshold_t rule(UInt32 flags, float high, float low, float hysteresis, float rate)
+{
+    SMCKeyThreshold_t r = { flags, high, low, hysteresis, rate };
+    return r;
+}
+
+static UInt32 feed(FakeSMCKeyThreshold *threshold, float value, UInt64 time, UInt32 *event)
+{
+    FakeSMCKeyThresholdCrossings crossings;
+    UInt32 count = fakeSMCKeyThresholdEvaluate(threshold, value, time, &crossings);
+
+    if (event)
+        *event = count ? crossings.events[0] : 0xff;
+
+    return count;
+}
+
+static void testHighHysteresis(void)
+{
+    FakeSMCKeyThreshold threshold = { { 0 } };
+    SMCKeyThreshold_t r = rule(SMC_THRESHOLD_HIGH, 80, 0, 5, 0);
+    UInt32 event;
+
+    fakeSMCKeyThresholdSetRule(&threshold, &r);
+
+    CHECK(feed(&threshold, 70, MS(1), &event) == 0);
+    CHECK(feed(&threshold, 80, MS(2), &event) == 1 && event == SMC_THRESHOLD_EVENT_HIGH);
+
+    // Still alarmed while above high minus hysteresis, no repeated events
+    CHECK(feed(&threshold, 90, MS(3), &event) == 0);
+    CHECK(feed(&threshold, 79, MS(4), &event) == 0);
+    CHECK(feed(&threshold, 75.5f, MS(5), &event) == 0);
+    CHECK(threshold.state == SMC_THRESHOLD_EVENT_HIGH);
+
+    CHECK(feed(&threshold, 74.9f, MS(6), &event) == 1 && event == SMC_THRESHOLD_EVENT_NORMAL);
+    CHECK(feed(&threshold, 79, MS(7), &event) == 0);
+    CHECK(feed(&threshold, 81, MS(8), &event) == 1 && event == SMC_THRESHOLD_EVENT_HIGH);
+}
+
+static void testLowHysteresis(void)
+{
+    FakeSMCKeyThreshold threshold = { { 0 } };
+    SMCKeyThreshold_t r = rule(SMC_THRESHOLD_LOW | SMC_THRESHOLD_HIGH, 100, 10, 2, 0);
+    UInt32 event;
+
+    fakeSMCKeyThresholdSetRule(&threshold, &r);
+
+    CHECK(feed(&threshold, 10, MS(1), &event) == 1 && event == SMC_THRESHOLD_EVENT_LOW);
+    CHECK(feed(&threshold, 11.5f, MS(2), &event) == 0);
+    CHECK(feed(&threshold, 12.5f, MS(3), &event) == 1 && event == SMC_THRESHOLD_EVENT_NORMAL);
+
+    // Straight from low to high alarm is one event
+    CHECK(feed(&threshold, 5, MS(4), &event) == 1 && event == SMC_THRESHOLD_EVENT_LOW);
+    CHECK(feed(&threshold, 120, MS(5), &event) == 1 && event == SMC_THRESHOLD_EVENT_HIGH);
+}
+
+static void testRate(void)
+{
+    FakeSMCKeyThreshold threshold = { { 0 } };
+    SMCKeyThreshold_t r = rule(SMC_THRESHOLD_RATE, 0, 0, 0, 10);
+    UInt32 event;
+
+    fakeSMCKeyThresholdSetRule(&threshold, &r);
+
+    // First sample only primes the rate
+    CHECK(feed(&threshold, 50, MS(1000), &event) == 0);
+    CHECK(feed(&threshold, 55, MS(2000), &event) == 0);
+
+    // 20 per second, reported once until the rate drops
+    CHECK(feed(&threshold, 65, MS(2500), &event) == 1 && event == SMC_THRESHOLD_EVENT_RATE);
+    CHECK(feed(&threshold, 55, MS(3000), &event) == 0);
+    CHECK(feed(&threshold, 56, MS(4000), &event) == 0);
+    CHECK(feed(&threshold, 36, MS(5000), &event) == 1 && event == SMC_THRESHOLD_EVENT_RATE);
+
+    // Same timestamp gives no rate
+    CHECK(feed(&threshold, 0, MS(5000), &event) == 0);
+}
+
+static void testLevelAndRateTogether(void)
+{
+    FakeSMCKeyThreshold threshold = { { 0 } };
+    SMCKeyThreshold_t r = rule(SMC_THRESHOLD_HIGH | SMC_THRESHOLD_RATE, 80, 0, 0, 10);
+    FakeSMCKeyThresholdCrossings crossings;
+
+    fakeSMCKeyThresholdSetRule(&threshold, &r);
+
+    CHECK(fakeSMCKeyThresholdEvaluate(&threshold, 40, MS(1000), &crossings) == 0);
+    CHECK(fakeSMCKeyThresholdEvaluate(&threshold, 90, MS(2000), &crossings) == 2);
+    CHECK(crossings.events[0] == SMC_THRESHOLD_EVENT_HIGH);
+    CHECK(crossings.events[1] == SMC_THRESHOLD_EVENT_RATE);
+    CHECK(crossings.value == 90);
+}
+
+static void testAddReplaceRemove(void)
+{
+    FakeSMCKeyThreshold threshold = { { 0 } };
+    SMCKeyThreshold_t high = rule(SMC_THRESHOLD_HIGH, 80, 0, 0, 0);
+    SMCKeyThreshold_t higher = rule(SMC_THRESHOLD_HIGH, 95, 0, 0, 0);
+    SMCKeyThreshold_t lowOnly = rule(SMC_THRESHOLD_LOW, 0, 10, 0, 0);
+    SMCKeyThreshold_t none = rule(0, 0, 0, 0, 0);
+    UInt32 event;
+
+    // No rule, nothing reported
+    CHECK(feed(&threshold, 1000, MS(1), &event) == 0);
+
+    // Added while the value is already beyond the limit: reported on the first evaluation
+    fakeSMCKeyThresholdSetRule(&threshold, &high);
+    CHECK(threshold.state == SMC_THRESHOLD_EVENT_NORMAL);
+    CHECK(feed(&threshold, 90, MS(2), &event) == 1 && event == SMC_THRESHOLD_EVENT_HIGH);
+
+    // Replaced: the alarm is kept, the next value is judged against the new limit
+    fakeSMCKeyThresholdSetRule(&threshold, &higher);
+    CHECK(threshold.state == SMC_THRESHOLD_EVENT_HIGH);
+    CHECK(threshold.rule.high == 95);
+    CHECK(feed(&threshold, 90, MS(3), &event) == 1 && event == SMC_THRESHOLD_EVENT_NORMAL);
+    CHECK(feed(&threshold, 96, MS(4), &event) == 1 && event == SMC_THRESHOLD_EVENT_HIGH);
+
+    // Replaced by a rule without the high limit: alarm clears on the next evaluation
+    fakeSMCKeyThresholdSetRule(&threshold, &lowOnly);
+    CHECK(feed(&threshold, 96, MS(5), &event) == 1 && event == SMC_THRESHOLD_EVENT_NORMAL);
+
+    // Removed: state is dropped and nothing is reported any more
+    fakeSMCKeyThresholdSetRule(&threshold, &high);
+    CHECK(feed(&threshold, 5, MS(6), &event) == 0);
+    fakeSMCKeyThresholdSetRule(&threshold, &none);
+    CHECK(threshold.rule.flags == 0 && threshold.state == SMC_THRESHOLD_EVENT_NORMAL && threshold.lastTime == 0);
+    CHECK(feed(&threshold, 1000, MS(7), &event) == 0);
+    CHECK(feed(&threshold, -1000, MS(8), &event) == 0);
+
+    fakeSMCKeyThresholdSetRule(&threshold, &high);
+    fakeSMCKeyThresholdSetRule(&threshold, 0);
+    CHECK(threshold.rule.flags == 0);
+
+    // Re-added after removal starts from normal
+    fakeSMCKeyThresholdSetRule(&threshold, &high);
+    CHECK(feed(&threshold, 85, MS(9), &event) == 1 && event == SMC_THRESHOLD_EVENT_HIGH);
+}
+
+int main(void)
+{
+    RUN(testHighHysteresis);
+    RUN(testLowHysteresis);
+    RUN(testRate);
+    RUN(testLevelAndRateTogether);
+    RUN(testAddReplaceRemove);
+
+    return hostTestResult("ThresholdTests");
+}
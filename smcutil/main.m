@@ -27,6 +27,7 @@
 
 #import <Foundation/Foundation.h>
 #import <stdio.h>
+#import <mach/mach_time.h>
 
 #import "SmcHelper.h"
 
@@ -37,6 +38,8 @@
 #define OPTION_READ     2
 #define OPTION_WRITE    3
 #define OPTION_HELP     4
+#define OPTION_TRACE    5
+#define OPTION_HISTORY  6
 
 void usage(const char* prog)
 {
@@ -45,6 +48,8 @@ void usage(const char* prog)
     printf("%s [options]\n", prog);
     printf("    -l         : list of all keys\n");
     printf("    -r <key>   : show key value\n");
+    printf("    -t         : dump SMC port trace (FakeSMC trace enabled, root)\n");
+    printf("    -g         : dump sensor history\n");
     printf("    -h         : help\n");
     printf("\n");
 }
@@ -83,6 +88,109 @@ bool printKeyValue(SMCVal_t val)
     return false;
 }
 
+int printTrace(void)
+{
+    io_connect_t connection;
+    mach_vm_address_t address = 0;
+    mach_vm_size_t size = 0;
+
+    if (kIOReturnSuccess != SMCOpen("FakeSMCKeyStore", &connection)) {
+        printf("failed to connect to FakeSMCKeyStore!\n");
+        return 1;
+    }
+
+    if (kIOReturnSuccess != IOConnectMapMemory64(connection, SMC_TRACE_RING_MEMORY, mach_task_self(), &address, &size, kIOMapAnywhere)) {
+        printf("trace is not available, is FakeSMC trace enabled?\n");
+        SMCClose(connection);
+        return 1;
+    }
+
+    const SMCTraceRing_t *ring = (const SMCTraceRing_t *)address;
+    mach_timebase_info_data_t timebase;
+    UInt32 head = ring->head;
+    UInt32 position = head > ring->capacity ? head - ring->capacity : 0;
+    UInt64 start = 0;
+
+    mach_timebase_info(&timebase);
+
+    for (; position < head; position++) {
+        SMCTraceRecord_t record;
+
+        // Overwritten while reading
+        if (!SMCCopyTraceRecord(ring, position, &record))
+            continue;
+
+        if (!start)
+            start = record.timestamp;
+
+        char key[5];
+
+        _ultostr(key, record.key);
+
+        printf("%12.3f  %s %03x  %02x  cmd %02x  status %02x  pos %3d  %-4s%s\n",
+               (double)(record.timestamp - start) * timebase.numer / timebase.denom / 1000.0,
+               record.flags & SMC_TRACE_WRITE ? "W" : "R",
+               record.port,
+               record.value,
+               record.cmd,
+               record.status,
+               record.pos,
+               key,
+               record.flags & SMC_TRACE_ERROR ? "  error" : "");
+    }
+
+    IOConnectUnmapMemory64(connection, SMC_TRACE_RING_MEMORY, mach_task_self(), address);
+    SMCClose(connection);
+
+    return 0;
+}
+
+int printHistory(void)
+{
+    io_connect_t connection;
+    mach_vm_address_t address = 0;
+    mach_vm_size_t size = 0;
+
+    if (kIOReturnSuccess != SMCOpen("FakeSMCKeyStore", &connection)) {
+        printf("failed to connect to FakeSMCKeyStore!\n");
+        return 1;
+    }
+
+    if (kIOReturnSuccess != IOConnectMapMemory64(connection, SMC_HISTORY_MEMORY, mach_task_self(), &address, &size, kIOMapAnywhere)) {
+        printf("no sensors keep history\n");
+        SMCClose(connection);
+        return 1;
+    }
+
+    const SMCHistoryBuffer_t *buffer = (const SMCHistoryBuffer_t *)address;
+
+    for (UInt32 index = 0; index < buffer->count; index++) {
+        const SMCHistoryRing_t *ring = &buffer->rings[index];
+        UInt32 head = ring->head;
+        UInt32 position = head > buffer->samples ? head - buffer->samples : 0;
+        char key[5];
+
+        _ultostr(key, ring->key);
+
+        printf("%-4s  period %u ms\n", key, (unsigned int)ring->period);
+
+        for (; position < head; position++) {
+            SMCHistorySample_t sample;
+
+            // Overwritten while reading
+            if (!SMCCopyHistorySample(ring, buffer->samples, position, &sample))
+                continue;
+
+            printf("  %14.3f  %.3f\n", (double)sample.timestamp / 1000000000.0, sample.value);
+        }
+    }
+
+    IOConnectUnmapMemory64(connection, SMC_HISTORY_MEMORY, mach_task_self(), address);
+    SMCClose(connection);
+
+    return 0;
+}
+
 void printValueBytes(SMCVal_t val)
 {
     printf("(bytes");
@@ -106,7 +214,7 @@ int main(int argc, const char * argv[])
 
         option = OPTION_HELP;
         
-        while ((c = getopt(argc, argv, "lr")) != -1)
+        while ((c = getopt(argc, argv, "lrtg")) != -1)
         {
             switch(c)
             {
@@ -119,6 +227,12 @@ int main(int argc, const char * argv[])
                 case 'w':
                     option = OPTION_WRITE;
                     break;
+                case 't':
+                    option = OPTION_TRACE;
+                    break;
+                case 'g':
+                    option = OPTION_HISTORY;
+                    break;
                 case 'h':
                 case '?':
                 default:
@@ -127,6 +241,12 @@ int main(int argc, const char * argv[])
             }
         }
         
+        if (option == OPTION_TRACE)
+            return printTrace();
+
+        if (option == OPTION_HISTORY)
+            return printHistory();
+
         io_connect_t connection;
         
         if (kIOReturnSuccess == SMCOpen("AppleSMC", &connection)) {